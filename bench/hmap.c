@@ -0,0 +1,924 @@
+#include "bench.h"
+
+#include "basic.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+struct key32 { uint64_t w[4]; };
+struct val64 { uint64_t w[8]; };
+
+// Bijective, so distinct indices give distinct keys.
+static inline uint64_t mix64(uint64_t x) {
+  x += 0x9e3779b97f4a7c15lu;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9lu;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eblu;
+  return x ^ (x >> 31);
+}
+
+static inline uint32_t key_u32(size_t i) {
+  return cast(uint32_t, i) * 2654435761u;
+}
+
+static inline uint64_t key_u64(size_t i) {
+  return mix64(i);
+}
+
+static inline struct key32 key_k32(size_t i) {
+  return new(struct key32, .w = { mix64(i), i, ~i, 0 });
+}
+
+static inline struct val64 val_v64(size_t i) {
+  return new(struct val64, .w = { i, i, i, i, i, i, i, i });
+}
+
+// Define a function NAME timing inserts, hits and misses of N keys in MAP.
+/////
+// KEY_OF and VAL_OF make the key and value of an index, BYTES_OF(MAP, TABLE)
+// is the footprint of a table's arrays.
+#define HMAP_BENCH_FUN(NAME, MAP, KEY_OF, VAL_OF, BYTES_OF)		\
+  static void NAME(const char* name, size_t n) {			\
+    char label[64];							\
+    size_t i;								\
+    struct MAP map = MAP ## _new();					\
+									\
+    snprintf(label, sizeof(label), "%s insert", name);			\
+    bench_measure(label, n,						\
+      range_foreach(i, 0, n) {						\
+	__auto_type key = KEY_OF(i);					\
+	__auto_type val = VAL_OF(i);					\
+	bench_sink(MAP ## _insert(&map, &key, &val));			\
+      });								\
+									\
+    snprintf(label, sizeof(label), "%s get hit", name);			\
+    bench_measure(label, n,						\
+      range_foreach(i, 0, n) {						\
+	__auto_type key = KEY_OF(i);					\
+	bench_sink(MAP ## _get(&map, &key));				\
+      });								\
+									\
+    snprintf(label, sizeof(label), "%s get miss", name);		\
+    bench_measure(label, n,						\
+      range_foreach(i, n, 2 * n) {					\
+	__auto_type key = KEY_OF(i);					\
+	bench_sink(MAP ## _get(&map, &key));				\
+      });								\
+									\
+    snprintf(label, sizeof(label), "%s bytes/entry", name);		\
+    bench_note(label, "%.1f",						\
+	       cast(double, BYTES_OF(MAP, &map))				\
+	       / cast(double, n));					\
+    MAP ## _destroy(&map);						\
+  }
+
+static inline uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return cast(uint64_t, ts.tv_sec) * 1000000000lu + cast(uint64_t, ts.tv_nsec);
+}
+
+static int cmp_u64(const void* lhs, const void* rhs) {
+  uint64_t l = *cast(const uint64_t*, lhs), r = *cast(const uint64_t*, rhs);
+  return (l > r) - (l < r);
+}
+
+// Define a function NAME timing each of N inserts into MAP, reporting the tail.
+#define HMAP_LATENCY_FUN(NAME, MAP, KEY_OF)				\
+  static void NAME(const char* name, size_t n) {			\
+    char label[64];							\
+    size_t i;								\
+    uint64_t* lat = sys_malloc_array(uint64_t, n);			\
+    struct MAP map = MAP ## _new();					\
+									\
+    snprintf(label, sizeof(label), "%s insert", name);			\
+    bench_measure(label, n,						\
+      range_foreach(i, 0, n) {						\
+	__auto_type key = KEY_OF(i);					\
+	uint64_t before = now_ns();					\
+	bench_sink(MAP ## _insert(&map, &key, &key));			\
+	lat[i] = now_ns() - before;					\
+      });								\
+									\
+    qsort(lat, n, sizeof(*lat), cmp_u64);				\
+    snprintf(label, sizeof(label), "%s p99.9", name);			\
+    bench_note(label, "%lu ns", lat[n - n / 1000]);			\
+    snprintf(label, sizeof(label), "%s p99.99", name);			\
+    bench_note(label, "%lu ns", lat[n - n / 10000]);			\
+    snprintf(label, sizeof(label), "%s max", name);			\
+    bench_note(label, "%.3f ms", cast(double, lat[n - 1]) / 1e6);	\
+    MAP ## _destroy(&map);						\
+    free(lat);								\
+  }
+
+// Define a function NAME timing single against batched operations on N keys of
+// MAP, a u64 to u64 map.
+#define HMAP_BATCH_FUN(NAME, MAP)					\
+  static void NAME(const char* name, size_t n) {			\
+    char label[64];							\
+    size_t i;								\
+    uint64_t* keys = sys_malloc_array(uint64_t, n);			\
+    uint64_t** out = sys_malloc_array(uint64_t*, n);			\
+    struct MAP map = MAP ## _new();					\
+    struct MAP batch = MAP ## _new();					\
+    range_foreach(i, 0, n) {						\
+      keys[i] = key_u64(i);						\
+    }									\
+									\
+    snprintf(label, sizeof(label), "%s insert", name);			\
+    bench_measure(label, n,						\
+      range_foreach(i, 0, n) {						\
+	bench_sink(MAP ## _insert(&map, &keys[i], &keys[i]));		\
+      });								\
+    snprintf(label, sizeof(label), "%s insert_batch", name);		\
+    bench_measure(label, n,						\
+      bench_sink(MAP ## _insert_batch(&batch, n, keys, keys)));	\
+									\
+    snprintf(label, sizeof(label), "%s get", name);			\
+    bench_measure(label, n,						\
+      range_foreach(i, 0, n) {						\
+	out[i] = MAP ## _get(&map, &keys[i]);				\
+      });								\
+    bench_sink(out[n - 1]);						\
+    snprintf(label, sizeof(label), "%s get_batch", name);		\
+    bench_measure(label, n, MAP ## _get_batch(&map, n, keys, out));	\
+    bench_sink(out[n - 1]);						\
+									\
+    MAP ## _destroy(&batch);						\
+    MAP ## _destroy(&map);						\
+    free(out);								\
+    free(keys);								\
+  }
+
+#define HMAP_AOS_BYTES(MAP, TABLE)					\
+  (MAP ## __num_slots(TABLE) * sizeof(struct MAP ## __bucket))
+#define HMAP_SOA_BYTES(MAP, TABLE)					\
+  (MAP ## __num_slots(TABLE)						\
+   * (sizeof(struct MAP ## __bucket) + sizeof(struct MAP ## __meta)))
+#define HMAP_SWISS_BYTES(MAP, TABLE)					\
+  (MAP ## __num_slots(TABLE) * (sizeof(struct MAP ## __bucket) + 1))
+#define HMAP_ORDERED_BYTES(MAP, TABLE)					\
+  ((TABLE)->cap * sizeof(struct MAP ## __bucket)			\
+   + ((TABLE)->mask + 1) * sizeof(uint32_t))
+
+////////////////////////////////////////////////////////////////////////////////
+// Layouts
+
+#define HMAP_NAME map_u32_u32
+#define HMAP_KEY_TYPE uint32_t
+#define HMAP_VAL_TYPE uint32_t
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u32_u32, map_u32_u32, key_u32, key_u32, HMAP_AOS_BYTES);
+
+#define HMAP_NAME map_u32_u32_soa
+#define HMAP_KEY_TYPE uint32_t
+#define HMAP_VAL_TYPE uint32_t
+#define HMAP_SOA
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u32_u32_soa, map_u32_u32_soa, key_u32, key_u32,
+	       HMAP_SOA_BYTES);
+
+#define HMAP_NAME map_u64_u64
+#define HMAP_KEY_TYPE uint64_t
+#define HMAP_VAL_TYPE uint64_t
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u64_u64, map_u64_u64, key_u64, key_u64, HMAP_AOS_BYTES);
+
+#define HMAP_NAME map_u64_u64_soa
+#define HMAP_KEY_TYPE uint64_t
+#define HMAP_VAL_TYPE uint64_t
+#define HMAP_SOA
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u64_u64_soa, map_u64_u64_soa, key_u64, key_u64,
+	       HMAP_SOA_BYTES);
+
+#define HMAP_NAME map_u64_v64
+#define HMAP_KEY_TYPE uint64_t
+#define HMAP_VAL_TYPE struct val64
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u64_v64, map_u64_v64, key_u64, val_v64, HMAP_AOS_BYTES);
+
+#define HMAP_NAME map_u64_v64_soa
+#define HMAP_KEY_TYPE uint64_t
+#define HMAP_VAL_TYPE struct val64
+#define HMAP_SOA
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u64_v64_soa, map_u64_v64_soa, key_u64, val_v64,
+	       HMAP_SOA_BYTES);
+
+#define HMAP_NAME map_k32_u64
+#define HMAP_KEY_TYPE struct key32
+#define HMAP_VAL_TYPE uint64_t
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_k32_u64, map_k32_u64, key_k32, key_u64, HMAP_AOS_BYTES);
+
+#define HMAP_NAME map_k32_u64_soa
+#define HMAP_KEY_TYPE struct key32
+#define HMAP_VAL_TYPE uint64_t
+#define HMAP_SOA
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_k32_u64_soa, map_k32_u64_soa, key_k32, key_u64,
+	       HMAP_SOA_BYTES);
+
+////////////////////////////////////////////////////////////////////////////////
+// Engines
+
+#define HMAP_NAME map_u32_u32_swiss
+#define HMAP_KEY_TYPE uint32_t
+#define HMAP_VAL_TYPE uint32_t
+#define HMAP_SWISS
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u32_u32_swiss, map_u32_u32_swiss, key_u32, key_u32,
+	       HMAP_SWISS_BYTES);
+
+#define HMAP_NAME map_u64_u64_swiss
+#define HMAP_KEY_TYPE uint64_t
+#define HMAP_VAL_TYPE uint64_t
+#define HMAP_SWISS
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u64_u64_swiss, map_u64_u64_swiss, key_u64, key_u64,
+	       HMAP_SWISS_BYTES);
+
+#define HMAP_NAME map_k32_u64_swiss
+#define HMAP_KEY_TYPE struct key32
+#define HMAP_VAL_TYPE uint64_t
+#define HMAP_SWISS
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_k32_u64_swiss, map_k32_u64_swiss, key_k32, key_u64,
+	       HMAP_SWISS_BYTES);
+
+#define HMAP_NAME map_u32_u32_ordered
+#define HMAP_KEY_TYPE uint32_t
+#define HMAP_VAL_TYPE uint32_t
+#define HMAP_ORDERED
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u32_u32_ordered, map_u32_u32_ordered, key_u32, key_u32,
+	       HMAP_ORDERED_BYTES);
+
+#define HMAP_NAME map_u64_u64_ordered
+#define HMAP_KEY_TYPE uint64_t
+#define HMAP_VAL_TYPE uint64_t
+#define HMAP_ORDERED
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u64_u64_ordered, map_u64_u64_ordered, key_u64, key_u64,
+	       HMAP_ORDERED_BYTES);
+
+#define HMAP_NAME map_k32_u64_ordered
+#define HMAP_KEY_TYPE struct key32
+#define HMAP_VAL_TYPE uint64_t
+#define HMAP_ORDERED
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_k32_u64_ordered, map_k32_u64_ordered, key_k32, key_u64,
+	       HMAP_ORDERED_BYTES);
+
+////////////////////////////////////////////////////////////////////////////////
+// Index reduction
+
+#define HMAP_NAME map_u32_u32_fastmod
+#define HMAP_KEY_TYPE uint32_t
+#define HMAP_VAL_TYPE uint32_t
+#define HMAP_SOA
+#define HMAP_FASTMOD
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u32_u32_fastmod, map_u32_u32_fastmod, key_u32, key_u32,
+	       HMAP_SOA_BYTES);
+
+#define HMAP_NAME map_u32_u32_pow2
+#define HMAP_KEY_TYPE uint32_t
+#define HMAP_VAL_TYPE uint32_t
+#define HMAP_SOA
+#define HMAP_POW2
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u32_u32_pow2, map_u32_u32_pow2, key_u32, key_u32,
+	       HMAP_SOA_BYTES);
+
+#define HMAP_NAME map_u64_u64_fastmod
+#define HMAP_KEY_TYPE uint64_t
+#define HMAP_VAL_TYPE uint64_t
+#define HMAP_SOA
+#define HMAP_FASTMOD
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u64_u64_fastmod, map_u64_u64_fastmod, key_u64, key_u64,
+	       HMAP_SOA_BYTES);
+
+#define HMAP_NAME map_u64_u64_pow2
+#define HMAP_KEY_TYPE uint64_t
+#define HMAP_VAL_TYPE uint64_t
+#define HMAP_SOA
+#define HMAP_POW2
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u64_u64_pow2, map_u64_u64_pow2, key_u64, key_u64,
+	       HMAP_SOA_BYTES);
+
+////////////////////////////////////////////////////////////////////////////////
+// Stored hashes
+
+#define HMAP_NAME map_u32_u32_frag
+#define HMAP_KEY_TYPE uint32_t
+#define HMAP_VAL_TYPE uint32_t
+#define HMAP_STORED_HASH HMAP_HASH_FRAG
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u32_u32_frag, map_u32_u32_frag, key_u32, key_u32,
+	       HMAP_AOS_BYTES);
+
+#define HMAP_NAME map_u32_u32_nohash
+#define HMAP_KEY_TYPE uint32_t
+#define HMAP_VAL_TYPE uint32_t
+#define HMAP_STORED_HASH HMAP_HASH_NONE
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u32_u32_nohash, map_u32_u32_nohash, key_u32, key_u32,
+	       HMAP_AOS_BYTES);
+
+#define HMAP_NAME map_u64_u64_frag
+#define HMAP_KEY_TYPE uint64_t
+#define HMAP_VAL_TYPE uint64_t
+#define HMAP_STORED_HASH HMAP_HASH_FRAG
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u64_u64_frag, map_u64_u64_frag, key_u64, key_u64,
+	       HMAP_AOS_BYTES);
+
+#define HMAP_NAME map_u64_u64_nohash
+#define HMAP_KEY_TYPE uint64_t
+#define HMAP_VAL_TYPE uint64_t
+#define HMAP_STORED_HASH HMAP_HASH_NONE
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u64_u64_nohash, map_u64_u64_nohash, key_u64, key_u64,
+	       HMAP_AOS_BYTES);
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocators
+
+#define HMAP_NAME map_u64_u64_huge
+#define HMAP_KEY_TYPE uint64_t
+#define HMAP_VAL_TYPE uint64_t
+#define HMAP_HUGE
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u64_u64_huge, map_u64_u64_huge, key_u64, key_u64,
+	       HMAP_AOS_BYTES);
+
+////////////////////////////////////////////////////////////////////////////////
+// Growth
+
+HMAP_LATENCY_FUN(latency_u64_u64_soa, map_u64_u64_soa, key_u64);
+
+#define HMAP_NAME map_u64_u64_incremental
+#define HMAP_KEY_TYPE uint64_t
+#define HMAP_VAL_TYPE uint64_t
+#define HMAP_SOA
+#define HMAP_INCREMENTAL
+#include "hmap.h"
+HMAP_BENCH_FUN(bench_u64_u64_incremental, map_u64_u64_incremental, key_u64,
+	       key_u64, HMAP_SOA_BYTES);
+HMAP_LATENCY_FUN(latency_u64_u64_incremental, map_u64_u64_incremental, key_u64);
+
+////////////////////////////////////////////////////////////////////////////////
+// Load factors
+
+// Define a function NAME noting the probe statistics of N keys in MAP, a u64
+// to u64 map, and timing hits before and after erasing all but 1 in 16.
+#define HMAP_LOAD_FUN(NAME, MAP)					\
+  static void NAME(const char* name, size_t n) {			\
+    char label[64];							\
+    size_t i;								\
+    struct MAP map = MAP ## _new();					\
+    range_foreach(i, 0, n) {						\
+      uint64_t key = key_u64(i);					\
+      MAP ## _insert(&map, &key, &key);					\
+    }									\
+									\
+    struct hmap_stats stats = MAP ## _stats(&map);			\
+    size_t total = 0;							\
+    range_foreach(i, 0, HMAP_STATS_DISTS) {				\
+      total += i * stats.dists[i];					\
+    }									\
+    snprintf(label, sizeof(label), "%s load", name);			\
+    bench_note(label, "%.2f", cast(double, stats.load));		\
+    snprintf(label, sizeof(label), "%s mean dist", name);		\
+    bench_note(label, "%.2f", cast(double, total) / cast(double, n));	\
+    snprintf(label, sizeof(label), "%s max dist", name);		\
+    bench_note(label, "%lu", stats.max_dist);				\
+    snprintf(label, sizeof(label), "%s get hit", name);			\
+    bench_measure(label, n,						\
+      range_foreach(i, 0, n) {						\
+	uint64_t key = key_u64(i);					\
+	bench_sink(MAP ## _get(&map, &key));				\
+      });								\
+									\
+    range_foreach(i, 0, n) {						\
+      uint64_t key = key_u64(i);					\
+      if (i % 16 != 0) {						\
+	MAP ## _erase(&map, &key);					\
+      }									\
+    }									\
+    stats = MAP ## _stats(&map);					\
+    snprintf(label, sizeof(label), "%s erased bytes/entry", name);	\
+    bench_note(label, "%.1f",						\
+	       cast(double, stats.bytes) / cast(double, stats.num_items)); \
+    snprintf(label, sizeof(label), "%s erased get hit", name);		\
+    bench_measure(label, n / 16,					\
+      for (i = 0; i < n; i += 16) {					\
+	uint64_t key = key_u64(i);					\
+	bench_sink(MAP ## _get(&map, &key));				\
+      });								\
+    MAP ## _destroy(&map);						\
+  }
+
+#define HMAP_NAME map_u64_u64_lf70
+#define HMAP_KEY_TYPE uint64_t
+#define HMAP_VAL_TYPE uint64_t
+#define HMAP_SOA
+#define HMAP_LOAD_FACTOR 0.70f
+#include "hmap.h"
+HMAP_LOAD_FUN(load_u64_u64_lf70, map_u64_u64_lf70);
+
+#define HMAP_NAME map_u64_u64_lf80
+#define HMAP_KEY_TYPE uint64_t
+#define HMAP_VAL_TYPE uint64_t
+#define HMAP_SOA
+#define HMAP_LOAD_FACTOR 0.80f
+#include "hmap.h"
+HMAP_LOAD_FUN(load_u64_u64_lf80, map_u64_u64_lf80);
+
+#define HMAP_NAME map_u64_u64_lf95
+#define HMAP_KEY_TYPE uint64_t
+#define HMAP_VAL_TYPE uint64_t
+#define HMAP_SOA
+#define HMAP_LOAD_FACTOR 0.95f
+#include "hmap.h"
+HMAP_LOAD_FUN(load_u64_u64_lf95, map_u64_u64_lf95);
+
+HMAP_LOAD_FUN(load_u64_u64_soa, map_u64_u64_soa);
+HMAP_LOAD_FUN(load_u64_u64_swiss, map_u64_u64_swiss);
+
+////////////////////////////////////////////////////////////////////////////////
+// Images
+
+#define HMAP_NAME map_u64_u64_file
+#define HMAP_KEY_TYPE uint64_t
+#define HMAP_VAL_TYPE uint64_t
+#define HMAP_SOA
+#define HMAP_FILE
+#include "hmap.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Batches
+
+HMAP_BATCH_FUN(batch_u64_u64_soa, map_u64_u64_soa);
+HMAP_BATCH_FUN(batch_u64_u64_swiss, map_u64_u64_swiss);
+
+////////////////////////////////////////////////////////////////////////////////
+// Entries
+
+// Define a function NAME timing inserts and counter updates of N keys in MAP, a
+// u64 to 64 byte map, by copy and through entries.
+#define HMAP_ENTRY_FUN(NAME, MAP)					\
+  static void NAME(const char* name, size_t n) {			\
+    char label[64];							\
+    size_t i;								\
+    uint64_t* word;							\
+    /* Reserved, so that growing doesn't drown the copies. */		\
+    struct MAP map = MAP ## _new_reserve(n + n / 2);			\
+    struct MAP entries = MAP ## _new_reserve(n + n / 2);		\
+									\
+    snprintf(label, sizeof(label), "%s insert", name);			\
+    bench_measure(label, n,						\
+      range_foreach(i, 0, n) {						\
+	uint64_t key = key_u64(i);					\
+	struct val64 val = val_v64(i);					\
+	bench_sink(MAP ## _insert(&map, &key, &val));			\
+      });								\
+    snprintf(label, sizeof(label), "%s entry", name);			\
+    bench_measure(label, n,						\
+      range_foreach(i, 0, n) {						\
+	uint64_t key = key_u64(i);					\
+	bool fresh;							\
+	struct val64* val = MAP ## _entry(&entries, &key, &fresh);	\
+	array_foreach(word, 8, val->w) {				\
+	  *word = i;						\
+	}								\
+      });								\
+									\
+    /* Bump a word of every value, half of them absent. */		\
+    snprintf(label, sizeof(label), "%s get + insert", name);		\
+    bench_measure(label, n,						\
+      range_foreach(i, n / 2, n + n / 2) {				\
+	uint64_t key = key_u64(i);					\
+	struct val64* val = MAP ## _get(&map, &key);			\
+	if (val != NULL) {						\
+	  ++val->w[0];							\
+	} else {							\
+	  struct val64 init = val_v64(i);				\
+	  MAP ## _insert(&map, &key, &init);				\
+	}								\
+      });								\
+    snprintf(label, sizeof(label), "%s entry upsert", name);		\
+    bench_measure(label, n,						\
+      range_foreach(i, n / 2, n + n / 2) {				\
+	uint64_t key = key_u64(i);					\
+	bool fresh;							\
+	struct val64* val = MAP ## _entry(&entries, &key, &fresh);	\
+	if (!fresh) {							\
+	  ++val->w[0];							\
+	} else {							\
+	  array_foreach(word, 8, val->w) {			\
+	    *word = i;						\
+	  }								\
+	}								\
+      });								\
+									\
+    MAP ## _destroy(&entries);						\
+    MAP ## _destroy(&map);						\
+  }
+
+#define HMAP_NAME map_u64_v64_swiss
+#define HMAP_KEY_TYPE uint64_t
+#define HMAP_VAL_TYPE struct val64
+#define HMAP_SWISS
+#include "hmap.h"
+
+HMAP_ENTRY_FUN(entry_u64_v64, map_u64_v64);
+HMAP_ENTRY_FUN(entry_u64_v64_soa, map_u64_v64_soa);
+HMAP_ENTRY_FUN(entry_u64_v64_swiss, map_u64_v64_swiss);
+
+////////////////////////////////////////////////////////////////////////////////
+// Iteration
+
+static bool sum_visitor(const uint64_t* key, uint64_t* val, void* arg) {
+  IGNORE(key);
+  *cast(uint64_t*, arg) += *val;
+  return false;
+}
+
+// Define a function NAME summing the values of N keys in MAP, a u64 to u64
+// map, by visitor and by iterator, full and with 7 of 8 keys erased.
+#define HMAP_ITER_FUN(NAME, MAP)					\
+  static void NAME(const char* name, size_t n) {			\
+    char label[64];							\
+    size_t i;								\
+    struct MAP map = MAP ## _new();					\
+    range_foreach(i, 0, n) {						\
+      uint64_t key = key_u64(i);					\
+      MAP ## _insert(&map, &key, &key);					\
+    }									\
+									\
+    for (int sparse = 0; sparse < 2; ++sparse) {			\
+      uint64_t sum = 0;							\
+      snprintf(label, sizeof(label), "%s%s foreach", name,		\
+	       sparse ? " sparse" : "");				\
+      bench_measure(label, n, MAP ## _foreach(&map, sum_visitor, &sum)); \
+      bench_sink(sum);							\
+									\
+      sum = 0;								\
+      snprintf(label, sizeof(label), "%s%s iter", name,			\
+	       sparse ? " sparse" : "");				\
+      bench_measure(label, n,						\
+	struct MAP ## _iter iter = MAP ## _iter(&map);			\
+	while (MAP ## _iter_next(&iter)) {				\
+	  sum += *MAP ## _iter_val(&iter);				\
+	});								\
+      bench_sink(sum);							\
+									\
+      range_foreach(i, 0, n) {						\
+	uint64_t key = key_u64(i);					\
+	if (i % 8 != 0) {						\
+	  MAP ## _erase(&map, &key);					\
+	}								\
+      }									\
+    }									\
+    MAP ## _destroy(&map);						\
+  }
+
+HMAP_ITER_FUN(iter_u64_u64, map_u64_u64);
+HMAP_ITER_FUN(iter_u64_u64_soa, map_u64_u64_soa);
+HMAP_ITER_FUN(iter_u64_u64_swiss, map_u64_u64_swiss);
+HMAP_ITER_FUN(iter_u64_u64_ordered, map_u64_u64_ordered);
+
+////////////////////////////////////////////////////////////////////////////////
+// Concurrency
+
+#define HMAP_NAME map_u64_u64_conc
+#define HMAP_KEY_TYPE uint64_t
+#define HMAP_VAL_TYPE uint64_t
+#define HMAP_CONCURRENT
+#include "hmap.h"
+
+struct conc_bench_arg {
+  struct map_u64_u64_conc* map;
+  struct map_u64_u64_swiss* locked; // Baseline, behind LOCK.
+  pthread_rwlock_t* lock;
+  atomic_bool* stop;
+  size_t n;     // Keys in the map.
+  size_t first; // First key looked up.
+  size_t gets;
+};
+
+static void* conc_bench_get(void* arg_) {
+  struct conc_bench_arg* arg = arg_;
+  size_t i;
+  range_foreach(i, 0, arg->gets) {
+    uint64_t key = key_u64((arg->first + i) % arg->n), val;
+    bench_sink(map_u64_u64_conc_get_copy(arg->map, &key, &val));
+  }
+  return NULL;
+}
+
+static void* locked_bench_get(void* arg_) {
+  struct conc_bench_arg* arg = arg_;
+  size_t i;
+  range_foreach(i, 0, arg->gets) {
+    uint64_t key = key_u64((arg->first + i) % arg->n);
+    pthread_rwlock_rdlock(arg->lock);
+    bench_sink(map_u64_u64_swiss_get(arg->locked, &key));
+    pthread_rwlock_unlock(arg->lock);
+  }
+  return NULL;
+}
+
+// Erase and insert keys past the looked up ones until stopped.
+static void* conc_bench_churn(void* arg_) {
+  struct conc_bench_arg* arg = arg_;
+  for (size_t i = 0; !atomic_load_explicit(arg->stop, memory_order_relaxed); ++i) {
+    uint64_t key = key_u64(arg->n + i % 4096);
+    if (!map_u64_u64_conc_erase(arg->map, &key)) {
+      map_u64_u64_conc_insert(arg->map, &key, &key);
+    }
+  }
+  return NULL;
+}
+
+// Time GETS lookups on each of THREADS threads running FUN over ARG.
+static void conc_bench_run(const char* name, size_t threads, void* (*fun)(void*),
+			   struct conc_bench_arg arg) {
+  pthread_t* ids = sys_malloc_array(pthread_t, threads);
+  struct conc_bench_arg* args = sys_malloc_array(struct conc_bench_arg, threads);
+  size_t i;
+  bench_measure(name, threads * arg.gets,
+    range_foreach(i, 0, threads) {
+      args[i] = arg;
+      args[i].first = i * (arg.n / threads);
+      pthread_create(&ids[i], NULL, fun, &args[i]);
+    }
+    range_foreach(i, 0, threads) {
+      pthread_join(ids[i], NULL);
+    });
+  free(args);
+  free(ids);
+}
+
+BENCH_DECL(bench_hmap_layout, r) {
+  IGNORE(r);
+  static const size_t N = 1lu << 20;
+
+  bench_u32_u32("u32:u32 aos", N);
+  bench_u32_u32_soa("u32:u32 soa", N);
+  bench_u64_u64("u64:u64 aos", N);
+  bench_u64_u64_soa("u64:u64 soa", N);
+  bench_u64_v64("u64:64B aos", N);
+  bench_u64_v64_soa("u64:64B soa", N);
+  bench_k32_u64("32B:u64 aos", N);
+  bench_k32_u64_soa("32B:u64 soa", N);
+}
+
+// Lookup-heavy comparison of the engines at the default load factor of 0.9.
+/////
+// The ordered engine caps the load of its index at 0.75.
+BENCH_DECL(bench_hmap_engine, r) {
+  IGNORE(r);
+  static const size_t N = 1lu << 20;
+
+  bench_u32_u32_soa("u32:u32 robin soa", N);
+  bench_u32_u32_swiss("u32:u32 swiss", N);
+  bench_u32_u32_ordered("u32:u32 ordered", N);
+  bench_u64_u64_soa("u64:u64 robin soa", N);
+  bench_u64_u64_swiss("u64:u64 swiss", N);
+  bench_u64_u64_ordered("u64:u64 ordered", N);
+  bench_k32_u64_soa("32B:u64 robin soa", N);
+  bench_k32_u64_swiss("32B:u64 swiss", N);
+  bench_k32_u64_ordered("32B:u64 ordered", N);
+}
+
+// Home slots by division, by reciprocal and by power of two, on SoA tables.
+/////
+// A small table fits in cache, where finding the home slot is most of a lookup.
+BENCH_DECL(bench_hmap_index, r) {
+  IGNORE(r);
+  static const size_t SMALL = 1lu << 14;
+  static const size_t N = 1lu << 20;
+
+  bench_u64_u64_soa("16K u64:u64 modulo", SMALL);
+  bench_u64_u64_fastmod("16K u64:u64 fastmod", SMALL);
+  bench_u64_u64_pow2("16K u64:u64 pow2", SMALL);
+  bench_u32_u32_soa("u32:u32 modulo", N);
+  bench_u32_u32_fastmod("u32:u32 fastmod", N);
+  bench_u32_u32_pow2("u32:u32 pow2", N);
+  bench_u64_u64_soa("u64:u64 modulo", N);
+  bench_u64_u64_fastmod("u64:u64 fastmod", N);
+  bench_u64_u64_pow2("u64:u64 pow2", N);
+}
+
+// AoS slots keeping the full hash, a byte of it, or none of it.
+BENCH_DECL(bench_hmap_stored_hash, r) {
+  IGNORE(r);
+  static const size_t N = 1lu << 20;
+
+  bench_u32_u32("u32:u32 full hash", N);
+  bench_u32_u32_frag("u32:u32 hash byte", N);
+  bench_u32_u32_nohash("u32:u32 no hash", N);
+  bench_u64_u64("u64:u64 full hash", N);
+  bench_u64_u64_frag("u64:u64 hash byte", N);
+  bench_u64_u64_nohash("u64:u64 no hash", N);
+}
+
+// Tables well beyond the LLC from malloc and on transparent huge pages.
+BENCH_DECL(bench_hmap_alloc, r) {
+  IGNORE(r);
+  static const size_t BIG = 4lu << 20;
+
+  bench_u64_u64("4M u64:u64 malloc", BIG);
+  bench_u64_u64_huge("4M u64:u64 huge pages", BIG);
+}
+
+// Latency of single inserts while growing at once or incrementally.
+BENCH_DECL(bench_hmap_growth, r) {
+  IGNORE(r);
+  static const size_t N = 1lu << 20;
+  static const size_t BIG = 10lu << 20;
+
+  bench_u64_u64_soa("u64:u64 at once", N);
+  bench_u64_u64_incremental("u64:u64 incremental", N);
+  latency_u64_u64_soa("10M at once", BIG);
+  latency_u64_u64_incremental("10M incremental", BIG);
+}
+
+// Probe lengths of robinhood SoA maps by load factor, and the swiss engine at
+// the default. Erasing most keys shrinks the maps.
+BENCH_DECL(bench_hmap_load, r) {
+  IGNORE(r);
+  static const size_t N = 1lu << 20;
+
+  load_u64_u64_lf70("u64:u64 0.7", N);
+  load_u64_u64_lf80("u64:u64 0.8", N);
+  load_u64_u64_soa("u64:u64 0.9", N);
+  load_u64_u64_lf95("u64:u64 0.95", N);
+  load_u64_u64_swiss("u64:u64 swiss 0.9", N);
+}
+
+// Building a map against loading its image, and the first lookups into the
+// image, whose pages come from the page cache.
+BENCH_DECL(bench_hmap_file, r) {
+  static const size_t N = 4lu << 20;
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/kc_hmap_bench_%d", getpid());
+  struct map_u64_u64_file map = map_u64_u64_file_new();
+  struct file_error err;
+  size_t i;
+
+  bench_measure("4M u64:u64 build", 1,
+    range_foreach(i, 0, N) {
+      uint64_t key = key_u64(i);
+      map_u64_u64_file_insert(&map, &key, &key);
+    });
+  bench_measure("4M u64:u64 save", 1, err = map_u64_u64_file_save(&map, path));
+  map_u64_u64_file_destroy(&map);
+  if (is_error(&err)) {
+    file_error_print(stderr, &err);
+    return;
+  }
+
+  struct map_u64_u64_file loaded;
+  bench_measure("4M u64:u64 load", 1,
+		err = map_u64_u64_file_load(r, path, &loaded));
+  unlink(path);
+  if (is_error(&err)) {
+    file_error_print(stderr, &err);
+    return;
+  }
+  bench_measure("4M u64:u64 first get hit", N,
+    range_foreach(i, 0, N) {
+      uint64_t key = key_u64(i);
+      bench_sink(map_u64_u64_file_get(&loaded, &key));
+    });
+  bench_measure("4M u64:u64 get hit", N,
+    range_foreach(i, 0, N) {
+      uint64_t key = key_u64(i);
+      bench_sink(map_u64_u64_file_get(&loaded, &key));
+    });
+}
+
+// Single against batched operations, in cache and well beyond the LLC.
+BENCH_DECL(bench_hmap_batch, r) {
+  IGNORE(r);
+  static const size_t SMALL = 1lu << 14;
+  static const size_t BIG = 16lu << 20;
+
+  batch_u64_u64_soa("16K robin soa", SMALL);
+  batch_u64_u64_swiss("16K swiss", SMALL);
+  batch_u64_u64_soa("16M robin soa", BIG);
+  batch_u64_u64_swiss("16M swiss", BIG);
+}
+
+// Copying values in against building them in place, and updates by lookup
+// then insert against a single entry probe.
+BENCH_DECL(bench_hmap_entry, r) {
+  IGNORE(r);
+  static const size_t N = 1lu << 20;
+
+  entry_u64_v64("u64:64B aos", N);
+  entry_u64_v64_soa("u64:64B soa", N);
+  entry_u64_v64_swiss("u64:64B swiss", N);
+}
+
+// Summing values by visitor and by inlined iterator, against a plain array.
+/////
+// Times are per key inserted, so the sparse runs show the cost of skipping
+// empty slots.
+BENCH_DECL(bench_hmap_iter, r) {
+  IGNORE(r);
+  static const size_t N = 1lu << 20;
+  uint64_t* vals = sys_malloc_array(uint64_t, N);
+  uint64_t sum = 0;
+  size_t i;
+
+  range_foreach(i, 0, N) {
+    vals[i] = key_u64(i);
+  }
+  bench_measure("u64 array", N,
+    range_foreach(i, 0, N) {
+      sum += vals[i];
+    });
+  bench_sink(sum);
+  free(vals);
+
+  iter_u64_u64("u64:u64 aos", N);
+  iter_u64_u64_soa("u64:u64 soa", N);
+  iter_u64_u64_swiss("u64:u64 swiss", N);
+  iter_u64_u64_ordered("u64:u64 ordered", N);
+}
+
+// Lookup throughput from 1 up to one thread per online CPU, against a swiss
+// map behind a readers-writer lock, and while another thread keeps writing.
+/////
+// Reported per lookup over all threads, so scaling shows as falling ns/iter.
+BENCH_DECL(bench_hmap_concurrent, r) {
+  IGNORE(r);
+  static const size_t N = 1lu << 20;
+  static const size_t GETS = 4lu << 20;
+  size_t cpus = cast(size_t, max(sysconf(_SC_NPROCESSORS_ONLN), 1l));
+  char label[64];
+  size_t i, threads;
+
+  struct map_u64_u64_conc map = map_u64_u64_conc_new();
+  struct map_u64_u64_swiss locked = map_u64_u64_swiss_new();
+  pthread_rwlock_t lock;
+  pthread_rwlock_init(&lock, NULL);
+  atomic_bool stop = false;
+  range_foreach(i, 0, N) {
+    uint64_t key = key_u64(i);
+    map_u64_u64_conc_insert(&map, &key, &key);
+    map_u64_u64_swiss_insert(&locked, &key, &key);
+  }
+  struct conc_bench_arg arg = {
+    .map = &map, .locked = &locked, .lock = &lock, .stop = &stop, .n = N,
+    .gets = GETS,
+  };
+
+  bench_note("online cpus", "%lu", cpus);
+  for (threads = 1;; threads = min(2 * threads, cpus)) {
+    snprintf(label, sizeof(label), "%lu threads concurrent", threads);
+    conc_bench_run(label, threads, conc_bench_get, arg);
+    snprintf(label, sizeof(label), "%lu threads rwlock swiss", threads);
+    conc_bench_run(label, threads, locked_bench_get, arg);
+
+    pthread_t writer;
+    pthread_create(&writer, NULL, conc_bench_churn, &arg);
+    snprintf(label, sizeof(label), "%lu threads + writer", threads);
+    conc_bench_run(label, threads, conc_bench_get, arg);
+    atomic_store(&stop, true);
+    pthread_join(writer, NULL);
+    atomic_store(&stop, false);
+    if (threads == cpus) {
+      break;
+    }
+  }
+
+  pthread_rwlock_destroy(&lock);
+  map_u64_u64_swiss_destroy(&locked);
+  map_u64_u64_conc_destroy(&map);
+}
+
+BENCH_SUITE_DECL(hmap_bench,
+  bench_add(bench_hmap_layout),
+  bench_add(bench_hmap_engine),
+  bench_add(bench_hmap_index),
+  bench_add(bench_hmap_stored_hash),
+  bench_add(bench_hmap_alloc),
+  bench_add(bench_hmap_growth),
+  bench_add(bench_hmap_load),
+  bench_add(bench_hmap_file),
+  bench_add(bench_hmap_batch),
+  bench_add(bench_hmap_entry),
+  bench_add(bench_hmap_iter),
+  bench_add(bench_hmap_concurrent));
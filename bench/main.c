@@ -0,0 +1,4 @@
+// Dummy
+int main() {
+  return 0;
+}
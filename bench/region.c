@@ -0,0 +1,176 @@
+#include "bench.h"
+
+#include "region.h"
+
+static size_t region_footprint(region_t r) {
+  return r_stats(r).reserved;
+}
+
+struct vec4 { double v[4]; };
+
+BENCH_DECL(bench_alignment_padding, r) {
+  static const size_t N = 100000;
+  size_t i;
+
+  region_t packed = r_create();
+  bench_measure("r_malloc_bytes (unaligned)", N,
+    range_foreach(i, 0, N) {
+      bench_sink(r_malloc_bytes(packed, 3));
+      bench_sink(r_malloc_bytes(packed, sizeof(struct vec4)));
+    });
+
+  region_t natural = r_create();
+  bench_measure("r_malloc (natural)", N,
+    range_foreach(i, 0, N) {
+      bench_sink(r_malloc_bytes(natural, 3));
+      bench_sink(r_malloc(natural, struct vec4));
+    });
+
+  region_t lines = r_create();
+  bench_measure("r_malloc_aligned (64)", N,
+    range_foreach(i, 0, N) {
+      bench_sink(r_malloc_bytes(lines, 3));
+      bench_sink(r_malloc_aligned(lines, sizeof(struct vec4), 64));
+    });
+
+  size_t base = region_footprint(packed);
+  bench_note("footprint unaligned", "%lu bytes", base);
+  bench_note("footprint natural", "%lu bytes (+%.1f%%)",
+	     region_footprint(natural),
+	     100.0 * cast(double, region_footprint(natural) - base) / cast(double, base));
+  bench_note("footprint 64-aligned", "%lu bytes (+%.1f%%)",
+	     region_footprint(lines),
+	     100.0 * cast(double, region_footprint(lines) - base) / cast(double, base));
+
+  r_destroy(packed);
+  r_destroy(natural);
+  r_destroy(lines);
+  IGNORE(r);
+}
+
+static uint32_t __attribute__((noinline))
+sum_u32(const uint32_t* xs, size_t n) {
+  uint32_t sum = 0;
+  size_t i;
+  range_foreach(i, 0, n) {
+    sum += xs[i];
+  }
+  return sum;
+}
+
+static uint32_t __attribute__((noinline))
+sum_u32_aligned(const uint32_t* xs_, size_t n) {
+  const uint32_t* xs = __builtin_assume_aligned(xs_, 64);
+  uint32_t sum = 0;
+  size_t i;
+  range_foreach(i, 0, n) {
+    sum += xs[i];
+  }
+  return sum;
+}
+
+static void fill_u32(uint32_t* xs, size_t n) {
+  size_t i;
+  range_foreach(i, 0, n) {
+    xs[i] = cast(uint32_t, i);
+  }
+}
+
+BENCH_DECL(bench_alignment_kernel, r) {
+  static const size_t LEN = 4096;
+  static const size_t REPS = 20000;
+  size_t i;
+
+  // Offset by one byte, as unaligned bump allocation used to hand out.
+  char* raw = r_malloc_bytes(r, LEN * sizeof(uint32_t) + 1);
+  uint32_t* split = cast(pointer(uint32_t), cast(void*, raw + 1));
+  uint32_t* natural = r_malloc_aligned(r, LEN * sizeof(uint32_t),
+				       alignof(uint32_t));
+  uint32_t* lines = r_malloc_aligned(r, LEN * sizeof(uint32_t), 64);
+  fill_u32(split, LEN);
+  fill_u32(natural, LEN);
+  fill_u32(lines, LEN);
+
+  bench_measure("sum misaligned", LEN * REPS,
+    range_foreach(i, 0, REPS) bench_sink(sum_u32(split, LEN)));
+  bench_measure("sum natural", LEN * REPS,
+    range_foreach(i, 0, REPS) bench_sink(sum_u32(natural, LEN)));
+  bench_measure("sum 64-aligned", LEN * REPS,
+    range_foreach(i, 0, REPS) bench_sink(sum_u32_aligned(lines, LEN)));
+}
+
+struct chase_node {
+  struct chase_node* next;
+  size_t val;
+  char payload[48];
+};
+
+static void bench_chase(const char* name, region_t r, size_t count,
+			const size_t* order) {
+  char label[64];
+  size_t i;
+
+  if (r == NULL) {
+    // Not enough address space, or no huge pages, on this host.
+    bench_note(name, "skipped, can't reserve");
+    return;
+  }
+  pointer(struct chase_node*) nodes = malloc(count * sizeof(*nodes));
+  snprintf(label, sizeof(label), "%s alloc", name);
+  bench_measure(label, count,
+    range_foreach(i, 0, count) {
+      nodes[i] = r_malloc(r, struct chase_node);
+      nodes[i]->val = i;
+    });
+
+  range_foreach(i, 0, count) {
+    nodes[order[i]]->next = nodes[order[(i + 1) % count]];
+  }
+
+  struct chase_node* curr = nodes[0];
+  size_t sum = 0;
+  snprintf(label, sizeof(label), "%s chase", name);
+  bench_measure(label, count,
+    range_foreach(i, 0, count) {
+      sum += curr->val;
+      curr = curr->next;
+    });
+  bench_sink(sum);
+
+  snprintf(label, sizeof(label), "%s destroy", name);
+  bench_measure(label, 1, r_destroy(r));
+  free(nodes);
+}
+
+BENCH_DECL(bench_reserved, r) {
+  IGNORE(r);
+  static const size_t COUNT = 2lu << 20;
+
+  // Random cyclic visiting order, shared by every backend.
+  pointer(size_t) order = malloc(COUNT * sizeof(size_t));
+  uint64_t state = 88172645463325252lu;
+  size_t i;
+  range_foreach(i, 0, COUNT) {
+    order[i] = i;
+  }
+  range_foreach_rev(i, COUNT - 1, 0) {
+    state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+    swap(&order[i], &order[state % (i + 1)]);
+  }
+
+  r_cache_trim(0);
+  bench_chase("blocks", r_create(), COUNT, order);
+  bench_chase("reserved", r_create_reserved(COUNT * sizeof(struct chase_node)
+					     + (1lu << 20), false),
+	      COUNT, order);
+  bench_chase("reserved huge", r_create_reserved(COUNT * sizeof(struct chase_node)
+						  + (1lu << 20), true),
+	      COUNT, order);
+
+  free(order);
+}
+
+BENCH_SUITE_DECL(region_bench,
+  bench_add(bench_alignment_padding),
+  bench_add(bench_alignment_kernel),
+  bench_add(bench_reserved));
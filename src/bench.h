@@ -0,0 +1,133 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// bench.h - A simple benchmarking library.
+//
+// The benchmarking counterpart to test.h: time a few statements, print the
+// numbers, compare by eye.
+//
+// To enable, pass KC_BENCHMARKING when compiling a compilation unit which uses
+// BENCH_SUITE_DECL.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Time the statements ..., run ITERS times in total, and report the time per
+// iteration under NAME.
+/////
+// bench_measure("push", N, range_foreach(i, 0, N) vec_push(&v, i));
+#define bench_measure(NAME, ITERS, ...)					\
+  do {									\
+    uint64_t __bench_start = __bench_now_ns_();				\
+    __VA_ARGS__;							\
+    __bench_report_((NAME), (ITERS), __bench_now_ns_() - __bench_start); \
+  } while (0)
+
+// Report an arbitrary measurement under NAME.
+/////
+// bench_note("padding", "%.2f%%", 100.0 * pad / total);
+#define bench_note(NAME, FMT, ...)				\
+  printf("    - %-32s " FMT "\n", (NAME), ## __VA_ARGS__)
+
+// Prevent the compiler from optimizing away the computation of VAL.
+#define bench_sink(VAL)					\
+  do {							\
+    __auto_type __bench_sink = (VAL);			\
+    __asm__ volatile("" : : "g"(__bench_sink) : "memory");	\
+  } while (0)
+
+// KC_BENCHMARKING enables benchmark suites at compile-time.
+#ifdef KC_BENCHMARKING
+
+// Declare a benchmark function with NAME and using region REG.
+/////
+// BENCH_DECL(foo_bench, r) { bench_measure(...); ... }
+#define BENCH_DECL(NAME, REG)				\
+  static void __bench_name(NAME)(region_t REG)
+
+// Declare benchmark suite with name NAME, running the given benchmarks.
+////
+// Benchmarks must be declared/added using 'bench_add(<bench_name>)'.
+// BENCH_SUITE_DECL(my_module, bench_add(foo_bench), ...);
+#define BENCH_SUITE_DECL(NAME, ...)					\
+  static const struct __bench_entry __bench_name(NAME ## _array)[] = { __VA_ARGS__ }; \
+  static void __attribute__((constructor(200))) __bench_name(NAME)() {	\
+    __bench_suite_execute_(#NAME,					\
+			   array_len(__bench_name(NAME ## _array)),	\
+			   __bench_name(NAME ## _array)); }		\
+  static const int __attribute__((unused)) __bench_name(NAME ## _reserved) = 0
+
+// Add a benchmark to the suite.
+#define bench_add(NAME)				\
+  { .name = #NAME, .fun = __bench_name(NAME) }
+
+#else // KC_BENCHMARKING is disabled
+#define BENCH_DECL(NAME, REG)						\
+  static void __attribute__((unused)) __bench_name(NAME)(region_t REG)
+#define BENCH_SUITE_DECL(NAME, ...)					\
+  static const int __attribute__((unused)) __bench_name(NAME ## _reserved) = 0
+#define bench_add(NAME) 0
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Private
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "basic.h"
+#include "region.h"
+
+#define __bench_name(NAME) __bench_ ## NAME
+
+struct __bench_entry {
+  const char* name;
+  void (*fun)(region_t);
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline uint64_t __attribute__((unused))
+__bench_now_ns_();
+
+static inline void __attribute__((unused))
+__bench_report_(const char*, size_t iters, uint64_t ns);
+
+static inline void __attribute__((unused))
+__bench_suite_execute_(const char*, size_t count, const struct __bench_entry[count]);
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline uint64_t __attribute__((unused))
+__bench_now_ns_() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return cast(uint64_t, ts.tv_sec) * 1000000000lu + cast(uint64_t, ts.tv_nsec);
+}
+
+static inline void __attribute__((unused))
+__bench_report_(const char* name, size_t iters, uint64_t ns) {
+  printf("    - %-32s %10.3f ms %10.2f ns/iter\n",
+	 name, cast(double, ns) / 1e6,
+	 cast(double, ns) / cast(double, max(iters, 1lu)));
+}
+
+static inline void __attribute__((unused))
+__bench_suite_execute_(const char* name,
+		       size_t count,
+		       const struct __bench_entry entries[count]) {
+  printf("Running %lu benchmarks in \'%s\' ... \n", count, name);
+
+  const struct __bench_entry* bench;
+  array_foreach(bench, count, entries) {
+    region_t bench_region = r_create();
+    printf("[%3lu] %s\n",
+	   (size_t) (bench - entries) + 1,
+	   bench->name);
+    bench->fun(bench_region);
+    r_destroy(bench_region);
+  }
+
+  printf("Completed \'%s\'.\n\n", name);
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// file_map.h - Files mapped read-only into a region, and their errors.
+//
+// Region snapshots and map images are written whole and mapped back read-only
+// by whoever loads them. This header maps such a file, checks its header with
+// the caller's test, and leaves the mapping to a region, which unmaps it when
+// destroyed.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "basic.h"
+#include "error.h"
+#include "region.h"
+
+#include <stdio.h>
+
+struct file_error {
+  ERROR_SUBTYPE(FILE_ERROR_LAYOUT, // Data can't be saved, see the saving call.
+		FILE_ERROR_IO,     // System call failed, see sys_errno.
+		FILE_ERROR_FORMAT); // File isn't of the expected type or version.
+  int sys_errno;
+};
+
+// Print a description of the file error ERR to FILE.
+static inline
+void file_error_print(FILE*, const struct file_error*);
+
+////////////////////////////////////////////////////////////////////////////////
+// Private
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct r_file_map {
+  void* map;
+  size_t len;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline struct file_error __attribute__((warn_unused_result, unused))
+__r_file_map_(region_t, const char* path, size_t min_len,
+	      bool (*valid)(const void* map, size_t len, const void* arg),
+	      const void* arg, const void** map);
+
+static void __attribute__((unused))
+__r_file_unmap_(void*);
+
+////////////////////////////////////////////////////////////////////////////////
+
+#define __file_error(TAG)						\
+  new(struct file_error, .tag = (TAG),					\
+      .sys_errno = ((TAG) == FILE_ERROR_IO) ? errno : 0)
+
+// Map the file PATH read-only into MAP for as long as region REG lives. Files
+// shorter than MIN_LEN, or which VALID(map, len, ARG) rejects, are not mapped.
+static inline struct file_error
+__r_file_map_(region_t region, const char* path, size_t min_len,
+	      bool (*valid)(const void* map, size_t len, const void* arg),
+	      const void* arg, const void** map) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return __file_error(FILE_ERROR_IO);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    struct file_error err = __file_error(FILE_ERROR_IO);
+    close(fd);
+    return err;
+  }
+  size_t len = cast(size_t, st.st_size);
+  if (len < min_len) {
+    close(fd);
+    return __file_error(FILE_ERROR_FORMAT);
+  }
+
+  void* mapped = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+  struct file_error err = __file_error(FILE_ERROR_IO);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return err;
+  }
+  if (!valid(mapped, len, arg)) {
+    munmap(mapped, len);
+    return __file_error(FILE_ERROR_FORMAT);
+  }
+
+  struct r_file_map* owned =
+    r_new_struct(region, __r_file_unmap_, struct r_file_map);
+  *owned = new(struct r_file_map, .map = mapped, .len = len);
+  *map = mapped;
+  return error_no(file_error);
+}
+
+static void
+__r_file_unmap_(void* data) {
+  struct r_file_map* owned = data;
+  munmap(owned->map, owned->len);
+}
+
+static inline void __attribute__((unused))
+file_error_print(FILE* out, const struct file_error* err) {
+  switch (err->tag) {
+  case FILE_ERROR_LAYOUT:
+    fprintf(out, "Data can't be saved to a file\n");
+    break;
+  case FILE_ERROR_IO:
+    fprintf(out, "File I/O failed: %s\n", strerror(err->sys_errno));
+    break;
+  case FILE_ERROR_FORMAT:
+    fprintf(out, "File isn't of the expected type or version\n");
+    break;
+  default:
+    fprintf(out, "No error\n");
+  }
+}
@@ -1,6 +1,7 @@
 ////////////////////////////////////////////////////////////////////////////////
 //
-// hmap.h - A generic hashmap structure, using a robinhood algorithm.
+// hmap.h - A generic hashmap structure, using a robinhood algorithm or
+//   SIMD-probed groups.
 //
 // All functions on the hashmap have the name form HMAP_NAME ## _<name>.
 //
@@ -14,6 +15,53 @@
 //       bool (*)(const KEY_TYPE*, const KEY_TYPE*)
 //   - HMAP_LOAD_FACTOR :: How full the map should be before growing it.
 //       float, [0.0, 1.0] (default: 0.9f)
+//   - HMAP_SOA         :: Define to keep probe metadata apart from entries.
+//   - HMAP_STORED_HASH :: What entries keep of their hash, without HMAP_SOA.
+//       HMAP_HASH_FULL, HMAP_HASH_FRAG or HMAP_HASH_NONE (default: FULL)
+//   - HMAP_FASTMOD     :: Define to find home slots without dividing.
+//   - HMAP_POW2        :: Define to use power of two capacities.
+//   - HMAP_INCREMENTAL :: Define to migrate entries gradually when growing.
+//   - HMAP_SWISS       :: Define to use the group-probing engine instead.
+//   - HMAP_ORDERED     :: Define to use the insertion-ordered engine instead.
+//   - HMAP_CONCURRENT  :: Define for a map shared between threads.
+//   - HMAP_ALLOC       :: Allocator of slot arrays (default: malloc)
+//       void* (*)(ALLOC_CTX ctx, size_t bytes, size_t align)
+//   - HMAP_FREE        :: Frees an array from HMAP_ALLOC (default: free)
+//       void (*)(ALLOC_CTX ctx, void* ptr, size_t bytes)
+//   - HMAP_ALLOC_CTX   :: Type of allocator state kept in the map, given to
+//       HMAP(new_in) instead of HMAP(new) (default: none, ctx is NULL)
+//   - HMAP_REGION      :: Define to allocate from a region_t.
+//   - HMAP_HUGE        :: Define to map big slot arrays on huge pages.
+//   - HMAP_HUGE_MIN    :: Bytes from which HMAP_HUGE maps an array.
+//       size_t (default: 2 MiB)
+//   - HMAP_FILE        :: Define to save maps as images and map them back,
+//       with the robinhood engine only.
+//
+// HMAP_REGION and HMAP_HUGE are allocator presets. A map with HMAP_REGION is
+// created with HMAP(new_in)(reg) and lives in the region: its arrays, including
+// the ones growing replaces, are left for the region to free, so the map needs
+// no destroy call.
+//
+// The robinhood engine is described in hmap_robin.h, the group-probing engine
+// in hmap_swiss.h and the insertion-ordered engine in hmap_ordered.h. They all
+// provide the same interface. Only the ordered engine iterates in a stable
+// order, the order of insertion.
+//
+// Erasing shrinks a map once it holds less than a quarter of the entries its
+// slots are meant for, to twice its entries' worth, so that a map hovering
+// around a size doesn't keep resizing. With HMAP_INCREMENTAL the entries move
+// to the smaller table a few slots at a time, as they do when growing. The
+// concurrent engine never shrinks.
+//
+// With HMAP_FILE, HMAP(save) writes a map's slot arrays to an image file which
+// HMAP(load) maps back read-only, so that a large lookup table is available as
+// soon as it is mapped instead of being rebuilt. Keys and values are written
+// as they are, so they must hold no pointers, and an image must be loaded by
+// the same instantiation on the same kind of machine.
+//
+// The concurrent engine, described in hmap_concurrent.h, takes no other
+// options. Lookups never block and copy values out instead of returning
+// pointers into the map, since the entry may move or go away right after.
 //
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -48,10 +96,83 @@
 #define HMAP_LOAD_FACTOR 0.9f
 #endif
 
+// Choices of HMAP_STORED_HASH.
+#ifndef HMAP_HASH_FULL
+#define HMAP_HASH_FULL 0 // The whole hash, never recomputed.
+#define HMAP_HASH_FRAG 1 // Its top byte, the hash is recomputed when growing.
+#define HMAP_HASH_NONE 2 // Nothing, probes compare every key on the way.
+#endif
+
+#ifndef HMAP_STORED_HASH
+#define HMAP_STORED_HASH HMAP_HASH_FULL
+#endif
+
+#ifndef HMAP_STATS_DISTS
+// Distances told apart by the histogram of hmap_stats.
+#define HMAP_STATS_DISTS 16lu
+
+// Occupancy of a map and lengths of its probes, see HMAP(stats).
+struct hmap_stats {
+  size_t num_items;
+  size_t num_slots;
+  float load;      // num_items / num_slots.
+  size_t bytes;    // Size of the slot arrays.
+  size_t max_dist; // Longest distance of an entry from its home.
+  // Entries by distance from their homes, the last counting any further.
+  size_t dists[HMAP_STATS_DISTS];
+};
+#endif
+
+#if defined(HMAP_REGION)
+#include "region.h"
+#define HMAP_ALLOC_CTX region_t
+#define HMAP_ALLOC(CTX, BYTES, ALIGN) r_malloc_aligned((CTX), (BYTES), (ALIGN))
+#define HMAP_FREE(CTX, PTR, BYTES) ((void) (CTX), (void) (PTR), (void) (BYTES))
+#elif defined(HMAP_HUGE)
+#ifndef HMAP_HUGE_MIN
+#define HMAP_HUGE_MIN (2lu << 20)
+#endif
+#define HMAP_ALLOC(CTX, BYTES, ALIGN)			\
+  __hmap_huge_alloc((BYTES), (ALIGN), HMAP_HUGE_MIN)
+#define HMAP_FREE(CTX, PTR, BYTES)			\
+  __hmap_huge_free((PTR), (BYTES), HMAP_HUGE_MIN)
+#endif
+
+#ifndef HMAP_ALLOC
+#define HMAP_ALLOC(CTX, BYTES, ALIGN) __hmap_sys_alloc((BYTES), (ALIGN))
+#define HMAP_FREE(CTX, PTR, BYTES) ((void) (BYTES), free(PTR))
+#elif defined(HMAP_CONCURRENT)
+#error "The concurrent engine takes no allocator."
+#endif
+
+#if defined(HMAP_FASTMOD) && defined(HMAP_POW2)
+#error "HMAP_FASTMOD and HMAP_POW2 are exclusive."
+#endif
+
+#ifndef HMAP_SWISS
+// Defaults to the robinhood engine.
+#endif
+
+#if defined(HMAP_SWISS) && defined(HMAP_ORDERED)
+#error "HMAP_SWISS and HMAP_ORDERED are exclusive."
+#endif
+
+#if defined(HMAP_FILE)
+#if defined(HMAP_SWISS) || defined(HMAP_ORDERED) || defined(HMAP_CONCURRENT)
+#error "HMAP_FILE takes the robinhood engine."
+#endif
+#include "hmap_file.h"
+#endif
+
+#ifndef HMAP_CONCURRENT
+// Defaults to a map used by one thread at a time.
+#endif
+
 #define HMAP__(NS, ID) NS ## _ ## ID
 #define HMAP_(NS, ID) HMAP__(NS, ID)
 #define HMAP(ID) HMAP_(HMAP_NAME, ID)
 
+#ifndef HMAP_ALLOC_CTX
 // Create a new hashmap.
 static inline
 struct HMAP_NAME HMAP(new)();
@@ -59,11 +180,35 @@ struct HMAP_NAME HMAP(new)();
 // Create a new hashmap, reserving a number of slots for entries.
 static inline
 struct HMAP_NAME HMAP(new_reserve)(size_t count);
+#else
+// Create a new hashmap, allocating with CTX.
+static inline
+struct HMAP_NAME HMAP(new_in)(HMAP_ALLOC_CTX ctx);
+
+// Create a new hashmap allocating with CTX, reserving a number of slots.
+static inline
+struct HMAP_NAME HMAP(new_reserve_in)(HMAP_ALLOC_CTX ctx, size_t count);
+#endif
 
 // Reserve count slots in the hashmap for entries.
 static inline
 void HMAP(reserve)(struct HMAP_NAME*, size_t count);
 
+#ifndef HMAP_CONCURRENT
+// Shrink the map to the fewest slots which hold its entries.
+static inline
+void HMAP(shrink_to_fit)(struct HMAP_NAME*);
+
+// Measure the occupancy and probe lengths of the map.
+/////
+// Distances are in probe steps of the engine: slots for the robinhood and
+// ordered engines, groups for the group-probing one. Walks the whole map, and
+// hashes every key with the group-probing engine.
+static inline
+struct hmap_stats HMAP(stats)(const struct HMAP_NAME*);
+#endif
+
+#ifndef HMAP_CONCURRENT
 // Insert an entry into the map.
 /////
 // Returns current value if key already present and does NOT overwrite it, NULL
@@ -88,6 +233,102 @@ static inline
 HMAP_KEY_TYPE* HMAP(get)(struct HMAP_NAME*, const HMAP_KEY_TYPE* key);
 #endif
 
+// Get the slot of a key's value, adding the key without a value if absent.
+/////
+// Sets FRESH if the key was added, in which case the value must be written
+// through the returned pointer before the next call on the map. Lets callers
+// build large values in place, or update present ones, with a single probe.
+// Returns the key pointer if hashmap is a hashset.
+#ifndef HMAP_HASHSET
+HMAP_VAL_TYPE* HMAP(entry)(struct HMAP_NAME*, const HMAP_KEY_TYPE* key,
+			   bool* fresh);
+#else
+HMAP_KEY_TYPE* HMAP(entry)(struct HMAP_NAME*, const HMAP_KEY_TYPE* key,
+			   bool* fresh);
+#endif
+
+// Hash of a key, for the _with_hash variants.
+static inline
+size_t HMAP(hash)(const HMAP_KEY_TYPE* key);
+
+// Variants of insert, get, entry and erase taking the hash of the key.
+/////
+// HASH must be HMAP(hash)(key). Saves hashing again when one key goes through
+// several calls, or when hashes are kept alongside keys.
+#ifndef HMAP_HASHSET
+HMAP_VAL_TYPE* HMAP(insert_with_hash)(struct HMAP_NAME*,
+				      const HMAP_KEY_TYPE* key,
+				      const HMAP_VAL_TYPE* val, size_t hash);
+static inline
+HMAP_VAL_TYPE* HMAP(get_with_hash)(struct HMAP_NAME*, const HMAP_KEY_TYPE* key,
+				   size_t hash);
+HMAP_VAL_TYPE* HMAP(entry_with_hash)(struct HMAP_NAME*, const HMAP_KEY_TYPE* key,
+				     size_t hash, bool* fresh);
+#else
+HMAP_KEY_TYPE* HMAP(insert_with_hash)(struct HMAP_NAME*,
+				      const HMAP_KEY_TYPE* key, size_t hash);
+static inline
+HMAP_KEY_TYPE* HMAP(get_with_hash)(struct HMAP_NAME*, const HMAP_KEY_TYPE* key,
+				   size_t hash);
+HMAP_KEY_TYPE* HMAP(entry_with_hash)(struct HMAP_NAME*, const HMAP_KEY_TYPE* key,
+				     size_t hash, bool* fresh);
+#endif
+bool HMAP(erase_with_hash)(struct HMAP_NAME*, const HMAP_KEY_TYPE* key,
+			   size_t hash);
+
+// Insert COUNT entries, as if inserting them in order.
+/////
+// Keys are hashed and their slots prefetched a few keys ahead of placing them,
+// so that cache misses of different keys overlap.
+// Returns the number of keys which were not present yet.
+#ifndef HMAP_HASHSET
+size_t HMAP(insert_batch)(struct HMAP_NAME*, size_t count,
+			  const HMAP_KEY_TYPE keys[count],
+			  const HMAP_VAL_TYPE vals[count]);
+#else
+size_t HMAP(insert_batch)(struct HMAP_NAME*, size_t count,
+			  const HMAP_KEY_TYPE keys[count]);
+#endif
+
+// Get the values for COUNT keys into OUT, NULL for absent keys.
+/////
+// Like insert_batch, prefetches ahead of the probes.
+#ifndef HMAP_HASHSET
+static inline
+void HMAP(get_batch)(struct HMAP_NAME*, size_t count,
+		     const HMAP_KEY_TYPE keys[count], HMAP_VAL_TYPE* out[count]);
+#else
+static inline
+void HMAP(get_batch)(struct HMAP_NAME*, size_t count,
+		     const HMAP_KEY_TYPE keys[count], HMAP_KEY_TYPE* out[count]);
+#endif
+#else
+// Insert an entry into the map.
+/////
+// Returns false if key already present and does NOT overwrite it, true
+// otherwise.
+#ifndef HMAP_HASHSET
+bool HMAP(insert)(struct HMAP_NAME*,
+		  const HMAP_KEY_TYPE* key,
+		  const HMAP_VAL_TYPE* val);
+#else
+bool HMAP(insert)(struct HMAP_NAME*, const HMAP_KEY_TYPE* key);
+#endif
+
+#ifndef HMAP_HASHSET
+// Copy the value for a key into OUT.
+/////
+// Returns false if not present, leaving OUT as it was.
+static inline
+bool HMAP(get_copy)(struct HMAP_NAME*, const HMAP_KEY_TYPE* key,
+		    HMAP_VAL_TYPE* out);
+#else
+// Check whether a key is present.
+static inline
+bool HMAP(contains)(struct HMAP_NAME*, const HMAP_KEY_TYPE* key);
+#endif
+#endif
+
 // Remove an entry from the map.
 /////
 // Returns true if successfully removed, false if not present.
@@ -106,6 +347,7 @@ bool HMAP(extract)(struct HMAP_NAME*,
 static inline
 void HMAP(destroy)(struct HMAP_NAME*);
 
+#ifndef HMAP_CONCURRENT
 #ifndef HMAP_HASHSET
 typedef bool (*HMAP(visitor_fun_t))(const HMAP_KEY_TYPE* key,
 				      HMAP_VAL_TYPE* val,
@@ -120,6 +362,63 @@ typedef bool (*HMAP(visitor_fun_t))(const HMAP_KEY_TYPE* key,
 // Return true from visitor to prematurely abort.
 bool HMAP(foreach)(struct HMAP_NAME*, HMAP(visitor_fun_t), void* arg);
 
+// Iterator over the entries of a map, see HMAP(iter_next).
+struct HMAP(iter) {
+  const HMAP_KEY_TYPE* key; // Of the current entry.
+#ifndef HMAP_HASHSET
+  HMAP_VAL_TYPE* val;
+#endif
+  struct HMAP_NAME* table;
+  size_t index; // Next slot to look at.
+  size_t end;
+};
+
+// Start iterating over the entries of the map.
+static inline
+struct HMAP(iter) HMAP(iter)(struct HMAP_NAME*);
+
+// Move the iterator to the next entry, false once all are visited.
+/////
+// The loop is inlined, unlike foreach. The map must not change while
+// iterating, other than values through HMAP(iter_val).
+/////
+// struct hmap_iter it = hmap_iter(&map);
+// while (hmap_iter_next(&it)) { sum += *hmap_iter_val(&it); }
+static inline
+bool HMAP(iter_next)(struct HMAP(iter)*);
+
+// Key of the entry the iterator is at.
+static inline
+const HMAP_KEY_TYPE* HMAP(iter_key)(const struct HMAP(iter)*);
+
+#ifndef HMAP_HASHSET
+// Value of the entry the iterator is at.
+static inline
+HMAP_VAL_TYPE* HMAP(iter_val)(const struct HMAP(iter)*);
+#endif
+
+#ifdef HMAP_FILE
+// Save the map as an image in the file PATH.
+/////
+// Finishes a migration in progress first.
+struct file_error HMAP(save)(struct HMAP_NAME*, const char* path);
+
+// Map the image file PATH read-only as the map OUT.
+/////
+// OUT must only be looked up, with get, get_batch, iteration or stats, and not
+// destroyed: the mapping lives until region REG is destroyed. Pages are read
+// from the file as lookups first touch them.
+struct file_error HMAP(load)(region_t, const char* path,
+			     struct HMAP_NAME* out);
+#endif
+#else
+// Free the slot arrays left behind by growing which writers haven't freed yet.
+/////
+// Only call while no other thread uses the map. Not needed to bound memory,
+// writers free retired arrays on their own.
+void HMAP(reclaim)(struct HMAP_NAME*);
+#endif
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // Private
@@ -130,37 +429,35 @@ bool HMAP(foreach)(struct HMAP_NAME*, HMAP(visitor_fun_t), void* arg);
 
 #include "type.h"
 #include "contract.h"
+#include "hmap_alloc.h"
 
-struct HMAP_NAME {
-  parray_t(struct HMAP(_bucket)) buckets;
-  size_t num_items;
-  uint8_t slot_bound;
-};
-
-struct HMAP(_bucket) {
-  HMAP_KEY_TYPE key;
 #ifndef HMAP_HASHSET
-  HMAP_VAL_TYPE val;
-#endif
-  size_t hash;
-  int8_t dist;
-};
-
-struct HMAP(_slots) {
-  size_t cap;
-  int8_t max_dist;
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-#ifndef HMAP_HASHSET
-#define HMAP__GET(ENTRY) ((ENTRY)->val)
+#define HMAP__GET(TABLE, IDX) (HMAP__ENTRY(TABLE, IDX).val)
 #define HMAP__RET HMAP_VAL_TYPE
 #else
-#define HMAP__GET(ENTRY) ((ENTRY)->key)
+#define HMAP__GET(TABLE, IDX) (HMAP__ENTRY(TABLE, IDX).key)
 #define HMAP__RET HMAP_KEY_TYPE
 #endif
 
+#ifdef HMAP_ALLOC_CTX
+#define HMAP__ALLOC_CTX(TABLE) ((TABLE)->alloc)
+#else
+#define HMAP__ALLOC_CTX(TABLE) NULL
+#endif
+
+// Allocate COUNT of TYPE for TABLE, aligned to at least ALIGN.
+#define HMAP__ALLOC(TABLE, TYPE, COUNT, ALIGN)				\
+  cast(pointer(TYPE), HMAP_ALLOC(HMAP__ALLOC_CTX(TABLE), sizeof(TYPE) * (COUNT), \
+				 max(alignof(TYPE), (ALIGN))))
+#define HMAP__FREE(TABLE, PTR, TYPE, COUNT)				\
+  HMAP_FREE(HMAP__ALLOC_CTX(TABLE), (PTR), sizeof(TYPE) * (COUNT))
+
+// Slot index of no slot.
+#define HMAP__NONE SIZE_MAX
+
+// Number of keys batches hash and prefetch ahead of the one being probed.
+#define HMAP__AHEAD 16lu
+
 #ifndef HMAP_HASH_FUN
 #include "murmur.h"
 static inline size_t __attribute__((always_inline))
@@ -189,280 +486,199 @@ static const HMAP(hash_fun_t) HMAP(_hash_fun) = HMAP_HASH_FUN;
 static const HMAP(key_eq_fun_t) HMAP(_key_eq_fun) = HMAP_KEY_EQ;
 static const float HMAP(_load_factor) = HMAP_LOAD_FACTOR;
 
-static const struct HMAP(_slots) HMAP(_slot_bounds)[] = {
-  { 5lu, 2 }, { 7lu, 3 }, { 11lu, 3 }, { 17lu, 4 }, { 23lu, 5 }, { 37lu, 5 },
-  { 53lu, 6 }, { 79lu, 6 }, { 113lu, 7 }, { 163lu, 7 }, { 229lu, 8 },
-  { 331lu, 8 }, { 463lu, 9 }, { 653lu, 9 }, { 919lu, 10 }, { 1289lu, 10 },
-  { 1811lu, 11 }, { 2539lu, 11 }, { 3557lu, 12 }, { 4987lu, 12 },
-  { 6983lu, 13 }, { 9781lu, 13 }, { 13693lu, 14 }, { 19181lu, 14 },
-  { 26861lu, 15 }, { 37607lu, 15 }, { 52667lu, 16 }, { 73751lu, 16 },
-  { 103289lu, 17 }, { 144611lu, 17 }, { 202471lu, 18 }, { 283463lu, 18 },
-  { 396871lu, 19 }, { 555637lu, 19 }, { 777901lu, 20 }, { 1089091lu, 20 },
-  { 1524763lu, 21 }, { 2134697lu, 21 }, { 2988607lu, 22 }, { 4184087lu, 22 },
-  { 5857727lu, 22 }, { 8200847lu, 23 }, { 11481199lu, 23 }, { 16073693lu, 24 },
-  { 22503181lu, 24 }, { 31504453lu, 25 }, { 44106241lu, 25 },
-  { 61748749lu, 26 }, { 86448259lu, 26 }, { 121027583lu, 27 },
-  { 169438627lu, 27 }, { 237214097lu, 28 }, { 332099741lu, 28 },
-  { 464939639lu, 29 }, { 650915521lu, 29 }, { 911281733lu, 30 },
-  { 1275794449lu, 30 }, { 1786112231lu, 31 }, { 2500557133lu, 31 },
-  { 3500779987lu, 32 }, { 4901092003lu, 32 }, { 6861528851lu, 33 },
-  { 9606140399lu, 33 }, { 13448596583lu, 34 }, { 18828035323lu, 34 },
-  { 26359249459lu, 35 }, { 36902949287lu, 35 }, { 51664129003lu, 36 },
-  { 72329780647lu, 36 }, { 101261692921lu, 37 }, { 141766370143lu, 37 },
-  { 198472918207lu, 38 }, { 277862085493lu, 38 }, { 389006919737lu, 39 },
-  { 544609687669lu, 39 }, { 762453562751lu, 39 }, { 1067434987873lu, 40 },
-  { 1494408983027lu, 40 }, { 2092172576243lu, 41 }, { 2929041606761lu, 41 },
-  { 4100658249511lu, 42 }, { 5740921549367lu, 42 }, { 8037290169151lu, 43 },
-  { 11252206236863lu, 43 }, { 15753088731613lu, 44 }, { 22054324224277lu, 44 },
-  { 30876053913989lu, 45 }, { 43226475479591lu, 45 }, { 60517065671459lu, 46 },
-  { 84723891940099lu, 46 }, { 118613448716141lu, 47 },
-  { 166058828202599lu, 47 }, { 232482359483653lu, 48 },
-  { 325475303277143lu, 48 }, { 455665424588069lu, 49 },
-  { 637931594423311lu, 49 }, { 893104232192647lu, 50 },
-  { 1250345925069739lu, 50 }, { 1750484295097673lu, 51 },
-  { 2450678013136757lu, 51 }, { 3430949218391537lu, 52 },
-  { 4803328905748207lu, 52 }, { 6724660468047551lu, 53 },
-  { 9414524655266669lu, 53 }, { 13180334517373357lu, 54 },
-  { 18452468324322709lu, 54 }, { 25833455654051813lu, 55 },
-  { 36166837915672573lu, 55 }, { 50633573081941709lu, 55 },
-  { 70887002314718437lu, 56 }, { 99241803240605819lu, 56 },
-  { 138938524536848189lu, 57 }, { 194513934351587491lu, 57 },
-  { 272319508092222467lu, 58 }, { 381247311329111473lu, 58 },
-  { 533746235860756057lu, 59 }, { 747244730205058483lu, 59 },
-  { 1046142622287081827lu, 60 }, { 1464599671201914671lu, 60 },
-  { 2050439539682680411lu, 61 }, { 2870615355555752471lu, 61 }
-};
-
 ////////////////////////////////////////////////////////////////////////////////
-
-static inline size_t __attribute__((always_inline))
-HMAP(_slot_count)(uint8_t slot_bound);
-
-static inline size_t __attribute__((always_inline))
-HMAP(_slot_load_count)(uint8_t slot_bound);
-
-static inline uint8_t __attribute__((always_inline))
-HMAP(_find_slot_bound)(size_t slots);
-
-static inline bool __attribute__((always_inline))
-HMAP(_key_eq)(struct HMAP(_bucket)* lhs, struct HMAP(_bucket)* rhs);
-
-static inline void
-HMAP(_grow_to)(struct HMAP_NAME* table, uint8_t slot_bound);
-
-static inline void __attribute__((always_inline))
-HMAP(_grow)(struct HMAP_NAME* table);
-
-static inline
-HMAP__RET* HMAP(_insert_inner)(struct HMAP_NAME* table,
-			       struct HMAP(_bucket) to_add);
-
-static inline struct HMAP(_bucket)*
-HMAP(_find)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key);
-
-static inline void
-HMAP(_remove)(struct HMAP(_bucket)* entry);
+// Engine
+//
+// An engine defines struct HMAP_NAME, with an alloc field of HMAP_ALLOC_CTX if
+// defined, HMAP(reserve), HMAP(shrink_to_fit), HMAP(stats) and HMAP(destroy),
+// and the slot level operations below, on which the rest of the interface is
+// built. Slot arrays come from HMAP__ALLOC and go back to HMAP__FREE.
+/////
+// HMAP(_create)(table, count)                 :: Set up for count entries,
+//                                                with alloc set.
+// HMAP(_find)(table, key, hash)               :: Slot of key, or HMAP__NONE.
+// HMAP(_insert_slot)(table, key, hash, fresh) :: Slot of key, added without a
+//                                                value if absent.
+// HMAP(_remove)(table, index)                 :: Empty a slot, maybe
+//                                                shrinking.
+// HMAP(_num_slots)(table)                     :: Number of slots.
+// HMAP(_prefetch)(table, hash)                :: Prefetch where a probe starts.
+// HMAP(_next_live)(table, index)              :: First slot from index on
+//                                                holding an entry, or
+//                                                _num_slots.
+// HMAP__LIVE(TABLE, IDX)                      :: Whether a slot holds an entry.
+// HMAP__ENTRY(TABLE, IDX)                     :: Entry, with key and val.
+/////
+// The concurrent engine defines the whole interface itself instead.
+
+#if defined(HMAP_CONCURRENT)
+#include "hmap_concurrent.h"
+#elif defined(HMAP_SWISS)
+#include "hmap_swiss.h"
+#elif defined(HMAP_ORDERED)
+#include "hmap_ordered.h"
+#else
+#include "hmap_robin.h"
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
 
-static inline size_t __attribute__((always_inline))
-HMAP(_slot_count)(uint8_t slot_bound) {
-  return HMAP(_slot_bounds)[slot_bound].cap
-    + (uint8_t) HMAP(_slot_bounds)[slot_bound].max_dist;
+#ifndef HMAP_CONCURRENT
+#ifndef HMAP_ALLOC_CTX
+static inline struct HMAP_NAME __attribute__((warn_unused_result))
+HMAP(new)() {
+  struct HMAP_NAME res;
+  HMAP(_create)(&res, 0);
+  return res;
 }
 
-static inline size_t __attribute__((always_inline))
-HMAP(_slot_load_count)(uint8_t slot_bound) {
-  return (size_t) lround((float) HMAP(_slot_count)(slot_bound) * HMAP(_load_factor));
+static inline struct HMAP_NAME __attribute__((warn_unused_result))
+HMAP(new_reserve)(size_t count) {
+  struct HMAP_NAME res;
+  HMAP(_create)(&res, count);
+  return res;
 }
-
-static inline uint8_t __attribute__((always_inline))
-HMAP(_find_slot_bound)(size_t slots) {
-  uint8_t slot_bound;
-  range_foreach(slot_bound, 0, array_len(HMAP(_slot_bounds))) {
-    if (HMAP(_slot_load_count)(slot_bound) >= slots) {
-      return slot_bound;
-    }
-  }
-  return slot_bound;
+#else
+static inline struct HMAP_NAME __attribute__((warn_unused_result))
+HMAP(new_in)(HMAP_ALLOC_CTX ctx) {
+  return HMAP(new_reserve_in)(ctx, 0);
 }
 
-static inline bool __attribute__((always_inline))
-HMAP(_key_eq)(struct HMAP(_bucket)* lhs, struct HMAP(_bucket)* rhs) {
-  return lhs->hash == rhs->hash
-      && HMAP(_key_eq_fun)(&lhs->key, &rhs->key);
+static inline struct HMAP_NAME __attribute__((warn_unused_result))
+HMAP(new_reserve_in)(HMAP_ALLOC_CTX ctx, size_t count) {
+  struct HMAP_NAME res;
+  res.alloc = ctx;
+  HMAP(_create)(&res, count);
+  return res;
 }
+#endif
 
-static inline void
-HMAP(_init)(struct HMAP_NAME* table, uint8_t slot_bound) {
-  size_t slot_count = HMAP(_slot_count)(slot_bound);
-
-  parray_init(&table->buckets,
-	      sys_malloc_array(struct HMAP(_bucket), slot_count),
-	      slot_count);
-
-  struct HMAP(_bucket)* bucket;
-  parray_foreach(bucket, &table->buckets) {
-    bucket->dist = -1;
-  }
-  table->num_items = 0;
-  table->slot_bound = slot_bound;
+HMAP__RET* HMAP(insert)(struct HMAP_NAME* table,
+			const HMAP_KEY_TYPE* key
+#ifndef HMAP_HASHSET
+			, const HMAP_VAL_TYPE* val
+#endif
+  ) {
+#ifndef HMAP_HASHSET
+  return HMAP(insert_with_hash)(table, key, val, HMAP(_hash_fun)(key));
+#else
+  return HMAP(insert_with_hash)(table, key, HMAP(_hash_fun)(key));
+#endif
 }
 
-static inline void
-HMAP(_grow_to)(struct HMAP_NAME* table, uint8_t slot_bound) {
-  struct HMAP_NAME res;
-  HMAP(_init)(&res, slot_bound);
-
-  struct HMAP(_bucket)* entry;
-  parray_foreach(entry, &table->buckets) {
-    if (entry->dist >= 0) {
-      HMAP(_insert_inner)(&res, *entry);
-    }
-  }
-
-  HMAP(destroy)(table);
-  *table = res;
+static inline
+HMAP__RET* HMAP(get)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key) {
+  return HMAP(get_with_hash)(table, key, HMAP(_hash_fun)(key));
 }
 
-static inline void __attribute__((always_inline))
-HMAP(_grow)(struct HMAP_NAME* table) {
-  return HMAP(_grow_to)(table, table->slot_bound + 1);
+HMAP__RET* HMAP(entry)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key,
+		       bool* fresh) {
+  return HMAP(entry_with_hash)(table, key, HMAP(_hash_fun)(key), fresh);
 }
 
 static inline
-HMAP__RET* HMAP(_insert_inner)(struct HMAP_NAME* table,
-                               struct HMAP(_bucket) to_add) {
-  size_t index;
-  struct HMAP(_bucket)* entry;
-
-insert:
-  to_add.dist = 0;
-  index = to_add.hash % HMAP(_slot_bounds)[table->slot_bound].cap;
-  entry = &parray_get(&table->buckets, index);
-
-  for (; entry->dist >= to_add.dist; ++entry, ++to_add.dist) {
-    if (HMAP(_key_eq)(entry, &to_add)) {
-      return &HMAP__GET(entry);
-    }
-  }
-
-  if (to_add.dist == HMAP(_slot_bounds)[table->slot_bound].max_dist) {
-    HMAP(_grow)(table);
-    goto insert;
-  } else if (entry->dist < 0) {
-    ++table->num_items;
-    *entry = to_add;
-    return NULL;
-  }
-
-  swap(entry, &to_add);
-
-  for (++entry, ++to_add.dist;; ++entry) {
-    if (entry->dist < 0) {
-      ++table->num_items;
-      *entry = to_add;
-      return NULL;
-    } else if (entry->dist < to_add.dist) {
-      swap(entry, &to_add);
-      ++to_add.dist;
-    } else {
-      ++to_add.dist;
-      if (to_add.dist == HMAP(_slot_bounds)[table->slot_bound].max_dist) {
-	break;
-      }
-    }
-  }
-
-  HMAP(_grow)(table);
-  goto insert;
+size_t HMAP(hash)(const HMAP_KEY_TYPE* key) {
+  return HMAP(_hash_fun)(key);
 }
 
-static inline struct HMAP_NAME __attribute__((warn_unused_result))
-HMAP(new)() {
-  struct HMAP_NAME res;
-  HMAP(_init)(&res, 0);
-  return res;
+HMAP__RET* HMAP(insert_with_hash)(struct HMAP_NAME* table,
+				  const HMAP_KEY_TYPE* key,
+#ifndef HMAP_HASHSET
+				  const HMAP_VAL_TYPE* val,
+#endif
+				  size_t hash) {
+  bool fresh;
+  size_t index = HMAP(_insert_slot)(table, key, hash, &fresh);
+  if (!fresh) {
+    return &HMAP__GET(table, index);
+  }
+#ifndef HMAP_HASHSET
+  HMAP__ENTRY(table, index).val = *val;
+#endif
+  return NULL;
 }
 
-static inline struct HMAP_NAME __attribute__((warn_unused_result))
-HMAP(new_reserve)(size_t slots) {
-  struct HMAP_NAME res;
-  HMAP(_init)(&res, HMAP(_find_slot_bound)(slots));
-  return res;
+static inline
+HMAP__RET* HMAP(get_with_hash)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key,
+			       size_t hash) {
+  size_t found = HMAP(_find)(table, key, hash);
+  return (found != HMAP__NONE) ? &HMAP__GET(table, found) : NULL;
 }
 
-static inline void
-HMAP(reserve)(struct HMAP_NAME* table, size_t slots) {
-  uint8_t slot_bound = HMAP(_find_slot_bound)(slots);
-  if (slot_bound > table->slot_bound) {
-    HMAP(_grow_to)(table, slot_bound);
-  }
+HMAP__RET* HMAP(entry_with_hash)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key,
+				 size_t hash, bool* fresh) {
+  // Probed first, as growing moves the slots.
+  size_t index = HMAP(_insert_slot)(table, key, hash, fresh);
+  return &HMAP__GET(table, index);
 }
 
-
-HMAP__RET* HMAP(insert)(struct HMAP_NAME* table,
-			const HMAP_KEY_TYPE* key
+size_t HMAP(insert_batch)(struct HMAP_NAME* table, size_t count,
+			  const HMAP_KEY_TYPE keys[count]
 #ifndef HMAP_HASHSET
-			, const HMAP_VAL_TYPE* val
+			  , const HMAP_VAL_TYPE vals[count]
 #endif
   ) {
-  if (table->num_items + 1 > HMAP(_slot_load_count)(table->slot_bound)) {
-    HMAP(_grow)(table);
+  size_t hashes[HMAP__AHEAD];
+  size_t index, added = 0;
+  range_foreach(index, 0, min(count, HMAP__AHEAD)) {
+    hashes[index] = HMAP(_hash_fun)(&keys[index]);
+    HMAP(_prefetch)(table, hashes[index]);
   }
-  struct HMAP(_bucket) buck = (struct HMAP(_bucket)) {
-    .key = *key,
+
+  range_foreach(index, 0, count) {
+    size_t hash = hashes[index % HMAP__AHEAD];
+    if (index + HMAP__AHEAD < count) {
+      hashes[index % HMAP__AHEAD] = HMAP(_hash_fun)(&keys[index + HMAP__AHEAD]);
+      HMAP(_prefetch)(table, hashes[index % HMAP__AHEAD]);
+    }
+
+    bool fresh;
+    size_t slot = HMAP(_insert_slot)(table, &keys[index], hash, &fresh);
 #ifndef HMAP_HASHSET
-    .val = *val,
+    if (fresh) {
+      HMAP__ENTRY(table, slot).val = vals[index];
+    }
+#else
+    IGNORE(slot);
 #endif
-    .hash = HMAP(_hash_fun)(key),
-    .dist = 0,
-  };
-  return HMAP(_insert_inner)(table, buck);
+    added += fresh;
+  }
+  return added;
 }
 
-static inline struct HMAP(_bucket)*
-HMAP(_find)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key) {
-  struct HMAP(_bucket) to_find = {
-    .key = *key,
-    .hash = HMAP(_hash_fun)(key),
-    .dist = 0,
-  };
-
-  size_t index = to_find.hash % HMAP(_slot_bounds)[table->slot_bound].cap;
-
-  struct HMAP(_bucket)* entry = &parray_get(&table->buckets, index);
-  for (;; ++to_find.dist, ++entry) {
-    if (entry->dist < to_find.dist) {
-      return NULL;
-    } else if (HMAP(_key_eq)(entry, &to_find)) {
-      return entry;
-    }
+static inline
+void HMAP(get_batch)(struct HMAP_NAME* table, size_t count,
+		     const HMAP_KEY_TYPE keys[count], HMAP__RET* out[count]) {
+  size_t hashes[HMAP__AHEAD];
+  size_t index;
+  range_foreach(index, 0, min(count, HMAP__AHEAD)) {
+    hashes[index] = HMAP(_hash_fun)(&keys[index]);
+    HMAP(_prefetch)(table, hashes[index]);
   }
 
-  UNREACHABLE;
-}
+  range_foreach(index, 0, count) {
+    size_t hash = hashes[index % HMAP__AHEAD];
+    if (index + HMAP__AHEAD < count) {
+      hashes[index % HMAP__AHEAD] = HMAP(_hash_fun)(&keys[index + HMAP__AHEAD]);
+      HMAP(_prefetch)(table, hashes[index % HMAP__AHEAD]);
+    }
 
-static inline void
-HMAP(_remove)(struct HMAP(_bucket)* entry) {
-  for (entry->dist = -1, ++entry; entry->dist >= 1; entry->dist = -1, ++entry) {
-    --entry->dist;
-    *(entry - 1) = *entry;
+    size_t found = HMAP(_find)(table, &keys[index], hash);
+    out[index] = (found != HMAP__NONE) ? &HMAP__GET(table, found) : NULL;
   }
 }
 
-static inline
-HMAP__RET* HMAP(get)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key) {
-  struct HMAP(_bucket)* found = HMAP(_find(table, key));
-  return (found != NULL) ? &HMAP__GET(found) : NULL;
+bool HMAP(erase)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key) {
+  return HMAP(erase_with_hash)(table, key, HMAP(_hash_fun)(key));
 }
 
-bool HMAP(erase)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key) {
-  struct HMAP(_bucket)* found = HMAP(_find(table, key));
-  if (found == NULL) {
+bool HMAP(erase_with_hash)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key,
+			   size_t hash) {
+  size_t found = HMAP(_find)(table, key, hash);
+  if (found == HMAP__NONE) {
     return false;
   } else {
-    HMAP(_remove)(found);
+    HMAP(_remove)(table, found);
     return true;
   }
 }
@@ -471,40 +687,70 @@ bool HMAP(erase)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key) {
 bool HMAP(extract)(struct HMAP_NAME* table,
 		     const HMAP_KEY_TYPE* key,
 		     HMAP_VAL_TYPE* out_val) {
-  struct HMAP(_bucket)* found = HMAP(_find(table, key));
-  if (found == NULL) {
+  size_t found = HMAP(_find)(table, key, HMAP(_hash_fun)(key));
+  if (found == HMAP__NONE) {
     return false;
   } else {
-    *out_val = found->val;
-    HMAP(_remove)(found);
+    *out_val = HMAP__ENTRY(table, found).val;
+    HMAP(_remove)(table, found);
     return true;
   }
 }
 #endif
 
-static inline void __attribute__((always_inline))
-HMAP(destroy)(struct HMAP_NAME* table) {
-  free(parray_raw(&table->buckets));
-}
-
 bool HMAP(foreach)(struct HMAP_NAME* table, HMAP(visitor_fun_t) fun, void* arg) {
-  struct HMAP(_bucket)* entry;
-  parray_foreach(entry, &table->buckets) {
-    if (entry->dist >= 0) {
-      if (
+  struct HMAP(iter) iter = HMAP(iter)(table);
+  while (HMAP(iter_next)(&iter)) {
+    if (
 #ifndef HMAP_HASHSET
-	  fun(&entry->key, &entry->val, arg)
+	fun(iter.key, iter.val, arg)
 #else
-	  fun(&entry->key, arg)
+	fun(iter.key, arg)
 #endif
-      ) {
-	return true;
-      }
+    ) {
+      return true;
     }
   }
   return false;
 }
 
+static inline
+struct HMAP(iter) HMAP(iter)(struct HMAP_NAME* table) {
+  return new(struct HMAP(iter), .key = NULL, .table = table, .index = 0,
+	     .end = HMAP(_num_slots)(table));
+}
+
+static inline
+bool HMAP(iter_next)(struct HMAP(iter)* iter) {
+  if (iter->index >= iter->end) {
+    return false;
+  }
+  size_t index = HMAP(_next_live)(iter->table, iter->index);
+  iter->index = index + 1;
+  if (unlikely(index >= iter->end)) {
+    return false;
+  }
+  struct HMAP(_bucket)* entry = &HMAP__ENTRY(iter->table, index);
+  iter->key = &entry->key;
+#ifndef HMAP_HASHSET
+  iter->val = &entry->val;
+#endif
+  return true;
+}
+
+static inline
+const HMAP_KEY_TYPE* HMAP(iter_key)(const struct HMAP(iter)* iter) {
+  return iter->key;
+}
+
+#ifndef HMAP_HASHSET
+static inline
+HMAP_VAL_TYPE* HMAP(iter_val)(const struct HMAP(iter)* iter) {
+  return iter->val;
+}
+#endif
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 
 #undef HMAP_NAME
@@ -514,8 +760,45 @@ bool HMAP(foreach)(struct HMAP_NAME* table, HMAP(visitor_fun_t) fun, void* arg)
 #undef HMAP_HASH_FUN
 #undef HMAP_KEY_EQ
 #undef HMAP_LOAD_FACTOR
+#undef HMAP_SOA
+#undef HMAP_STORED_HASH
+#undef HMAP_FASTMOD
+#undef HMAP_POW2
+#undef HMAP_INCREMENTAL
+#undef HMAP_SWISS
+#undef HMAP_ORDERED
+#undef HMAP_CONCURRENT
+#undef HMAP_ALLOC
+#undef HMAP_FREE
+#undef HMAP_ALLOC_CTX
+#undef HMAP_REGION
+#undef HMAP_HUGE
+#undef HMAP_HUGE_MIN
+#undef HMAP_FILE
+#undef HMAP__SLOTS
+#undef HMAP__BUCKET
+#undef HMAP__DIST
+#undef HMAP__FRAG
+#undef HMAP__HASH_EQ
+#undef HMAP__SET_HASH
+#undef HMAP__HASH
+#undef HMAP__FULL
+#undef HMAP__ENTRY
+#undef HMAP__LIVE
+#undef HMAP__TAG
+#undef HMAP__FIRST_GROUP
+#undef HMAP__POS_EMPTY
+#undef HMAP__POS_ERASED
+#undef HMAP__HASH_LIVE
+#undef HMAP__SEGMENT
+#undef HMAP__SEGMENTS
 #undef HMAP__GET
 #undef HMAP__RET
+#undef HMAP__NONE
+#undef HMAP__ALLOC_CTX
+#undef HMAP__ALLOC
+#undef HMAP__FREE
+#undef HMAP__AHEAD
 #undef HMAP__
 #undef HMAP_
 #undef HMAP
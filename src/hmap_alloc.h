@@ -0,0 +1,63 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// hmap_alloc.h - Allocators of hmap slot arrays, see HMAP_ALLOC in hmap.h.
+//
+// __hmap_sys_alloc is the default, malloc unless an array needs a stricter
+// alignment. __hmap_huge_alloc maps arrays of at least a given size on their
+// own, aligned to and advised for transparent huge pages, so that walking a
+// big table takes few TLB entries. Smaller arrays come from malloc.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "basic.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define __HMAP_HUGE_PAGE (2lu << 20)
+
+// Allocate BYTES aligned to ALIGN, a power of two.
+static inline void* __attribute__((unused))
+__hmap_sys_alloc(size_t bytes, size_t align) {
+  if (align <= alignof(max_align_t)) {
+    return malloc(bytes);
+  }
+  return aligned_alloc(align, (bytes + align - 1) & ~(align - 1));
+}
+
+// Allocate BYTES aligned to ALIGN, on huge pages from MIN_BYTES on.
+static inline void* __attribute__((unused))
+__hmap_huge_alloc(size_t bytes, size_t align, size_t min_bytes) {
+  if (bytes < min_bytes) {
+    return __hmap_sys_alloc(bytes, align);
+  }
+  size_t len = (bytes + __HMAP_HUGE_PAGE - 1) & ~(__HMAP_HUGE_PAGE - 1);
+
+  // Over-map to place the array on a huge page boundary, then trim.
+  char* map = mmap(NULL, len + __HMAP_HUGE_PAGE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  char* base = map + (-cast(uintptr_t, map) & (__HMAP_HUGE_PAGE - 1));
+  if (base != map) {
+    munmap(map, cast(size_t, base - map));
+  }
+  munmap(base + len, __HMAP_HUGE_PAGE - cast(size_t, base - map));
+  madvise(base, len, MADV_HUGEPAGE);
+  return base;
+}
+
+// Free PTR of BYTES, from __hmap_huge_alloc with the same MIN_BYTES.
+static inline void __attribute__((unused))
+__hmap_huge_free(void* ptr, size_t bytes, size_t min_bytes) {
+  if (bytes < min_bytes) {
+    free(ptr);
+  } else if (ptr != NULL) {
+    munmap(ptr, (bytes + __HMAP_HUGE_PAGE - 1) & ~(__HMAP_HUGE_PAGE - 1));
+  }
+}
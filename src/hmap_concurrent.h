@@ -0,0 +1,438 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// hmap_concurrent.h - The concurrent engine of hmap.h, included by it.
+//
+// The map is split into HMAP__SEGMENTS segments by the top bits of the hash,
+// each a group-probing table of its own (see hmap_swiss.h) with a spinlock for
+// writers, so writers only contend when they hit the same segment.
+//
+// Lookups never take the lock. Each segment has a sequence number which is odd
+// while a writer changes its slots. A lookup reads the number, probes, and
+// starts over if the number changed meanwhile, so a value copied out was never
+// torn by a writer. Since a lookup may read a slot as it is being written,
+// keys and values must be plain data, and KEY_EQ must not follow pointers.
+//
+// Growing builds a new slot array next to the old one, without bumping the
+// sequence number, so lookups carry on in the old array in the meantime. The
+// old array is retired, and freed by a later writer once every lookup which
+// may still read it has finished (see hmap_epoch.h). Arrays retired last stay
+// until HMAP(reclaim) or HMAP(destroy).
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "hmap_epoch.h"
+#include "hmap_group.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+struct HMAP(_bucket) {
+  HMAP_KEY_TYPE key;
+#ifndef HMAP_HASHSET
+  HMAP_VAL_TYPE val;
+#endif
+};
+
+// Slots of a segment, replaced as a whole when it grows.
+struct HMAP(_array) {
+  struct HMAP(_array)* retired; // Next array in a retired list.
+  struct HMAP(_bucket)* buckets;
+  size_t mask; // Number of slots - 1.
+  int8_t ctrl[] __attribute__((aligned(__HMAP_GROUP)));
+};
+
+struct HMAP(_segment) {
+  struct HMAP(_array)* _Atomic slots;
+  _Atomic size_t seq; // Odd while a writer changes the slots.
+  atomic_flag lock;   // Held by the segment's writer.
+  size_t num_items;
+  size_t growth_left; // Empty slots that may be filled before growing.
+} __attribute__((aligned(64)));
+
+// Arrays replaced by growing, which lookups may still read.
+struct HMAP(_retired) {
+  struct __hmap_epoch epoch; // Its lock guards the lists too.
+  struct HMAP(_array)* arrays[2]; // Retired since the last flip, and before.
+};
+
+struct HMAP_NAME {
+  struct HMAP(_segment)* segments;
+  struct HMAP(_retired)* retired;
+};
+
+#define HMAP__SEGMENTS 64lu
+// Segment picked by the top 6 bits of the hash.
+#define HMAP__SEGMENT(TABLE, HASH) (&(TABLE)->segments[(HASH) >> 58])
+#define HMAP__TAG(HASH) (cast(int8_t, (HASH) & 0x7f))
+#define HMAP__FIRST_GROUP(SLOTS, HASH)			\
+  (((HASH) >> 7) & (SLOTS)->mask & ~(__HMAP_GROUP - 1))
+
+#define HMAP__ENTRY(SLOTS, IDX) ((SLOTS)->buckets[(IDX)])
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline size_t
+HMAP(_capacity_for)(size_t count);
+
+static inline size_t
+HMAP(_growth_for)(size_t slots);
+
+static inline struct HMAP(_array)*
+HMAP(_array_new)(size_t slots);
+
+static inline void
+HMAP(_array_free)(struct HMAP(_array)* slots);
+
+static inline size_t
+HMAP(_free_slot)(const struct HMAP(_array)* slots, size_t hash);
+
+static inline size_t
+HMAP(_find)(const struct HMAP(_array)* slots, const HMAP_KEY_TYPE* key, size_t hash);
+
+static void __attribute__((noinline))
+HMAP(_grow_to)(struct HMAP_NAME* table, struct HMAP(_segment)* seg, size_t slots);
+
+static inline void
+HMAP(_retire)(struct HMAP_NAME* table, struct HMAP(_array)* slots);
+
+static inline void __attribute__((always_inline))
+HMAP(_lock)(struct HMAP(_segment)* seg);
+
+static inline void __attribute__((always_inline))
+HMAP(_unlock)(struct HMAP(_segment)* seg);
+
+static inline void __attribute__((always_inline))
+HMAP(_write_begin)(struct HMAP(_segment)* seg);
+
+static inline void __attribute__((always_inline))
+HMAP(_write_end)(struct HMAP(_segment)* seg);
+
+static inline void
+HMAP(_remove)(struct HMAP(_segment)* seg, struct HMAP(_array)* slots, size_t index);
+
+static inline bool
+HMAP(_read)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key, HMAP__RET* out);
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline size_t
+HMAP(_capacity_for)(size_t count) {
+  size_t slots = __HMAP_GROUP;
+  while ((float) slots * HMAP(_load_factor) < (float) count) {
+    slots *= 2;
+  }
+  return slots;
+}
+
+static inline size_t
+HMAP(_growth_for)(size_t slots) {
+  // A group with an empty slot ends every probe.
+  return min((size_t) ((float) slots * HMAP(_load_factor)), slots - 1);
+}
+
+static inline struct HMAP(_array)*
+HMAP(_array_new)(size_t slots) {
+  struct HMAP(_array)* res = aligned_alloc(__HMAP_GROUP, sizeof(*res) + slots);
+  memset(res->ctrl, __HMAP_EMPTY, slots);
+  res->buckets = sys_malloc_array(struct HMAP(_bucket), slots);
+  res->mask = slots - 1;
+  res->retired = NULL;
+  return res;
+}
+
+// Free SLOTS and the arrays it replaced.
+static inline void
+HMAP(_array_free)(struct HMAP(_array)* slots) {
+  while (slots != NULL) {
+    struct HMAP(_array)* retired = slots->retired;
+    free(slots->buckets);
+    free(slots);
+    slots = retired;
+  }
+}
+
+static inline size_t
+HMAP(_free_slot)(const struct HMAP(_array)* slots, size_t hash) {
+  size_t group = HMAP__FIRST_GROUP(slots, hash);
+  for (size_t step = __HMAP_GROUP;; group = (group + step) & slots->mask,
+	 step += __HMAP_GROUP) {
+    uint32_t open = __hmap_group_free_(&slots->ctrl[group]);
+    if (open != 0) {
+      return group + cast(size_t, __builtin_ctz(open));
+    }
+  }
+}
+
+static inline size_t
+HMAP(_find)(const struct HMAP(_array)* slots, const HMAP_KEY_TYPE* key, size_t hash) {
+  int8_t tag = HMAP__TAG(hash);
+  size_t group = HMAP__FIRST_GROUP(slots, hash);
+  // Visits each group at most once, since a lookup racing a writer may see
+  // every group full.
+  for (size_t step = __HMAP_GROUP; step <= slots->mask + 1;
+       group = (group + step) & slots->mask, step += __HMAP_GROUP) {
+    const int8_t* ctrl = &slots->ctrl[group];
+    for (uint32_t match = __hmap_group_match_(ctrl, tag); match != 0;
+	 match &= match - 1) {
+      size_t index = group + cast(size_t, __builtin_ctz(match));
+      if (likely(HMAP(_key_eq_fun)(&slots->buckets[index].key, key))) {
+	return index;
+      }
+    }
+    if (likely(__hmap_group_match_(ctrl, __HMAP_EMPTY) != 0)) {
+      break;
+    }
+  }
+  return HMAP__NONE;
+}
+
+static void
+HMAP(_grow_to)(struct HMAP_NAME* table, struct HMAP(_segment)* seg, size_t slots) {
+  struct HMAP(_array)* old = atomic_load_explicit(&seg->slots, memory_order_relaxed);
+  struct HMAP(_array)* res = HMAP(_array_new)(slots);
+
+  size_t index;
+  range_foreach(index, 0, old->mask + 1) {
+    if (old->ctrl[index] >= 0) {
+      size_t hash = HMAP(_hash_fun)(&old->buckets[index].key);
+      size_t slot = HMAP(_free_slot)(res, hash);
+      res->ctrl[slot] = HMAP__TAG(hash);
+      res->buckets[slot] = old->buckets[index];
+    }
+  }
+  seg->growth_left = HMAP(_growth_for)(slots) - seg->num_items;
+
+  // Both arrays hold the same entries, so lookups may read either one.
+  atomic_store_explicit(&seg->slots, res, memory_order_release);
+  HMAP(_retire)(table, old);
+}
+
+// Add SLOTS, no longer reachable from a segment, to the retired arrays, and
+// free those which no lookup can read anymore.
+static inline void
+HMAP(_retire)(struct HMAP_NAME* table, struct HMAP(_array)* slots) {
+  struct HMAP(_retired)* retired = table->retired;
+  while (atomic_flag_test_and_set_explicit(&retired->epoch.lock, memory_order_acquire)) {}
+
+  slots->retired = retired->arrays[0];
+  retired->arrays[0] = slots;
+  if (__hmap_epoch_flip(&retired->epoch)) {
+    HMAP(_array_free)(retired->arrays[1]);
+    retired->arrays[1] = retired->arrays[0];
+    retired->arrays[0] = NULL;
+  }
+
+  atomic_flag_clear_explicit(&retired->epoch.lock, memory_order_release);
+}
+
+static inline void
+HMAP(_lock)(struct HMAP(_segment)* seg) {
+  while (atomic_flag_test_and_set_explicit(&seg->lock, memory_order_acquire)) {}
+}
+
+static inline void
+HMAP(_unlock)(struct HMAP(_segment)* seg) {
+  atomic_flag_clear_explicit(&seg->lock, memory_order_release);
+}
+
+static inline void
+HMAP(_write_begin)(struct HMAP(_segment)* seg) {
+  size_t seq = atomic_load_explicit(&seg->seq, memory_order_relaxed);
+  atomic_store_explicit(&seg->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+static inline void
+HMAP(_write_end)(struct HMAP(_segment)* seg) {
+  size_t seq = atomic_load_explicit(&seg->seq, memory_order_relaxed);
+  atomic_store_explicit(&seg->seq, seq + 1, memory_order_release);
+}
+
+static inline void
+HMAP(_remove)(struct HMAP(_segment)* seg, struct HMAP(_array)* slots, size_t index) {
+  HMAP(_write_begin)(seg);
+  if (__hmap_group_match_(&slots->ctrl[index & ~(__HMAP_GROUP - 1)],
+			  __HMAP_EMPTY) != 0) {
+    slots->ctrl[index] = __HMAP_EMPTY;
+    ++seg->growth_left;
+  } else {
+    slots->ctrl[index] = __HMAP_ERASED;
+  }
+  HMAP(_write_end)(seg);
+  --seg->num_items;
+}
+
+static inline bool
+HMAP(_read)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key, HMAP__RET* out) {
+  size_t hash = HMAP(_hash_fun)(key);
+  struct HMAP(_segment)* seg = HMAP__SEGMENT(table, hash);
+  _Atomic size_t* readers = __hmap_epoch_enter(&table->retired->epoch);
+  for (;;) {
+    size_t seq = atomic_load_explicit(&seg->seq, memory_order_acquire);
+    if (unlikely(seq & 1)) {
+      continue;
+    }
+    // Pairs with the fence of __hmap_epoch_flip, see there.
+    const struct HMAP(_array)* slots = atomic_load(&seg->slots);
+    size_t found = HMAP(_find)(slots, key, hash);
+    HMAP__RET copy = { 0 };
+    if (found != HMAP__NONE && out != NULL) {
+      copy = HMAP__GET(slots, found);
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    if (likely(atomic_load_explicit(&seg->seq, memory_order_relaxed) == seq)) {
+      __hmap_epoch_exit(readers);
+      if (found != HMAP__NONE && out != NULL) {
+	*out = copy;
+      }
+      return found != HMAP__NONE;
+    }
+  }
+}
+
+static inline struct HMAP_NAME __attribute__((warn_unused_result))
+HMAP(new)() {
+  return HMAP(new_reserve)(0);
+}
+
+static inline struct HMAP_NAME __attribute__((warn_unused_result))
+HMAP(new_reserve)(size_t count) {
+  struct HMAP_NAME res;
+  res.segments = aligned_alloc(64, HMAP__SEGMENTS * sizeof(struct HMAP(_segment)));
+  res.retired = aligned_alloc(64, sizeof(struct HMAP(_retired)));
+  __hmap_epoch_init(&res.retired->epoch);
+  res.retired->arrays[0] = res.retired->arrays[1] = NULL;
+  size_t slots = HMAP(_capacity_for)((count + HMAP__SEGMENTS - 1) / HMAP__SEGMENTS);
+
+  struct HMAP(_segment)* seg;
+  array_foreach(seg, HMAP__SEGMENTS, res.segments) {
+    atomic_init(&seg->slots, HMAP(_array_new)(slots));
+    atomic_init(&seg->seq, 0);
+    atomic_flag_clear(&seg->lock);
+    seg->num_items = 0;
+    seg->growth_left = HMAP(_growth_for)(slots);
+  }
+  return res;
+}
+
+static inline void
+HMAP(reserve)(struct HMAP_NAME* table, size_t count) {
+  size_t slots = HMAP(_capacity_for)((count + HMAP__SEGMENTS - 1) / HMAP__SEGMENTS);
+
+  struct HMAP(_segment)* seg;
+  array_foreach(seg, HMAP__SEGMENTS, table->segments) {
+    HMAP(_lock)(seg);
+    if (slots > atomic_load_explicit(&seg->slots, memory_order_relaxed)->mask + 1) {
+      HMAP(_grow_to)(table, seg, slots);
+    }
+    HMAP(_unlock)(seg);
+  }
+}
+
+bool HMAP(insert)(struct HMAP_NAME* table,
+		  const HMAP_KEY_TYPE* key
+#ifndef HMAP_HASHSET
+		  , const HMAP_VAL_TYPE* val
+#endif
+  ) {
+  size_t hash = HMAP(_hash_fun)(key);
+  struct HMAP(_segment)* seg = HMAP__SEGMENT(table, hash);
+  HMAP(_lock)(seg);
+
+  struct HMAP(_array)* slots = atomic_load_explicit(&seg->slots, memory_order_relaxed);
+  bool fresh = HMAP(_find)(slots, key, hash) == HMAP__NONE;
+  if (fresh) {
+    size_t index = HMAP(_free_slot)(slots, hash);
+    if (unlikely(seg->growth_left == 0 && slots->ctrl[index] == __HMAP_EMPTY)) {
+      // Clear erased markers if they take up half the room, else double.
+      size_t cap = slots->mask + 1;
+      if ((float) (seg->num_items + 1) > (float) cap * HMAP(_load_factor) / 2) {
+	cap *= 2;
+      }
+      HMAP(_grow_to)(table, seg, cap);
+      slots = atomic_load_explicit(&seg->slots, memory_order_relaxed);
+      index = HMAP(_free_slot)(slots, hash);
+    }
+
+    HMAP(_write_begin)(seg);
+    seg->growth_left -= (slots->ctrl[index] == __HMAP_EMPTY);
+    slots->buckets[index].key = *key;
+#ifndef HMAP_HASHSET
+    slots->buckets[index].val = *val;
+#endif
+    slots->ctrl[index] = HMAP__TAG(hash);
+    HMAP(_write_end)(seg);
+    ++seg->num_items;
+  }
+
+  HMAP(_unlock)(seg);
+  return fresh;
+}
+
+#ifndef HMAP_HASHSET
+static inline bool
+HMAP(get_copy)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key,
+	       HMAP_VAL_TYPE* out) {
+  return HMAP(_read)(table, key, out);
+}
+#else
+static inline bool
+HMAP(contains)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key) {
+  return HMAP(_read)(table, key, NULL);
+}
+#endif
+
+bool HMAP(erase)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key) {
+  size_t hash = HMAP(_hash_fun)(key);
+  struct HMAP(_segment)* seg = HMAP__SEGMENT(table, hash);
+  HMAP(_lock)(seg);
+
+  struct HMAP(_array)* slots = atomic_load_explicit(&seg->slots, memory_order_relaxed);
+  size_t found = HMAP(_find)(slots, key, hash);
+  if (found != HMAP__NONE) {
+    HMAP(_remove)(seg, slots, found);
+  }
+
+  HMAP(_unlock)(seg);
+  return found != HMAP__NONE;
+}
+
+#ifndef HMAP_HASHSET
+bool HMAP(extract)(struct HMAP_NAME* table,
+		     const HMAP_KEY_TYPE* key,
+		     HMAP_VAL_TYPE* out_val) {
+  size_t hash = HMAP(_hash_fun)(key);
+  struct HMAP(_segment)* seg = HMAP__SEGMENT(table, hash);
+  HMAP(_lock)(seg);
+
+  struct HMAP(_array)* slots = atomic_load_explicit(&seg->slots, memory_order_relaxed);
+  size_t found = HMAP(_find)(slots, key, hash);
+  if (found != HMAP__NONE) {
+    *out_val = slots->buckets[found].val;
+    HMAP(_remove)(seg, slots, found);
+  }
+
+  HMAP(_unlock)(seg);
+  return found != HMAP__NONE;
+}
+#endif
+
+void HMAP(reclaim)(struct HMAP_NAME* table) {
+  struct HMAP(_array)** arrays;
+  array_foreach(arrays, 2lu, table->retired->arrays) {
+    HMAP(_array_free)(*arrays);
+    *arrays = NULL;
+  }
+}
+
+static inline void
+HMAP(destroy)(struct HMAP_NAME* table) {
+  struct HMAP(_segment)* seg;
+  array_foreach(seg, HMAP__SEGMENTS, table->segments) {
+    HMAP(_array_free)(atomic_load_explicit(&seg->slots, memory_order_relaxed));
+  }
+  HMAP(reclaim)(table);
+  free(table->segments);
+  free(table->retired);
+}
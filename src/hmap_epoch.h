@@ -0,0 +1,100 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// hmap_epoch.h - Grace periods of the concurrent hmap engine, telling when no
+//   lookup can still read a replaced slot array.
+//
+// A lookup counts itself in one of two counters, picked by the current parity,
+// for as long as it runs. Counters are striped over cache lines by thread, so
+// lookups from different threads mostly touch different lines. A writer may
+// flip the parity once no lookup is counted under the other one: every lookup
+// which started before the previous flip has finished by then. So an array
+// unpublished before a flip is unreachable after the next one.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "basic.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define __HMAP_EPOCH_STRIPES 16lu
+
+struct __hmap_epoch {
+  _Atomic unsigned parity; // Only flipped by a writer holding lock.
+  atomic_flag lock;
+  struct {
+    _Atomic size_t readers[2];
+  } __attribute__((aligned(64))) stripes[__HMAP_EPOCH_STRIPES];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline void __attribute__((unused))
+__hmap_epoch_init(struct __hmap_epoch* epoch);
+
+static inline _Atomic size_t* __attribute__((always_inline, unused))
+__hmap_epoch_enter(struct __hmap_epoch* epoch);
+
+static inline void __attribute__((always_inline, unused))
+__hmap_epoch_exit(_Atomic size_t* readers);
+
+static inline bool __attribute__((unused))
+__hmap_epoch_flip(struct __hmap_epoch* epoch);
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Only its address is used, which differs between threads.
+static _Thread_local char __hmap_epoch_thread_;
+
+static inline void
+__hmap_epoch_init(struct __hmap_epoch* epoch) {
+  atomic_init(&epoch->parity, 0);
+  atomic_flag_clear(&epoch->lock);
+  size_t stripe;
+  range_foreach(stripe, 0, __HMAP_EPOCH_STRIPES) {
+    atomic_init(&epoch->stripes[stripe].readers[0], 0);
+    atomic_init(&epoch->stripes[stripe].readers[1], 0);
+  }
+}
+
+// Count a lookup in EPOCH, returning the counter to give to __hmap_epoch_exit.
+static inline _Atomic size_t*
+__hmap_epoch_enter(struct __hmap_epoch* epoch) {
+  size_t stripe = ((cast(uintptr_t, &__hmap_epoch_thread_) * 0x9e3779b97f4a7c15lu)
+		   >> 32) % __HMAP_EPOCH_STRIPES;
+  for (;;) {
+    unsigned parity = atomic_load(&epoch->parity);
+    _Atomic size_t* readers = &epoch->stripes[stripe].readers[parity];
+    atomic_fetch_add(readers, 1);
+    // Counted under a parity since flipped, the flip may have missed it.
+    if (likely(atomic_load(&epoch->parity) == parity)) {
+      return readers;
+    }
+    atomic_fetch_sub(readers, 1);
+  }
+}
+
+static inline void
+__hmap_epoch_exit(_Atomic size_t* readers) {
+  atomic_fetch_sub_explicit(readers, 1, memory_order_release);
+}
+
+// Flip the parity of EPOCH unless lookups are counted under the other one.
+/////
+// Call with epoch->lock held, after unpublishing the arrays to retire.
+static inline bool
+__hmap_epoch_flip(struct __hmap_epoch* epoch) {
+  // Lookups counted after this see the arrays unpublished before it.
+  atomic_thread_fence(memory_order_seq_cst);
+  unsigned parity = atomic_load_explicit(&epoch->parity, memory_order_relaxed);
+  size_t stripe;
+  range_foreach(stripe, 0, __HMAP_EPOCH_STRIPES) {
+    if (atomic_load(&epoch->stripes[stripe].readers[parity ^ 1]) != 0) {
+      return false;
+    }
+  }
+  atomic_store(&epoch->parity, parity ^ 1);
+  return true;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// hmap_file.h - Map images saved to disk and mapped back, see HMAP_FILE in
+//   hmap.h.
+//
+// An image is a header followed by the slot arrays of a map, each starting on
+// a multiple of __HMAP_FILE_ALIGN bytes. Loading maps the file read-only and
+// points a map at the arrays in place, so lookups work on it at once and
+// the file's pages are shared by every process mapping it.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "basic.h"
+#include "error.h"
+#include "file_map.h"
+#include "region.h"
+
+#include <stdio.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Private
+
+#include <stdint.h>
+#include <string.h>
+
+#define HMAP_FILE_MAGIC 0x50414d48434b00lu // "\0KCHMAP"
+#define HMAP_FILE_VERSION 1u
+
+// Alignment of the header and the arrays in an image, a cache line.
+#define __HMAP_FILE_ALIGN 64lu
+
+// Written at the start of the file, followed by zeros up to the arrays.
+struct hmap_file_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t layout;     // Of the map type, see HMAP(_file_layout).
+  uint64_t slot_bound; // Index into the map type's slot bounds.
+  uint64_t num_items;
+  uint64_t bytes;      // Of the arrays, padding included.
+};
+
+// What __hmap_file_map expects of an image.
+struct hmap_file_expect {
+  uint32_t layout;
+  size_t (*bytes_for)(uint64_t slot_bound);
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline struct file_error __attribute__((warn_unused_result, unused))
+__hmap_file_write(const char* path, struct hmap_file_header header,
+		  size_t count, const void* const arrays[count],
+		  const size_t lens[count]);
+
+static inline struct file_error __attribute__((warn_unused_result, unused))
+__hmap_file_map(region_t, const char* path, uint32_t layout,
+		size_t (*bytes_for)(uint64_t slot_bound),
+		struct hmap_file_header* header, const char** arrays);
+
+static bool __attribute__((unused))
+__hmap_file_valid(const void* map, size_t len, const void* expect);
+
+////////////////////////////////////////////////////////////////////////////////
+
+#define __hmap_file_pad(BYTES)						\
+  (((BYTES) + __HMAP_FILE_ALIGN - 1) & ~(__HMAP_FILE_ALIGN - 1))
+
+// Write HEADER and the COUNT arrays of LENS bytes to the file PATH.
+static inline struct file_error
+__hmap_file_write(const char* path, struct hmap_file_header header,
+		  size_t count, const void* const arrays[count],
+		  const size_t lens[count]) {
+  _Static_assert(sizeof(struct hmap_file_header) <= __HMAP_FILE_ALIGN,
+		 "Map image header overlaps the arrays");
+  char pad[__HMAP_FILE_ALIGN] = { 0 };
+  size_t index;
+  header.magic = HMAP_FILE_MAGIC;
+  header.version = HMAP_FILE_VERSION;
+  header.bytes = 0;
+  range_foreach(index, 0, count) {
+    header.bytes += __hmap_file_pad(lens[index]);
+  }
+  memcpy(pad, &header, sizeof(header));
+
+  FILE* file = fopen(path, "wb");
+  if (file == NULL) {
+    return __file_error(FILE_ERROR_IO);
+  }
+  bool ok = fwrite(pad, 1, sizeof(pad), file) == sizeof(pad);
+  memset(pad, 0, sizeof(pad));
+  range_foreach(index, 0, count) {
+    size_t tail = __hmap_file_pad(lens[index]) - lens[index];
+    ok = ok && fwrite(arrays[index], 1, lens[index], file) == lens[index]
+      && fwrite(pad, 1, tail, file) == tail;
+  }
+  if (!ok) {
+    struct file_error err = __file_error(FILE_ERROR_IO);
+    fclose(file);
+    return err;
+  }
+  if (fclose(file) != 0) {
+    return __file_error(FILE_ERROR_IO);
+  }
+  return error_no(file_error);
+}
+
+// Map the file PATH, checking it holds an image of LAYOUT whose arrays take
+// BYTES_FOR(slot_bound) bytes, into HEADER and a pointer to its first array.
+// The mapping lives until REG is destroyed.
+static inline struct file_error
+__hmap_file_map(region_t region, const char* path, uint32_t layout,
+		size_t (*bytes_for)(uint64_t slot_bound),
+		struct hmap_file_header* header, const char** arrays) {
+  struct hmap_file_expect expect = { .layout = layout, .bytes_for = bytes_for };
+  const void* map;
+  struct file_error err =
+    __r_file_map_(region, path, __HMAP_FILE_ALIGN, __hmap_file_valid, &expect,
+		  &map);
+  if (!is_error(&err)) {
+    memcpy(header, map, sizeof(*header));
+    *arrays = as_bytes(map) + __HMAP_FILE_ALIGN;
+  }
+  return err;
+}
+
+static bool
+__hmap_file_valid(const void* map, size_t len, const void* expect) {
+  const struct hmap_file_expect* image = expect;
+  struct hmap_file_header header;
+  memcpy(&header, map, sizeof(header));
+  return header.magic == HMAP_FILE_MAGIC
+    && header.version == HMAP_FILE_VERSION
+    && header.layout == image->layout
+    && header.bytes == len - __HMAP_FILE_ALIGN
+    && header.bytes == image->bytes_for(header.slot_bound);
+}
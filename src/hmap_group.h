@@ -0,0 +1,78 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// hmap_group.h - Control byte groups of the group-probing hmap engines.
+//
+// Each slot has a control byte, the low 7 bits of its entry's hash or a marker
+// for an empty or erased slot. A group of __HMAP_GROUP control bytes is
+// matched at once, with SSE2 (16 slots) or AVX2 (32 slots) when compiled for
+// it and with a plain loop otherwise.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "basic.h"
+
+#include <stdint.h>
+
+#define __HMAP_EMPTY cast(int8_t, -128)
+#define __HMAP_ERASED cast(int8_t, -2)
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+#define __HMAP_GROUP 32lu
+
+// Mask of the slots in GROUP with control byte CTRL.
+static inline uint32_t __attribute__((always_inline, unused))
+__hmap_group_match_(const int8_t* group, int8_t ctrl) {
+  __m256i bytes = _mm256_load_si256(cast(const __m256i*, cast(const void*, group)));
+  return cast(uint32_t, _mm256_movemask_epi8(
+    _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(ctrl))));
+}
+
+// Mask of the empty or erased slots in GROUP.
+static inline uint32_t __attribute__((always_inline, unused))
+__hmap_group_free_(const int8_t* group) {
+  __m256i bytes = _mm256_load_si256(cast(const __m256i*, cast(const void*, group)));
+  return cast(uint32_t, _mm256_movemask_epi8(bytes));
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+#define __HMAP_GROUP 16lu
+
+static inline uint32_t __attribute__((always_inline, unused))
+__hmap_group_match_(const int8_t* group, int8_t ctrl) {
+  __m128i bytes = _mm_load_si128(cast(const __m128i*, cast(const void*, group)));
+  return cast(uint32_t, _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(ctrl))));
+}
+
+static inline uint32_t __attribute__((always_inline, unused))
+__hmap_group_free_(const int8_t* group) {
+  __m128i bytes = _mm_load_si128(cast(const __m128i*, cast(const void*, group)));
+  return cast(uint32_t, _mm_movemask_epi8(bytes));
+}
+#else
+#define __HMAP_GROUP 16lu
+
+static inline uint32_t __attribute__((always_inline, unused))
+__hmap_group_match_(const int8_t* group, int8_t ctrl) {
+  uint32_t res = 0;
+  uint32_t slot;
+  range_foreach(slot, 0, __HMAP_GROUP) {
+    res |= cast(uint32_t, group[slot] == ctrl) << slot;
+  }
+  return res;
+}
+
+static inline uint32_t __attribute__((always_inline, unused))
+__hmap_group_free_(const int8_t* group) {
+  uint32_t res = 0;
+  uint32_t slot;
+  range_foreach(slot, 0, __HMAP_GROUP) {
+    res |= cast(uint32_t, group[slot] < 0) << slot;
+  }
+  return res;
+}
+#endif
@@ -0,0 +1,287 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// hmap_ordered.h - The insertion-ordered engine of hmap.h, included by it.
+//
+// Entries are appended to a dense array in insertion order, and an index of
+// 32-bit positions in that array finds them. The index is probed linearly from
+// the low bits of the hash. Entries keep their hash, so probes compare keys
+// only on a hash match and growing rebuilds the index without hashing a key.
+// Iterating walks the entry array alone and yields entries in the order they
+// were inserted, across growth.
+//
+// Erasing marks the entry and its index slot dead. Growing copies the entry
+// array as a block, erased entries and all, then rebuilds only the index from
+// the stored hashes. Erased entries are compacted away in place once they take
+// up half the array, and when the map shrinks. The entry array has room for as
+// many entries as the index may hold.
+// Linear probing degrades faster than the other engines as the index fills,
+// so it is kept at most 3/4 full whatever HMAP_LOAD_FACTOR asks.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+
+struct HMAP_NAME {
+  uint32_t* index; // Positions of entries, HMAP__POS_EMPTY or HMAP__POS_ERASED.
+  struct HMAP(_bucket)* entries;
+  size_t mask; // Number of index slots - 1.
+  size_t len; // Entries appended, erased or not.
+  size_t cap; // Entries which fit before rebuilding.
+  size_t num_items;
+#ifdef HMAP_ALLOC_CTX
+  HMAP_ALLOC_CTX alloc;
+#endif
+};
+
+struct HMAP(_bucket) {
+  size_t hash; // With HMAP__HASH_LIVE set, 0 once erased.
+  HMAP_KEY_TYPE key;
+#ifndef HMAP_HASHSET
+  HMAP_VAL_TYPE val;
+#endif
+};
+
+#define HMAP__POS_EMPTY UINT32_MAX
+#define HMAP__POS_ERASED (UINT32_MAX - 1)
+#define HMAP__HASH_LIVE (SIZE_MAX ^ (SIZE_MAX >> 1))
+#define HMAP__ENTRY(TABLE, IDX) ((TABLE)->entries[(IDX)])
+#define HMAP__LIVE(TABLE, IDX) (HMAP__ENTRY(TABLE, IDX).hash != 0)
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline size_t
+HMAP(_capacity_for)(size_t count);
+
+static inline size_t
+HMAP(_entries_for)(size_t slots);
+
+static inline void
+HMAP(_init)(struct HMAP_NAME* table, size_t slots);
+
+static inline void
+HMAP(_create)(struct HMAP_NAME* table, size_t count);
+
+static void __attribute__((noinline))
+HMAP(_rebuild)(struct HMAP_NAME* table, size_t slots, bool compact);
+
+static inline size_t
+HMAP(_find)(const struct HMAP_NAME* table, const HMAP_KEY_TYPE* key, size_t hash);
+
+static inline size_t
+HMAP(_insert_slot)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key,
+		   size_t hash, bool* fresh);
+
+static inline void __attribute__((always_inline))
+HMAP(_prefetch)(const struct HMAP_NAME* table, size_t hash);
+
+static inline void
+HMAP(_remove)(struct HMAP_NAME* table, size_t index);
+
+static inline size_t
+HMAP(_next_live)(const struct HMAP_NAME* table, size_t index);
+
+static inline size_t __attribute__((always_inline))
+HMAP(_num_slots)(const struct HMAP_NAME* table);
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline size_t
+HMAP(_capacity_for)(size_t count) {
+  size_t slots = 8;
+  while (HMAP(_entries_for)(slots) < count) {
+    slots *= 2;
+  }
+  return slots;
+}
+
+static inline size_t
+HMAP(_entries_for)(size_t slots) {
+  // An empty index slot ends every probe.
+  size_t entries = (size_t) ((float) slots * min(HMAP(_load_factor), 0.75f));
+  return min(entries, slots - 1);
+}
+
+static inline void
+HMAP(_init)(struct HMAP_NAME* table, size_t slots) {
+  assertf(slots <= HMAP__POS_ERASED, "Ordered hmap of %lu slots", slots);
+  table->index = HMAP__ALLOC(table, uint32_t, slots, 1);
+  memset(table->index, 0xff, slots * sizeof(uint32_t));
+  table->cap = HMAP(_entries_for)(slots);
+  table->entries = HMAP__ALLOC(table, struct HMAP(_bucket), table->cap, 1);
+  table->mask = slots - 1;
+  table->len = 0;
+  table->num_items = 0;
+}
+
+// Index SLOTS slots, resizing the entry array to match and compacting it first
+// if COMPACT. Entries keep their position otherwise.
+static void
+HMAP(_rebuild)(struct HMAP_NAME* table, size_t slots, bool compact) {
+  assertf(slots <= HMAP__POS_ERASED, "Ordered hmap of %lu slots", slots);
+  size_t pos;
+  if (compact) {
+    size_t len = 0;
+    range_foreach(pos, 0, table->len) {
+      if (HMAP__LIVE(table, pos)) {
+	HMAP__ENTRY(table, len++) = HMAP__ENTRY(table, pos);
+      }
+    }
+    table->len = len;
+  }
+
+  size_t cap = HMAP(_entries_for)(slots);
+  if (cap != table->cap) {
+    struct HMAP(_bucket)* entries = HMAP__ALLOC(table, struct HMAP(_bucket), cap, 1);
+    memcpy(entries, table->entries, table->len * sizeof(*entries));
+    HMAP__FREE(table, table->entries, struct HMAP(_bucket), table->cap);
+    table->entries = entries;
+    table->cap = cap;
+  }
+  if (slots != table->mask + 1) {
+    HMAP__FREE(table, table->index, uint32_t, table->mask + 1);
+    table->index = HMAP__ALLOC(table, uint32_t, slots, 1);
+    table->mask = slots - 1;
+  }
+  memset(table->index, 0xff, slots * sizeof(uint32_t));
+
+  range_foreach(pos, 0, table->len) {
+    size_t hash = HMAP__ENTRY(table, pos).hash;
+    if (hash != 0) {
+      size_t slot = hash & table->mask;
+      while (table->index[slot] != HMAP__POS_EMPTY) {
+	slot = (slot + 1) & table->mask;
+      }
+      table->index[slot] = cast(uint32_t, pos);
+    }
+  }
+}
+
+static inline size_t
+HMAP(_find)(const struct HMAP_NAME* table, const HMAP_KEY_TYPE* key, size_t hash) {
+  hash |= HMAP__HASH_LIVE;
+  for (size_t slot = hash & table->mask;; slot = (slot + 1) & table->mask) {
+    uint32_t pos = table->index[slot];
+    if (pos == HMAP__POS_EMPTY) {
+      return HMAP__NONE;
+    }
+    if (pos != HMAP__POS_ERASED && HMAP__ENTRY(table, pos).hash == hash
+	&& likely(HMAP(_key_eq_fun)(&HMAP__ENTRY(table, pos).key, key))) {
+      return pos;
+    }
+  }
+}
+
+static inline size_t
+HMAP(_insert_slot)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key,
+		   size_t hash, bool* fresh) {
+  size_t index = HMAP(_find)(table, key, hash);
+  if (index != HMAP__NONE) {
+    *fresh = false;
+    return index;
+  }
+
+  if (unlikely(table->len == table->cap)) {
+    // Compact in place if erased entries take up half the room, else double.
+    if (table->num_items + 1 > table->cap / 2) {
+      HMAP(_rebuild)(table, 2 * (table->mask + 1), false);
+    } else {
+      HMAP(_rebuild)(table, table->mask + 1, true);
+    }
+  }
+
+  hash |= HMAP__HASH_LIVE;
+  size_t slot = hash & table->mask;
+  while (table->index[slot] != HMAP__POS_EMPTY) {
+    slot = (slot + 1) & table->mask;
+  }
+  index = table->len++;
+  table->index[slot] = cast(uint32_t, index);
+  HMAP__ENTRY(table, index).hash = hash;
+  HMAP__ENTRY(table, index).key = *key;
+  ++table->num_items;
+  *fresh = true;
+  return index;
+}
+
+static inline void
+HMAP(_prefetch)(const struct HMAP_NAME* table, size_t hash) {
+  __builtin_prefetch(&table->index[(hash | HMAP__HASH_LIVE) & table->mask]);
+}
+
+static inline void
+HMAP(_remove)(struct HMAP_NAME* table, size_t index) {
+  size_t slot = HMAP__ENTRY(table, index).hash & table->mask;
+  while (table->index[slot] != index) {
+    slot = (slot + 1) & table->mask;
+  }
+  table->index[slot] = HMAP__POS_ERASED;
+  HMAP__ENTRY(table, index).hash = 0;
+  --table->num_items;
+
+  if (table->num_items < table->cap / 4) {
+    size_t slots = HMAP(_capacity_for)(2 * table->num_items);
+    if (slots < table->mask + 1) {
+      HMAP(_rebuild)(table, slots, true);
+    }
+  }
+}
+
+static inline size_t
+HMAP(_next_live)(const struct HMAP_NAME* table, size_t index) {
+  while (index < table->len && !HMAP__LIVE(table, index)) {
+    ++index;
+  }
+  return index;
+}
+
+static inline size_t
+HMAP(_num_slots)(const struct HMAP_NAME* table) {
+  return table->len;
+}
+
+static inline void
+HMAP(_create)(struct HMAP_NAME* table, size_t count) {
+  HMAP(_init)(table, HMAP(_capacity_for)(count));
+}
+
+static inline void
+HMAP(reserve)(struct HMAP_NAME* table, size_t slots) {
+  if (HMAP(_capacity_for)(slots) > table->mask + 1) {
+    HMAP(_rebuild)(table, HMAP(_capacity_for)(slots), false);
+  }
+}
+
+static inline void
+HMAP(shrink_to_fit)(struct HMAP_NAME* table) {
+  size_t slots = HMAP(_capacity_for)(table->num_items);
+  if (slots < table->mask + 1 || table->num_items < table->len) {
+    HMAP(_rebuild)(table, slots, true);
+  }
+}
+
+// Distances count the index slots between an entry's home and its slot.
+static inline struct hmap_stats
+HMAP(stats)(const struct HMAP_NAME* table) {
+  struct hmap_stats res = { 0 };
+  size_t slot;
+  range_foreach(slot, 0, table->mask + 1) {
+    uint32_t pos = table->index[slot];
+    if (pos != HMAP__POS_EMPTY && pos != HMAP__POS_ERASED) {
+      size_t dist = (slot - HMAP__ENTRY(table, pos).hash) & table->mask;
+      res.max_dist = max(res.max_dist, dist);
+      ++res.dists[min(dist, HMAP_STATS_DISTS - 1)];
+    }
+  }
+  res.num_items = table->num_items;
+  res.num_slots = table->mask + 1;
+  res.load = (float) res.num_items / (float) res.num_slots;
+  res.bytes = table->cap * sizeof(struct HMAP(_bucket))
+    + res.num_slots * sizeof(uint32_t);
+  return res;
+}
+
+static inline void __attribute__((always_inline))
+HMAP(destroy)(struct HMAP_NAME* table) {
+  HMAP__FREE(table, table->index, uint32_t, table->mask + 1);
+  HMAP__FREE(table, table->entries, struct HMAP(_bucket), table->cap);
+}
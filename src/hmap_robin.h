@@ -0,0 +1,848 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// hmap_robin.h - The robinhood engine of hmap.h, included by it.
+//
+// Entries are kept in order of their home slots, each at most max_dist slots
+// past its home, so a lookup scans a short run of slots comparing probe
+// distances and hashes and stops at the first entry closer to its home than
+// the key would be.
+//
+// Capacities are primes by default, and the home slot of a hash is its
+// remainder. With HMAP_FASTMOD the hash is folded to 32 bits and the remainder
+// is computed by multiplying with a reciprocal of the capacity kept in the slot
+// bounds table instead of dividing, for capacities below 2^32.
+// With HMAP_POW2 capacities are powers of two instead, and the home slot is the
+// top bits of the hash multiplied by the golden ratio.
+//
+// By default each slot holds the entry with its hash and distance, or with the
+// top byte of its hash or none of it, as chosen by HMAP_STORED_HASH, trading
+// rehashing keys when growing for smaller slots. The hash comes first and the
+// distance last in a slot, so that small keys and values pack without padding.
+// With HMAP_SOA, distances and a byte of the hash live in a dense array of
+// their own, so probing reads two bytes a slot and only touches an entry to
+// compare keys, at the cost of rehashing keys when growing.
+//
+// With HMAP_INCREMENTAL, growing or shrinking on erase allocates the new table
+// but leaves the entries in the old one, and every insert and erase then moves
+// the entries of the next few old slots over. Lookups check the new table
+// first, then the part of the old one not yet migrated. Slot indices past the
+// new table's slots refer to the old table.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+struct HMAP_NAME {
+#ifdef HMAP_SOA
+  struct HMAP(_meta)* meta;
+  struct HMAP(_bucket)* buckets;
+#else
+  parray_t(struct HMAP(_bucket)) buckets;
+#endif
+  size_t num_items;
+  uint8_t slot_bound;
+#ifdef HMAP_INCREMENTAL
+  struct HMAP_NAME* old; // Table being migrated from, or NULL.
+  size_t cursor;         // Slots of old before it are migrated.
+#endif
+#ifdef HMAP_ALLOC_CTX
+  HMAP_ALLOC_CTX alloc;
+#endif
+};
+
+#ifdef HMAP_SOA
+struct HMAP(_meta) {
+  int8_t dist;
+  uint8_t frag; // Top byte of the hash.
+};
+
+struct HMAP(_bucket) {
+  HMAP_KEY_TYPE key;
+#ifndef HMAP_HASHSET
+  HMAP_VAL_TYPE val;
+#endif
+};
+#else
+struct HMAP(_bucket) {
+#if HMAP_STORED_HASH == HMAP_HASH_FULL
+  size_t hash;
+#endif
+  HMAP_KEY_TYPE key;
+#ifndef HMAP_HASHSET
+  HMAP_VAL_TYPE val;
+#endif
+#if HMAP_STORED_HASH == HMAP_HASH_FRAG
+  uint8_t frag; // Top byte of the hash.
+#endif
+  int8_t dist;
+};
+#endif
+
+struct HMAP(_slots) {
+  size_t cap;
+  int8_t max_dist;
+#if defined(HMAP_FASTMOD)
+  uint64_t magic; // 2^64 / cap rounded up, or 0 when cap doesn't fit 32 bits.
+#elif defined(HMAP_POW2)
+  uint8_t shift; // 64 - log2(cap).
+#endif
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Slot accessors, by layout. Distances are negative for empty slots.
+#define HMAP__FRAG(HASH) (cast(uint8_t, (HASH) >> 56))
+#ifdef HMAP_SOA
+#define HMAP__BUCKET(TABLE, IDX) ((TABLE)->buckets[(IDX)])
+#define HMAP__DIST(TABLE, IDX) ((TABLE)->meta[(IDX)].dist)
+#define HMAP__HASH_EQ(TABLE, IDX, HASH)			\
+  ((TABLE)->meta[(IDX)].frag == HMAP__FRAG(HASH))
+#define HMAP__SET_HASH(TABLE, IDX, HASH)		\
+  ((TABLE)->meta[(IDX)].frag = HMAP__FRAG(HASH))
+#define HMAP__HASH(TABLE, IDX)				\
+  (HMAP(_hash_fun)(&HMAP__BUCKET(TABLE, IDX).key))
+#else
+#define HMAP__BUCKET(TABLE, IDX) (parray_get(&(TABLE)->buckets, (IDX)))
+#define HMAP__DIST(TABLE, IDX) (HMAP__BUCKET(TABLE, IDX).dist)
+#if HMAP_STORED_HASH == HMAP_HASH_FULL
+#define HMAP__HASH_EQ(TABLE, IDX, HASH)		\
+  (HMAP__BUCKET(TABLE, IDX).hash == (HASH))
+#define HMAP__SET_HASH(TABLE, IDX, HASH)	\
+  (HMAP__BUCKET(TABLE, IDX).hash = (HASH))
+#define HMAP__HASH(TABLE, IDX)			\
+  (HMAP__BUCKET(TABLE, IDX).hash)
+#elif HMAP_STORED_HASH == HMAP_HASH_FRAG
+#define HMAP__HASH_EQ(TABLE, IDX, HASH)			\
+  (HMAP__BUCKET(TABLE, IDX).frag == HMAP__FRAG(HASH))
+#define HMAP__SET_HASH(TABLE, IDX, HASH)		\
+  (HMAP__BUCKET(TABLE, IDX).frag = HMAP__FRAG(HASH))
+#define HMAP__HASH(TABLE, IDX)				\
+  (HMAP(_hash_fun)(&HMAP__BUCKET(TABLE, IDX).key))
+#elif HMAP_STORED_HASH == HMAP_HASH_NONE
+#define HMAP__HASH_EQ(TABLE, IDX, HASH) true
+#define HMAP__SET_HASH(TABLE, IDX, HASH) ((void) 0)
+#define HMAP__HASH(TABLE, IDX)				\
+  (HMAP(_hash_fun)(&HMAP__BUCKET(TABLE, IDX).key))
+#else
+#error "HMAP_STORED_HASH must be HMAP_HASH_FULL, HMAP_HASH_FRAG or HMAP_HASH_NONE."
+#endif
+#endif
+#define HMAP__FULL(TABLE, IDX) (HMAP__DIST(TABLE, IDX) >= 0)
+#ifdef HMAP_INCREMENTAL
+#define HMAP__ENTRY(TABLE, IDX) (*HMAP(_entry)((TABLE), (IDX)))
+#define HMAP__LIVE(TABLE, IDX) (HMAP(_live)((TABLE), (IDX)))
+#else
+#define HMAP__ENTRY(TABLE, IDX) HMAP__BUCKET(TABLE, IDX)
+#define HMAP__LIVE(TABLE, IDX) HMAP__FULL(TABLE, IDX)
+#endif
+
+#ifdef HMAP_INCREMENTAL
+// Old slots migrated per insert or erase. A table grows by at most 2x, so this
+// finishes a migration long before the next growth is due.
+static const size_t HMAP(_migrate_slots) = 8;
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+#if defined(HMAP_POW2)
+#define HMAP__SLOTS(LOG) { 1lu << (LOG), (LOG), 64 - (LOG) }
+
+static const struct HMAP(_slots) HMAP(_slot_bounds)[] = {
+  HMAP__SLOTS(2), HMAP__SLOTS(3), HMAP__SLOTS(4), HMAP__SLOTS(5),
+  HMAP__SLOTS(6), HMAP__SLOTS(7), HMAP__SLOTS(8), HMAP__SLOTS(9),
+  HMAP__SLOTS(10), HMAP__SLOTS(11), HMAP__SLOTS(12), HMAP__SLOTS(13),
+  HMAP__SLOTS(14), HMAP__SLOTS(15), HMAP__SLOTS(16), HMAP__SLOTS(17),
+  HMAP__SLOTS(18), HMAP__SLOTS(19), HMAP__SLOTS(20), HMAP__SLOTS(21),
+  HMAP__SLOTS(22), HMAP__SLOTS(23), HMAP__SLOTS(24), HMAP__SLOTS(25),
+  HMAP__SLOTS(26), HMAP__SLOTS(27), HMAP__SLOTS(28), HMAP__SLOTS(29),
+  HMAP__SLOTS(30), HMAP__SLOTS(31), HMAP__SLOTS(32), HMAP__SLOTS(33),
+  HMAP__SLOTS(34), HMAP__SLOTS(35), HMAP__SLOTS(36), HMAP__SLOTS(37),
+  HMAP__SLOTS(38), HMAP__SLOTS(39), HMAP__SLOTS(40), HMAP__SLOTS(41),
+  HMAP__SLOTS(42), HMAP__SLOTS(43), HMAP__SLOTS(44), HMAP__SLOTS(45),
+  HMAP__SLOTS(46), HMAP__SLOTS(47), HMAP__SLOTS(48), HMAP__SLOTS(49),
+  HMAP__SLOTS(50), HMAP__SLOTS(51), HMAP__SLOTS(52), HMAP__SLOTS(53),
+  HMAP__SLOTS(54), HMAP__SLOTS(55), HMAP__SLOTS(56), HMAP__SLOTS(57),
+  HMAP__SLOTS(58), HMAP__SLOTS(59), HMAP__SLOTS(60), HMAP__SLOTS(61)
+};
+#else
+#if defined(HMAP_FASTMOD)
+#define HMAP__SLOTS(CAP, MAX_DIST)					\
+  { (CAP), (MAX_DIST), ((CAP) <= UINT32_MAX) ? UINT64_MAX / (CAP) + 1 : 0 }
+#else
+#define HMAP__SLOTS(CAP, MAX_DIST) { (CAP), (MAX_DIST) }
+#endif
+
+static const struct HMAP(_slots) HMAP(_slot_bounds)[] = {
+  HMAP__SLOTS(5lu, 2), HMAP__SLOTS(7lu, 3), HMAP__SLOTS(11lu, 3),
+  HMAP__SLOTS(17lu, 4), HMAP__SLOTS(23lu, 5), HMAP__SLOTS(37lu, 5),
+  HMAP__SLOTS(53lu, 6), HMAP__SLOTS(79lu, 6), HMAP__SLOTS(113lu, 7),
+  HMAP__SLOTS(163lu, 7), HMAP__SLOTS(229lu, 8), HMAP__SLOTS(331lu, 8),
+  HMAP__SLOTS(463lu, 9), HMAP__SLOTS(653lu, 9), HMAP__SLOTS(919lu, 10),
+  HMAP__SLOTS(1289lu, 10), HMAP__SLOTS(1811lu, 11), HMAP__SLOTS(2539lu, 11),
+  HMAP__SLOTS(3557lu, 12), HMAP__SLOTS(4987lu, 12), HMAP__SLOTS(6983lu, 13),
+  HMAP__SLOTS(9781lu, 13), HMAP__SLOTS(13693lu, 14), HMAP__SLOTS(19181lu, 14),
+  HMAP__SLOTS(26861lu, 15), HMAP__SLOTS(37607lu, 15), HMAP__SLOTS(52667lu, 16),
+  HMAP__SLOTS(73751lu, 16), HMAP__SLOTS(103289lu, 17),
+  HMAP__SLOTS(144611lu, 17), HMAP__SLOTS(202471lu, 18),
+  HMAP__SLOTS(283463lu, 18), HMAP__SLOTS(396871lu, 19),
+  HMAP__SLOTS(555637lu, 19), HMAP__SLOTS(777901lu, 20),
+  HMAP__SLOTS(1089091lu, 20), HMAP__SLOTS(1524763lu, 21),
+  HMAP__SLOTS(2134697lu, 21), HMAP__SLOTS(2988607lu, 22),
+  HMAP__SLOTS(4184087lu, 22), HMAP__SLOTS(5857727lu, 22),
+  HMAP__SLOTS(8200847lu, 23), HMAP__SLOTS(11481199lu, 23),
+  HMAP__SLOTS(16073693lu, 24), HMAP__SLOTS(22503181lu, 24),
+  HMAP__SLOTS(31504453lu, 25), HMAP__SLOTS(44106241lu, 25),
+  HMAP__SLOTS(61748749lu, 26), HMAP__SLOTS(86448259lu, 26),
+  HMAP__SLOTS(121027583lu, 27), HMAP__SLOTS(169438627lu, 27),
+  HMAP__SLOTS(237214097lu, 28), HMAP__SLOTS(332099741lu, 28),
+  HMAP__SLOTS(464939639lu, 29), HMAP__SLOTS(650915521lu, 29),
+  HMAP__SLOTS(911281733lu, 30), HMAP__SLOTS(1275794449lu, 30),
+  HMAP__SLOTS(1786112231lu, 31), HMAP__SLOTS(2500557133lu, 31),
+  HMAP__SLOTS(3500779987lu, 32), HMAP__SLOTS(4901092003lu, 32),
+  HMAP__SLOTS(6861528851lu, 33), HMAP__SLOTS(9606140399lu, 33),
+  HMAP__SLOTS(13448596583lu, 34), HMAP__SLOTS(18828035323lu, 34),
+  HMAP__SLOTS(26359249459lu, 35), HMAP__SLOTS(36902949287lu, 35),
+  HMAP__SLOTS(51664129003lu, 36), HMAP__SLOTS(72329780647lu, 36),
+  HMAP__SLOTS(101261692921lu, 37), HMAP__SLOTS(141766370143lu, 37),
+  HMAP__SLOTS(198472918207lu, 38), HMAP__SLOTS(277862085493lu, 38),
+  HMAP__SLOTS(389006919737lu, 39), HMAP__SLOTS(544609687669lu, 39),
+  HMAP__SLOTS(762453562751lu, 39), HMAP__SLOTS(1067434987873lu, 40),
+  HMAP__SLOTS(1494408983027lu, 40), HMAP__SLOTS(2092172576243lu, 41),
+  HMAP__SLOTS(2929041606761lu, 41), HMAP__SLOTS(4100658249511lu, 42),
+  HMAP__SLOTS(5740921549367lu, 42), HMAP__SLOTS(8037290169151lu, 43),
+  HMAP__SLOTS(11252206236863lu, 43), HMAP__SLOTS(15753088731613lu, 44),
+  HMAP__SLOTS(22054324224277lu, 44), HMAP__SLOTS(30876053913989lu, 45),
+  HMAP__SLOTS(43226475479591lu, 45), HMAP__SLOTS(60517065671459lu, 46),
+  HMAP__SLOTS(84723891940099lu, 46), HMAP__SLOTS(118613448716141lu, 47),
+  HMAP__SLOTS(166058828202599lu, 47), HMAP__SLOTS(232482359483653lu, 48),
+  HMAP__SLOTS(325475303277143lu, 48), HMAP__SLOTS(455665424588069lu, 49),
+  HMAP__SLOTS(637931594423311lu, 49), HMAP__SLOTS(893104232192647lu, 50),
+  HMAP__SLOTS(1250345925069739lu, 50), HMAP__SLOTS(1750484295097673lu, 51),
+  HMAP__SLOTS(2450678013136757lu, 51), HMAP__SLOTS(3430949218391537lu, 52),
+  HMAP__SLOTS(4803328905748207lu, 52), HMAP__SLOTS(6724660468047551lu, 53),
+  HMAP__SLOTS(9414524655266669lu, 53), HMAP__SLOTS(13180334517373357lu, 54),
+  HMAP__SLOTS(18452468324322709lu, 54), HMAP__SLOTS(25833455654051813lu, 55),
+  HMAP__SLOTS(36166837915672573lu, 55), HMAP__SLOTS(50633573081941709lu, 55),
+  HMAP__SLOTS(70887002314718437lu, 56), HMAP__SLOTS(99241803240605819lu, 56),
+  HMAP__SLOTS(138938524536848189lu, 57), HMAP__SLOTS(194513934351587491lu, 57),
+  HMAP__SLOTS(272319508092222467lu, 58), HMAP__SLOTS(381247311329111473lu, 58),
+  HMAP__SLOTS(533746235860756057lu, 59), HMAP__SLOTS(747244730205058483lu, 59),
+  HMAP__SLOTS(1046142622287081827lu, 60),
+  HMAP__SLOTS(1464599671201914671lu, 60),
+  HMAP__SLOTS(2050439539682680411lu, 61),
+  HMAP__SLOTS(2870615355555752471lu, 61)
+};
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline size_t __attribute__((always_inline))
+HMAP(_slot_count)(uint8_t slot_bound);
+
+static inline size_t __attribute__((always_inline))
+HMAP(_slot_load_count)(uint8_t slot_bound);
+
+static inline uint8_t __attribute__((always_inline))
+HMAP(_find_slot_bound)(size_t slots);
+
+static inline size_t __attribute__((always_inline))
+HMAP(_home)(const struct HMAP_NAME* table, size_t hash);
+
+static inline void
+HMAP(_rebuild)(struct HMAP_NAME* table, uint8_t slot_bound);
+
+static inline void
+HMAP(_resize)(struct HMAP_NAME* table, uint8_t slot_bound);
+
+static inline void __attribute__((always_inline))
+HMAP(_free_slots)(struct HMAP_NAME* table);
+
+static inline void
+HMAP(_create)(struct HMAP_NAME* table, size_t count);
+
+static inline size_t
+HMAP(_place)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key, size_t hash,
+	     bool* fresh);
+
+static inline size_t
+HMAP(_probe)(const struct HMAP_NAME* table, const HMAP_KEY_TYPE* key, size_t hash);
+
+static inline void __attribute__((always_inline))
+HMAP(_prefetch)(const struct HMAP_NAME* table, size_t hash);
+
+static inline size_t
+HMAP(_find)(const struct HMAP_NAME* table, const HMAP_KEY_TYPE* key, size_t hash);
+
+static inline void
+HMAP(_remove_at)(struct HMAP_NAME* table, size_t index);
+
+static inline void
+HMAP(_stats_add)(const struct HMAP_NAME* table, size_t from,
+		 struct hmap_stats* stats);
+
+static inline void
+HMAP(_remove)(struct HMAP_NAME* table, size_t index);
+
+static inline size_t
+HMAP(_next_live)(const struct HMAP_NAME* table, size_t index);
+
+#ifdef HMAP_INCREMENTAL
+static inline struct HMAP(_bucket)* __attribute__((always_inline))
+HMAP(_entry)(struct HMAP_NAME* table, size_t index);
+
+static inline bool __attribute__((always_inline))
+HMAP(_live)(const struct HMAP_NAME* table, size_t index);
+
+static inline void
+HMAP(_migrate_entry)(struct HMAP_NAME* table, struct HMAP_NAME* old, size_t index);
+
+static inline void
+HMAP(_migrate_step)(struct HMAP_NAME* table);
+
+static void
+HMAP(_migrate_all)(struct HMAP_NAME* table);
+#endif
+
+static inline size_t
+HMAP(_insert_slot)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key,
+		   size_t hash, bool* fresh);
+
+static inline size_t __attribute__((always_inline))
+HMAP(_num_slots)(const struct HMAP_NAME* table);
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline size_t __attribute__((always_inline))
+HMAP(_slot_count)(uint8_t slot_bound) {
+  return HMAP(_slot_bounds)[slot_bound].cap
+    + (uint8_t) HMAP(_slot_bounds)[slot_bound].max_dist;
+}
+
+static inline size_t __attribute__((always_inline))
+HMAP(_slot_load_count)(uint8_t slot_bound) {
+  return (size_t) lround((float) HMAP(_slot_count)(slot_bound) * HMAP(_load_factor));
+}
+
+static inline uint8_t __attribute__((always_inline))
+HMAP(_find_slot_bound)(size_t slots) {
+  uint8_t slot_bound;
+  range_foreach(slot_bound, 0, array_len(HMAP(_slot_bounds))) {
+    if (HMAP(_slot_load_count)(slot_bound) >= slots) {
+      return slot_bound;
+    }
+  }
+  return slot_bound;
+}
+
+static inline size_t __attribute__((always_inline))
+HMAP(_home)(const struct HMAP_NAME* table, size_t hash) {
+  const struct HMAP(_slots)* slots = &HMAP(_slot_bounds)[table->slot_bound];
+#if defined(HMAP_POW2)
+  return (hash * 0x9e3779b97f4a7c15lu) >> slots->shift;
+#elif defined(HMAP_FASTMOD)
+  if (unlikely(slots->magic == 0)) {
+    return hash % slots->cap;
+  }
+  // The fraction of folded / cap is in the low bits of folded * magic.
+  uint64_t folded = cast(uint32_t, hash ^ (hash >> 32));
+  uint64_t frac = slots->magic * folded;
+  return cast(size_t, (cast(__uint128_t, frac) * slots->cap) >> 64);
+#else
+  return hash % slots->cap;
+#endif
+}
+
+static inline void
+HMAP(_init)(struct HMAP_NAME* table, uint8_t slot_bound) {
+  size_t slot_count = HMAP(_slot_count)(slot_bound);
+
+#ifdef HMAP_SOA
+  table->meta = HMAP__ALLOC(table, struct HMAP(_meta), slot_count, 1);
+  table->buckets = HMAP__ALLOC(table, struct HMAP(_bucket), slot_count, 1);
+#else
+  parray_init(&table->buckets,
+	      HMAP__ALLOC(table, struct HMAP(_bucket), slot_count, 1),
+	      slot_count);
+#endif
+
+  size_t index;
+  range_foreach(index, 0, slot_count) {
+    HMAP__DIST(table, index) = -1;
+  }
+  table->num_items = 0;
+  table->slot_bound = slot_bound;
+#ifdef HMAP_INCREMENTAL
+  table->old = NULL;
+  table->cursor = 0;
+#endif
+}
+
+static inline void
+HMAP(_rebuild)(struct HMAP_NAME* table, uint8_t slot_bound) {
+  struct HMAP_NAME res;
+#ifdef HMAP_ALLOC_CTX
+  res.alloc = table->alloc;
+#endif
+  HMAP(_init)(&res, slot_bound);
+
+  size_t index;
+  range_foreach(index, 0, HMAP(_slot_count)(table->slot_bound)) {
+    if (HMAP__DIST(table, index) >= 0) {
+      bool fresh;
+      size_t slot = HMAP(_place)(&res, &HMAP__BUCKET(table, index).key,
+				 HMAP__HASH(table, index), &fresh);
+      int8_t dist = HMAP__DIST(&res, slot);
+      HMAP__BUCKET(&res, slot) = HMAP__BUCKET(table, index);
+      HMAP__DIST(&res, slot) = dist;
+    }
+  }
+
+  HMAP(destroy)(table);
+  *table = res;
+}
+
+// Move the entries to a table of SLOT_BOUND, over the next inserts and erases
+// with HMAP_INCREMENTAL.
+static inline void
+HMAP(_resize)(struct HMAP_NAME* table, uint8_t slot_bound) {
+#ifdef HMAP_INCREMENTAL
+  HMAP(_migrate_all)(table);
+  struct HMAP_NAME* old = HMAP__ALLOC(table, struct HMAP_NAME, 1, 1);
+  *old = *table;
+  HMAP(_init)(table, slot_bound);
+  table->old = old;
+#else
+  HMAP(_rebuild)(table, slot_bound);
+#endif
+}
+
+// Move the slots [FROM, TO) up by one, a step further from their homes.
+static inline void
+HMAP(_shift_up)(struct HMAP_NAME* table, size_t from, size_t to) {
+  memmove(&HMAP__BUCKET(table, from + 1), &HMAP__BUCKET(table, from),
+	  (to - from) * sizeof(struct HMAP(_bucket)));
+#ifdef HMAP_SOA
+  memmove(&table->meta[from + 1], &table->meta[from],
+	  (to - from) * sizeof(struct HMAP(_meta)));
+#endif
+  size_t index;
+  range_foreach(index, from + 1, to + 1) {
+    ++HMAP__DIST(table, index);
+  }
+}
+
+// Move the slots (FROM, TO) down by one, emptying TO - 1.
+static inline void
+HMAP(_shift_down)(struct HMAP_NAME* table, size_t from, size_t to) {
+  memmove(&HMAP__BUCKET(table, from), &HMAP__BUCKET(table, from + 1),
+	  (to - from - 1) * sizeof(struct HMAP(_bucket)));
+#ifdef HMAP_SOA
+  memmove(&table->meta[from], &table->meta[from + 1],
+	  (to - from - 1) * sizeof(struct HMAP(_meta)));
+#endif
+  size_t index;
+  range_foreach(index, from, to - 1) {
+    --HMAP__DIST(table, index);
+  }
+  HMAP__DIST(table, to - 1) = -1;
+}
+
+// Find the slot of KEY, or make room for it at its place in the probe order.
+/////
+// A new key is stored without a value and FRESH is set. Distances never reach
+// max_dist, so the last slot of the table is always empty.
+static inline size_t
+HMAP(_place)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key, size_t hash,
+	     bool* fresh) {
+  int8_t max_dist, dist;
+  size_t index, end;
+  bool full;
+
+place:
+  max_dist = HMAP(_slot_bounds)[table->slot_bound].max_dist;
+  index = HMAP(_home)(table, hash);
+  for (dist = 0; HMAP__DIST(table, index) >= dist; ++index, ++dist) {
+    if (HMAP__HASH_EQ(table, index, hash)
+	&& HMAP(_key_eq_fun)(&HMAP__BUCKET(table, index).key, key)) {
+      *fresh = false;
+      return index;
+    }
+  }
+
+  // Entries from here on are further from their homes, shift them up a slot.
+  full = dist == max_dist;
+  for (end = index; !full && HMAP__DIST(table, end) >= 0; ++end) {
+    full = HMAP__DIST(table, end) + 1 == max_dist;
+  }
+  if (full) {
+    HMAP(_resize)(table, table->slot_bound + 1);
+    goto place;
+  }
+
+  HMAP(_shift_up)(table, index, end);
+  HMAP__DIST(table, index) = dist;
+  HMAP__SET_HASH(table, index, hash);
+  HMAP__BUCKET(table, index).key = *key;
+  ++table->num_items;
+  *fresh = true;
+  return index;
+}
+
+static inline void
+HMAP(_create)(struct HMAP_NAME* table, size_t count) {
+  HMAP(_init)(table, HMAP(_find_slot_bound)(count));
+}
+
+static inline void
+HMAP(reserve)(struct HMAP_NAME* table, size_t slots) {
+#ifdef HMAP_INCREMENTAL
+  HMAP(_migrate_all)(table);
+#endif
+  uint8_t slot_bound = HMAP(_find_slot_bound)(slots);
+  if (slot_bound > table->slot_bound) {
+    HMAP(_rebuild)(table, slot_bound);
+  }
+}
+
+static inline void
+HMAP(shrink_to_fit)(struct HMAP_NAME* table) {
+#ifdef HMAP_INCREMENTAL
+  HMAP(_migrate_all)(table);
+#endif
+  uint8_t slot_bound = HMAP(_find_slot_bound)(table->num_items);
+  if (slot_bound < table->slot_bound) {
+    HMAP(_rebuild)(table, slot_bound);
+  }
+}
+
+// Count the entries of TABLE alone from slot FROM on into STATS.
+static inline void
+HMAP(_stats_add)(const struct HMAP_NAME* table, size_t from,
+		 struct hmap_stats* stats) {
+  size_t slot_count = HMAP(_slot_count)(table->slot_bound), index;
+  range_foreach(index, from, slot_count) {
+    int8_t dist = HMAP__DIST(table, index);
+    if (dist >= 0) {
+      stats->max_dist = max(stats->max_dist, cast(size_t, dist));
+      ++stats->dists[min(cast(size_t, dist), HMAP_STATS_DISTS - 1)];
+    }
+  }
+  stats->num_items += table->num_items;
+  stats->num_slots += slot_count;
+#ifdef HMAP_SOA
+  stats->bytes += slot_count
+    * (sizeof(struct HMAP(_bucket)) + sizeof(struct HMAP(_meta)));
+#else
+  stats->bytes += slot_count * sizeof(struct HMAP(_bucket));
+#endif
+}
+
+static inline struct hmap_stats
+HMAP(stats)(const struct HMAP_NAME* table) {
+  struct hmap_stats res = { 0 };
+  HMAP(_stats_add)(table, 0, &res);
+#ifdef HMAP_INCREMENTAL
+  if (table->old != NULL) {
+    // Entries before the cursor are stale copies of migrated ones.
+    HMAP(_stats_add)(table->old, table->cursor, &res);
+  }
+#endif
+  res.load = (float) res.num_items / (float) res.num_slots;
+  return res;
+}
+static inline size_t
+HMAP(_insert_slot)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key,
+		   size_t hash, bool* fresh) {
+  size_t count = table->num_items;
+#ifdef HMAP_INCREMENTAL
+  if (table->old != NULL) {
+    HMAP(_migrate_step)(table);
+    count = table->num_items + ((table->old != NULL) ? table->old->num_items : 0);
+  }
+#endif
+  if (count + 1 > HMAP(_slot_load_count)(table->slot_bound)) {
+    HMAP(_resize)(table, table->slot_bound + 1);
+  }
+#ifdef HMAP_INCREMENTAL
+  if (table->old != NULL) {
+    size_t index = HMAP(_probe)(table->old, key, hash);
+    if (index != HMAP__NONE && index >= table->cursor) {
+      *fresh = false;
+      return HMAP(_slot_count)(table->slot_bound) + index;
+    }
+  }
+#endif
+  return HMAP(_place)(table, key, hash, fresh);
+}
+
+static inline size_t
+HMAP(_num_slots)(const struct HMAP_NAME* table) {
+  size_t slots = HMAP(_slot_count)(table->slot_bound);
+#ifdef HMAP_INCREMENTAL
+  if (table->old != NULL) {
+    slots += HMAP(_slot_count)(table->old->slot_bound);
+  }
+#endif
+  return slots;
+}
+
+static inline void
+HMAP(_prefetch)(const struct HMAP_NAME* table, size_t hash) {
+  size_t index = HMAP(_home)(table, hash);
+#ifdef HMAP_SOA
+  __builtin_prefetch(&table->meta[index]);
+  __builtin_prefetch(&table->buckets[index]);
+#else
+  __builtin_prefetch(&parray_get(&table->buckets, index));
+#endif
+}
+
+// Find the slot of KEY in TABLE alone.
+static inline size_t
+HMAP(_probe)(const struct HMAP_NAME* table, const HMAP_KEY_TYPE* key, size_t hash) {
+  size_t index = HMAP(_home)(table, hash);
+  for (int8_t dist = 0;; ++index, ++dist) {
+    if (HMAP__DIST(table, index) < dist) {
+      return HMAP__NONE;
+    } else if (HMAP__HASH_EQ(table, index, hash)
+	       && HMAP(_key_eq_fun)(&HMAP__BUCKET(table, index).key, key)) {
+      return index;
+    }
+  }
+
+  UNREACHABLE;
+}
+
+static inline size_t
+HMAP(_find)(const struct HMAP_NAME* table, const HMAP_KEY_TYPE* key, size_t hash) {
+  size_t index = HMAP(_probe)(table, key, hash);
+#ifdef HMAP_INCREMENTAL
+  if (index == HMAP__NONE && unlikely(table->old != NULL)) {
+    // Entries before the cursor are stale copies of migrated ones.
+    index = HMAP(_probe)(table->old, key, hash);
+    return (index != HMAP__NONE && index >= table->cursor)
+      ? HMAP(_slot_count)(table->slot_bound) + index : HMAP__NONE;
+  }
+#endif
+  return index;
+}
+
+// Empty the slot INDEX of TABLE alone, shifting back the entries after it.
+static inline void
+HMAP(_remove_at)(struct HMAP_NAME* table, size_t index) {
+  size_t end = index + 1;
+  while (HMAP__DIST(table, end) >= 1) {
+    ++end;
+  }
+  HMAP(_shift_down)(table, index, end);
+  --table->num_items;
+}
+
+static inline void
+HMAP(_remove)(struct HMAP_NAME* table, size_t index) {
+#ifdef HMAP_INCREMENTAL
+  size_t slots = HMAP(_slot_count)(table->slot_bound);
+  if (index >= slots) {
+    // Only entries from the cursor on are shifted back, so none is skipped.
+    HMAP(_remove_at)(table->old, index - slots);
+  } else {
+    HMAP(_remove_at)(table, index);
+  }
+  if (table->old != NULL) {
+    HMAP(_migrate_step)(table);
+    return; // Shrinking waits for the migration to finish.
+  }
+#else
+  HMAP(_remove_at)(table, index);
+#endif
+  if (table->num_items < HMAP(_slot_load_count)(table->slot_bound) / 4) {
+    uint8_t slot_bound = HMAP(_find_slot_bound)(2 * table->num_items);
+    if (slot_bound < table->slot_bound) {
+      HMAP(_resize)(table, slot_bound);
+    }
+  }
+}
+
+static inline size_t
+HMAP(_next_live)(const struct HMAP_NAME* table, size_t index) {
+  size_t end = HMAP(_num_slots)(table);
+  while (index < end && !HMAP__LIVE(table, index)) {
+    ++index;
+  }
+  return index;
+}
+
+#ifdef HMAP_INCREMENTAL
+static inline struct HMAP(_bucket)*
+HMAP(_entry)(struct HMAP_NAME* table, size_t index) {
+  size_t slots = HMAP(_slot_count)(table->slot_bound);
+  return likely(index < slots)
+    ? &HMAP__BUCKET(table, index) : &HMAP__BUCKET(table->old, index - slots);
+}
+
+static inline bool
+HMAP(_live)(const struct HMAP_NAME* table, size_t index) {
+  size_t slots = HMAP(_slot_count)(table->slot_bound);
+  if (likely(index < slots)) {
+    return HMAP__FULL(table, index);
+  }
+  index -= slots;
+  return index >= table->cursor && HMAP__FULL(table->old, index);
+}
+
+// Move the entry in slot INDEX of OLD into TABLE.
+static inline void
+HMAP(_migrate_entry)(struct HMAP_NAME* table, struct HMAP_NAME* old, size_t index) {
+  // Copied out first, as placing it may grow the table and free OLD.
+  struct HMAP(_bucket) bucket = HMAP__BUCKET(old, index);
+  size_t hash = HMAP__HASH(old, index);
+  --old->num_items;
+
+  bool fresh;
+  size_t slot = HMAP(_place)(table, &bucket.key, hash, &fresh);
+  int8_t dist = HMAP__DIST(table, slot);
+  HMAP__BUCKET(table, slot) = bucket;
+  HMAP__DIST(table, slot) = dist;
+}
+
+// Migrate the next few slots of the old table, freeing it once done.
+static inline void
+HMAP(_migrate_step)(struct HMAP_NAME* table) {
+  struct HMAP_NAME* old = table->old;
+  uint8_t slot_bound = table->slot_bound;
+  size_t slots = HMAP(_slot_count)(old->slot_bound);
+  size_t end = min(table->cursor + HMAP(_migrate_slots), slots);
+
+  while (table->cursor < end) {
+    size_t index = table->cursor++;
+    if (HMAP__FULL(old, index)) {
+      HMAP(_migrate_entry)(table, old, index);
+      if (table->slot_bound != slot_bound) {
+	return; // Grew, which finished this migration.
+      }
+    }
+  }
+  if (end == slots) {
+    HMAP(_free_slots)(old);
+    HMAP__FREE(table, old, struct HMAP_NAME, 1);
+    table->old = NULL;
+  }
+}
+
+// Migrate the rest of the old table at once.
+static void
+HMAP(_migrate_all)(struct HMAP_NAME* table) {
+  while (table->old != NULL) {
+    struct HMAP_NAME* old = table->old;
+    size_t from = table->cursor;
+    // Detached, so that growing while placing starts a fresh migration.
+    table->old = NULL;
+
+    size_t index;
+    range_foreach(index, from, HMAP(_slot_count)(old->slot_bound)) {
+      if (HMAP__FULL(old, index)) {
+	HMAP(_migrate_entry)(table, old, index);
+      }
+    }
+    HMAP(_free_slots)(old);
+    HMAP__FREE(table, old, struct HMAP_NAME, 1);
+  }
+}
+#endif
+
+static inline void
+HMAP(_free_slots)(struct HMAP_NAME* table) {
+  size_t slot_count = HMAP(_slot_count)(table->slot_bound);
+#ifdef HMAP_SOA
+  HMAP__FREE(table, table->meta, struct HMAP(_meta), slot_count);
+  HMAP__FREE(table, table->buckets, struct HMAP(_bucket), slot_count);
+#else
+  HMAP__FREE(table, parray_raw(&table->buckets), struct HMAP(_bucket), slot_count);
+#endif
+}
+
+#ifdef HMAP_FILE
+// Tells apart map types with different images: the bucket size, layout, slot
+// bounds table and stored hash.
+static const uint32_t HMAP(_file_layout) =
+  cast(uint32_t, sizeof(struct HMAP(_bucket)) << 8)
+#ifdef HMAP_SOA
+  | 1u
+#endif
+#if defined(HMAP_FASTMOD)
+  | 2u
+#elif defined(HMAP_POW2)
+  | 4u
+#endif
+  | (HMAP_STORED_HASH << 3);
+
+// Bytes of the arrays in an image of SLOT_BOUND, or SIZE_MAX if out of bounds.
+static size_t
+HMAP(_file_bytes)(uint64_t slot_bound) {
+  if (slot_bound >= array_len(HMAP(_slot_bounds))) {
+    return SIZE_MAX;
+  }
+  size_t slot_count = HMAP(_slot_count)(cast(uint8_t, slot_bound));
+#ifdef HMAP_SOA
+  return __hmap_file_pad(slot_count * sizeof(struct HMAP(_meta)))
+    + __hmap_file_pad(slot_count * sizeof(struct HMAP(_bucket)));
+#else
+  return __hmap_file_pad(slot_count * sizeof(struct HMAP(_bucket)));
+#endif
+}
+
+struct file_error HMAP(save)(struct HMAP_NAME* table, const char* path) {
+#ifdef HMAP_INCREMENTAL
+  HMAP(_migrate_all)(table);
+#endif
+  size_t slot_count = HMAP(_slot_count)(table->slot_bound);
+  struct hmap_file_header header = {
+    .layout = HMAP(_file_layout),
+    .slot_bound = table->slot_bound,
+    .num_items = table->num_items,
+  };
+#ifdef HMAP_SOA
+  const void* arrays[] = { table->meta, table->buckets };
+  size_t lens[] = { slot_count * sizeof(struct HMAP(_meta)),
+		    slot_count * sizeof(struct HMAP(_bucket)) };
+#else
+  const void* arrays[] = { parray_raw(&table->buckets) };
+  size_t lens[] = { slot_count * sizeof(struct HMAP(_bucket)) };
+#endif
+  return __hmap_file_write(path, header, array_len(arrays), arrays, lens);
+}
+
+struct file_error HMAP(load)(region_t region, const char* path,
+			     struct HMAP_NAME* out) {
+  struct hmap_file_header header;
+  const char* arrays;
+  struct file_error err =
+    __hmap_file_map(region, path, HMAP(_file_layout), HMAP(_file_bytes),
+		    &header, &arrays);
+  if (is_error(&err)) {
+    return err;
+  }
+
+  memset(out, 0, sizeof(*out));
+  out->slot_bound = cast(uint8_t, header.slot_bound);
+  out->num_items = header.num_items;
+  size_t slot_count = HMAP(_slot_count)(out->slot_bound);
+#ifdef HMAP_SOA
+  out->meta = cast(struct HMAP(_meta)*, arrays);
+  out->buckets = cast(struct HMAP(_bucket)*, arrays
+		      + __hmap_file_pad(slot_count * sizeof(struct HMAP(_meta))));
+#else
+  parray_init(&out->buckets, cast(struct HMAP(_bucket)*, arrays), slot_count);
+#endif
+  return err;
+}
+#endif
+
+static inline void __attribute__((always_inline))
+HMAP(destroy)(struct HMAP_NAME* table) {
+#ifdef HMAP_INCREMENTAL
+  if (table->old != NULL) {
+    HMAP(_free_slots)(table->old);
+    HMAP__FREE(table, table->old, struct HMAP_NAME, 1);
+  }
+#endif
+  HMAP(_free_slots)(table);
+}
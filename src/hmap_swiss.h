@@ -0,0 +1,298 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// hmap_swiss.h - The group-probing engine of hmap.h, included by it.
+//
+// Every slot has a control byte: the low 7 bits of its entry's hash, or a
+// marker for an empty or erased slot. A lookup loads the control bytes of a
+// group of __HMAP_GROUP slots and compares them all against the key's 7 bits
+// at once, with SSE2 (16 slots) or AVX2 (32 slots) when compiled for it, and
+// only compares keys in matching slots. The rest of the hash picks the first
+// group, further groups are probed in triangular order until one has an empty
+// slot. Capacities are powers of two.
+//
+// Erasing leaves a marker unless the slot's group has an empty slot, since a
+// probe for any key stops at such a group anyway. Markers are cleared when the
+// table is rebuilt.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "hmap_group.h"
+
+#include <string.h>
+
+struct HMAP_NAME {
+  int8_t* ctrl;
+  struct HMAP(_bucket)* buckets;
+  size_t mask; // Number of slots - 1.
+  size_t num_items;
+  size_t growth_left; // Empty slots that may be filled before rebuilding.
+#ifdef HMAP_ALLOC_CTX
+  HMAP_ALLOC_CTX alloc;
+#endif
+};
+
+struct HMAP(_bucket) {
+  HMAP_KEY_TYPE key;
+#ifndef HMAP_HASHSET
+  HMAP_VAL_TYPE val;
+#endif
+};
+
+#define HMAP__BUCKET(TABLE, IDX) ((TABLE)->buckets[(IDX)])
+#define HMAP__FULL(TABLE, IDX) ((TABLE)->ctrl[(IDX)] >= 0)
+#define HMAP__ENTRY(TABLE, IDX) HMAP__BUCKET(TABLE, IDX)
+#define HMAP__LIVE(TABLE, IDX) HMAP__FULL(TABLE, IDX)
+#define HMAP__TAG(HASH) (cast(int8_t, (HASH) & 0x7f))
+#define HMAP__FIRST_GROUP(TABLE, HASH)			\
+  (((HASH) >> 7) & (TABLE)->mask & ~(__HMAP_GROUP - 1))
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline size_t
+HMAP(_capacity_for)(size_t count);
+
+static inline size_t
+HMAP(_growth_for)(size_t slots);
+
+static inline void
+HMAP(_init)(struct HMAP_NAME* table, size_t slots);
+
+static inline void
+HMAP(_create)(struct HMAP_NAME* table, size_t count);
+
+static void __attribute__((noinline))
+HMAP(_rebuild)(struct HMAP_NAME* table, size_t slots);
+
+static inline size_t
+HMAP(_free_slot)(const struct HMAP_NAME* table, size_t hash);
+
+static inline size_t
+HMAP(_find)(const struct HMAP_NAME* table, const HMAP_KEY_TYPE* key, size_t hash);
+
+static inline size_t
+HMAP(_insert_slot)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key,
+		   size_t hash, bool* fresh);
+
+static inline void __attribute__((always_inline))
+HMAP(_prefetch)(const struct HMAP_NAME* table, size_t hash);
+
+static inline void
+HMAP(_remove)(struct HMAP_NAME* table, size_t index);
+
+static inline size_t
+HMAP(_next_live)(const struct HMAP_NAME* table, size_t index);
+
+static inline size_t __attribute__((always_inline))
+HMAP(_num_slots)(const struct HMAP_NAME* table);
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline size_t
+HMAP(_capacity_for)(size_t count) {
+  size_t slots = __HMAP_GROUP;
+  while (HMAP(_growth_for)(slots) < count) {
+    slots *= 2;
+  }
+  return slots;
+}
+
+static inline size_t
+HMAP(_growth_for)(size_t slots) {
+  // A group with an empty slot ends every probe.
+  return min((size_t) ((float) slots * HMAP(_load_factor)), slots - 1);
+}
+
+static inline void
+HMAP(_init)(struct HMAP_NAME* table, size_t slots) {
+  table->ctrl = HMAP__ALLOC(table, int8_t, slots, __HMAP_GROUP);
+  memset(table->ctrl, __HMAP_EMPTY, slots);
+  table->buckets = HMAP__ALLOC(table, struct HMAP(_bucket), slots, 1);
+  table->mask = slots - 1;
+  table->num_items = 0;
+  table->growth_left = HMAP(_growth_for)(slots);
+}
+
+static void
+HMAP(_rebuild)(struct HMAP_NAME* table, size_t slots) {
+  struct HMAP_NAME res;
+#ifdef HMAP_ALLOC_CTX
+  res.alloc = table->alloc;
+#endif
+  HMAP(_init)(&res, slots);
+
+  size_t index;
+  range_foreach(index, 0, HMAP(_num_slots)(table)) {
+    if (HMAP__FULL(table, index)) {
+      size_t hash = HMAP(_hash_fun)(&HMAP__BUCKET(table, index).key);
+      size_t slot = HMAP(_free_slot)(&res, hash);
+      res.ctrl[slot] = HMAP__TAG(hash);
+      HMAP__BUCKET(&res, slot) = HMAP__BUCKET(table, index);
+    }
+  }
+  res.num_items = table->num_items;
+  res.growth_left -= min(res.growth_left, table->num_items);
+
+  HMAP(destroy)(table);
+  *table = res;
+}
+
+// Find the first empty or erased slot in the probe order of HASH.
+static inline size_t
+HMAP(_free_slot)(const struct HMAP_NAME* table, size_t hash) {
+  size_t group = HMAP__FIRST_GROUP(table, hash);
+  for (size_t step = __HMAP_GROUP;; group = (group + step) & table->mask,
+	 step += __HMAP_GROUP) {
+    uint32_t open = __hmap_group_free_(&table->ctrl[group]);
+    if (open != 0) {
+      return group + cast(size_t, __builtin_ctz(open));
+    }
+  }
+}
+
+static inline size_t
+HMAP(_find)(const struct HMAP_NAME* table, const HMAP_KEY_TYPE* key, size_t hash) {
+  int8_t tag = HMAP__TAG(hash);
+  size_t group = HMAP__FIRST_GROUP(table, hash);
+  for (size_t step = __HMAP_GROUP;; group = (group + step) & table->mask,
+	 step += __HMAP_GROUP) {
+    const int8_t* ctrl = &table->ctrl[group];
+    for (uint32_t match = __hmap_group_match_(ctrl, tag); match != 0;
+	 match &= match - 1) {
+      size_t index = group + cast(size_t, __builtin_ctz(match));
+      if (likely(HMAP(_key_eq_fun)(&HMAP__BUCKET(table, index).key, key))) {
+	return index;
+      }
+    }
+    if (likely(__hmap_group_match_(ctrl, __HMAP_EMPTY) != 0)) {
+      return HMAP__NONE;
+    }
+  }
+}
+
+static inline size_t
+HMAP(_insert_slot)(struct HMAP_NAME* table, const HMAP_KEY_TYPE* key,
+		   size_t hash, bool* fresh) {
+  size_t index = HMAP(_find)(table, key, hash);
+  if (index != HMAP__NONE) {
+    *fresh = false;
+    return index;
+  }
+
+  index = HMAP(_free_slot)(table, hash);
+  if (unlikely(table->growth_left == 0 && table->ctrl[index] == __HMAP_EMPTY)) {
+    // Clear erased markers in place if they take up half the room, else double.
+    size_t slots = HMAP(_num_slots)(table);
+    if ((float) (table->num_items + 1) > (float) slots * HMAP(_load_factor) / 2) {
+      slots *= 2;
+    }
+    HMAP(_rebuild)(table, slots);
+    index = HMAP(_free_slot)(table, hash);
+  }
+
+  table->growth_left -= (table->ctrl[index] == __HMAP_EMPTY);
+  table->ctrl[index] = HMAP__TAG(hash);
+  HMAP__BUCKET(table, index).key = *key;
+  ++table->num_items;
+  *fresh = true;
+  return index;
+}
+
+static inline void
+HMAP(_prefetch)(const struct HMAP_NAME* table, size_t hash) {
+  size_t group = HMAP__FIRST_GROUP(table, hash);
+  __builtin_prefetch(&table->ctrl[group]);
+  __builtin_prefetch(&table->buckets[group]);
+}
+
+static inline void
+HMAP(_remove)(struct HMAP_NAME* table, size_t index) {
+  if (__hmap_group_match_(&table->ctrl[index & ~(__HMAP_GROUP - 1)],
+			  __HMAP_EMPTY) != 0) {
+    table->ctrl[index] = __HMAP_EMPTY;
+    ++table->growth_left;
+  } else {
+    table->ctrl[index] = __HMAP_ERASED;
+  }
+  --table->num_items;
+
+  size_t slots = HMAP(_num_slots)(table);
+  if ((float) table->num_items < (float) slots * HMAP(_load_factor) / 4) {
+    size_t cap = HMAP(_capacity_for)(2 * table->num_items);
+    if (cap < slots) {
+      HMAP(_rebuild)(table, cap);
+    }
+  }
+}
+
+// Scans a group's control bytes at once, so empty runs are skipped quickly.
+static inline size_t
+HMAP(_next_live)(const struct HMAP_NAME* table, size_t index) {
+  size_t group = index & ~(__HMAP_GROUP - 1);
+  uint32_t group_mask = cast(uint32_t, (1lu << __HMAP_GROUP) - 1);
+  uint32_t live = ~__hmap_group_free_(&table->ctrl[group])
+    & (group_mask << (index - group)) & group_mask;
+  while (live == 0) {
+    group += __HMAP_GROUP;
+    if (group > table->mask) {
+      return HMAP(_num_slots)(table);
+    }
+    live = ~__hmap_group_free_(&table->ctrl[group]) & group_mask;
+  }
+  return group + cast(size_t, __builtin_ctz(live));
+}
+
+static inline size_t
+HMAP(_num_slots)(const struct HMAP_NAME* table) {
+  return table->mask + 1;
+}
+
+static inline void
+HMAP(_create)(struct HMAP_NAME* table, size_t count) {
+  HMAP(_init)(table, HMAP(_capacity_for)(count));
+}
+
+static inline void
+HMAP(reserve)(struct HMAP_NAME* table, size_t slots) {
+  size_t cap = HMAP(_capacity_for)(slots);
+  if (cap > HMAP(_num_slots)(table)) {
+    HMAP(_rebuild)(table, cap);
+  }
+}
+
+static inline void
+HMAP(shrink_to_fit)(struct HMAP_NAME* table) {
+  size_t cap = HMAP(_capacity_for)(table->num_items);
+  if (cap < HMAP(_num_slots)(table)) {
+    HMAP(_rebuild)(table, cap);
+  }
+}
+
+// Distances count the groups probed before the one holding an entry.
+static inline struct hmap_stats
+HMAP(stats)(const struct HMAP_NAME* table) {
+  struct hmap_stats res = { 0 };
+  size_t index;
+  range_foreach(index, 0, HMAP(_num_slots)(table)) {
+    if (HMAP__FULL(table, index)) {
+      size_t hash = HMAP(_hash_fun)(&HMAP__BUCKET(table, index).key);
+      size_t group = HMAP__FIRST_GROUP(table, hash), dist = 0;
+      for (size_t step = __HMAP_GROUP; group != (index & ~(__HMAP_GROUP - 1));
+	   group = (group + step) & table->mask, step += __HMAP_GROUP) {
+	++dist;
+      }
+      res.max_dist = max(res.max_dist, dist);
+      ++res.dists[min(dist, HMAP_STATS_DISTS - 1)];
+    }
+  }
+  res.num_items = table->num_items;
+  res.num_slots = HMAP(_num_slots)(table);
+  res.load = (float) res.num_items / (float) res.num_slots;
+  res.bytes = res.num_slots * (sizeof(struct HMAP(_bucket)) + 1);
+  return res;
+}
+
+static inline void __attribute__((always_inline))
+HMAP(destroy)(struct HMAP_NAME* table) {
+  HMAP__FREE(table, table->ctrl, int8_t, HMAP(_num_slots)(table));
+  HMAP__FREE(table, table->buckets, struct HMAP(_bucket), HMAP(_num_slots)(table));
+}
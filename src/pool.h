@@ -0,0 +1,153 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// pool.h - A pool of same-typed objects with constant time allocate and free.
+//
+// Paramaters: POOL_SLAB_MIN, POOL_SLAB_MAX_BYTES
+//
+// Objects are carved from slabs allocated in the pool's region, and freed
+// objects are threaded onto an intrusive free list to be handed out again.
+// Slabs double in size from POOL_SLAB_MIN objects up to POOL_SLAB_MAX_BYTES.
+// Nothing is returned to the region until the region itself is destroyed, at
+// which point the whole pool goes with it.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "type.h"
+#include "util.h"
+#include "basic.h"
+#include "region.h"
+
+// Number of objects in a pool's first slab.
+#ifndef POOL_SLAB_MIN
+#define POOL_SLAB_MIN 16
+#endif
+
+// Largest slab size in bytes, unless a single object is larger.
+#ifndef POOL_SLAB_MAX_BYTES
+#define POOL_SLAB_MAX_BYTES (64lu << 10)
+#endif
+
+// Declare a pool NAME for objects of TYPE.
+#define POOL_DECL(NAME, TYPE)				\
+  struct NAME { struct pool base; TYPE __pool_elem[0]; }
+
+#define pool_t(TYPE)				\
+  POOL_DECL(, TYPE)
+
+#define pool_elem_typeof(POOL)			\
+  typeof((POOL)->__pool_elem[0])
+
+// Create a new pool of POOL_TYPE, allocating its slabs in region REG.
+#define pool_new(REG, POOL_TYPE) ({					\
+  POOL_TYPE __pool;							\
+  __pool_init_(&__pool.base, (REG),					\
+	       sizeof(pool_elem_typeof(&__pool)),			\
+	       alignof(pool_elem_typeof(&__pool)));			\
+  __pool;								\
+})
+
+// Allocate an uninitialized object from the pool.
+#define pool_alloc(POOL)						\
+  (cast(pointer(pool_elem_typeof(POOL)), __pool_alloc_(&(POOL)->base)))
+
+// Return the object PTR, allocated from the pool, to the pool.
+#define pool_free(POOL, PTR)						\
+  do {									\
+    __auto_type __pool = (POOL);					\
+    pointer(pool_elem_typeof(__pool)) __pool_ptr = (PTR);		\
+    __pool_free_(&__pool->base, __pool_ptr);				\
+  } while (0)
+
+// Get the number of live objects allocated from the pool.
+#define pool_len(POOL)				\
+  ((POOL)->base.len)
+
+////////////////////////////////////////////////////////////////////////////////
+// Private
+
+#include "list.h"
+
+SLIST_DECL(pool_free_slist, struct pool_free_node);
+struct pool_free_node {
+  SLIST_ENTRY(struct pool_free_node) slist;
+};
+
+struct pool {
+  region_t region;
+  size_t elem_size;
+  size_t elem_align;
+  size_t slab_count;
+  size_t len;
+
+  char* cursor;
+  char* limit;
+  struct pool_free_slist free;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline void __attribute__((unused))
+__pool_init_(struct pool*, region_t, size_t size, size_t align);
+
+static inline void* __attribute__((malloc, warn_unused_result, unused))
+__pool_alloc_(struct pool*);
+
+static inline void __attribute__((unused))
+__pool_free_(struct pool*, void*);
+
+static void __attribute__((noinline, unused))
+__pool_grow_(struct pool*);
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline void
+__pool_init_(struct pool* pool, region_t region, size_t size, size_t align) {
+  // Every slot has to be able to hold a free list node in its place.
+  pool->elem_align = max(align, alignof(struct pool_free_node));
+  pool->elem_size = (max(size, sizeof(struct pool_free_node))
+		     + pool->elem_align - 1) & ~(pool->elem_align - 1);
+  pool->region = region;
+  pool->slab_count = POOL_SLAB_MIN;
+  pool->len = 0;
+  pool->cursor = NULL;
+  pool->limit = NULL;
+  slist_init(&pool->free);
+}
+
+static inline void*
+__pool_alloc_(struct pool* pool) {
+  void* res;
+  if (!slist_is_empty(&pool->free)) {
+    struct pool_free_node* node;
+    slist_pop(&pool->free, node, slist);
+    res = node;
+  } else {
+    if (unlikely(pool->cursor == pool->limit)) {
+      __pool_grow_(pool);
+    }
+    res = pool->cursor;
+    pool->cursor += pool->elem_size;
+  }
+  ++pool->len;
+  return res;
+}
+
+static inline void
+__pool_free_(struct pool* pool, void* ptr) {
+  struct pool_free_node* node = ptr;
+  slist_insert(&pool->free, node, slist);
+  --pool->len;
+}
+
+static void
+__pool_grow_(struct pool* pool) {
+  size_t bytes = pool->elem_size * pool->slab_count;
+  pool->cursor = r_malloc_aligned(pool->region, bytes, pool->elem_align);
+  pool->limit = pool->cursor + bytes;
+
+  if ((pool->slab_count * 2) * pool->elem_size <= POOL_SLAB_MAX_BYTES) {
+    pool->slab_count *= 2;
+  }
+}
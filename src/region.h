@@ -4,7 +4,22 @@
 //
 // region.h - A region allocator with subregions and destructors.
 //
-// Paramaters: REGION_BLOCK_SIZE
+// Paramaters: REGION_BLOCK_SIZE, REGION_BLOCK_MAX_SHIFT, REGION_OVERSIZED_RATIO,
+//   REGION_CACHE_MAX_BYTES, REGION_CACHE_THREAD_LOCAL, REGION_COMMIT_SIZE,
+//   REGION_PROFILE, REGION_SUB_INDEX_MIN
+//
+// Allocation bumps a cursor through the current block. When the current block
+// runs out, its tail is abandoned and a fresh block, twice the size of the
+// last, becomes current (up to REGION_BLOCK_SIZE << REGION_BLOCK_MAX_SHIFT).
+// Allocations larger than 1/REGION_OVERSIZED_RATIO of a fresh block get a
+// block of their own instead, so an abandoned tail never wastes more than that
+// fraction of a block.
+//
+// Typed allocations are aligned to their type, r_malloc_bytes is unaligned.
+//
+// Blocks come from, and return to, a block cache shared by all regions, so
+// short-lived regions rarely reach the system allocator. The region handle
+// itself lives at the start of its first block.
 //
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -17,6 +32,38 @@
 #define REGION_BLOCK_SIZE 2048
 #endif
 
+// Number of times the block size may double as a region grows.
+#ifndef REGION_BLOCK_MAX_SHIFT
+#define REGION_BLOCK_MAX_SHIFT 5
+#endif
+
+// Allocations above 1/REGION_OVERSIZED_RATIO of a block are given their own.
+#ifndef REGION_OVERSIZED_RATIO
+#define REGION_OVERSIZED_RATIO 4
+#endif
+
+// Default number of bytes of free blocks the block cache may hold.
+#ifndef REGION_CACHE_MAX_BYTES
+#define REGION_CACHE_MAX_BYTES (4lu << 20)
+#endif
+
+// Granularity at which reserved regions commit address space.
+#ifndef REGION_COMMIT_SIZE
+#define REGION_COMMIT_SIZE (2lu << 20)
+#endif
+
+// Number of live subregions a region scans by tag before indexing them.
+#ifndef REGION_SUB_INDEX_MIN
+#define REGION_SUB_INDEX_MIN 8
+#endif
+
+// Define REGION_CACHE_THREAD_LOCAL to give each thread its own block cache,
+// rather than one process-wide cache behind a spinlock.
+/////
+// Threads should r_cache_trim(0) before exiting to release their blocks.
+
+// Define REGION_PROFILE to count allocations by call site, see r_profile_dump.
+
 // Handle for a region.
 typedef struct region* region_t;
 
@@ -24,13 +71,41 @@ typedef struct region* region_t;
 static inline
 region_t r_create();
 
+// Create a region backed by BYTES of reserved, contiguous address space.
+/////
+// Memory is committed REGION_COMMIT_SIZE at a time as the region grows and
+// the whole range is unmapped at once on destruction. Once the reservation is
+// used up the region continues with ordinary blocks. HUGE_PAGES requests
+// transparent huge pages for the range. Returns NULL if BYTES can't be
+// reserved.
+static inline
+region_t r_create_reserved(size_t bytes, bool huge_pages);
+
 // Allocate memory of type TYPE within the region REG.
-#define r_malloc(REG, TYPE)			\
-  (cast(pointer(TYPE), __r_malloc_((REG), sizeof(TYPE))))
+#define r_malloc(REG, TYPE)						\
+  (cast(pointer(TYPE), __r_alloc((REG), sizeof(TYPE), alignof(TYPE))))
 
 // Allocate LEN bytes within the region REG.
 #define r_malloc_bytes(REG, LEN)		\
-  __r_malloc_((REG), (LEN))
+  __r_alloc((REG), (LEN), 1)
+
+// Allocate LEN bytes within the region REG, aligned to ALIGN (a power of two).
+////
+// float* lanes = r_malloc_aligned(r, 64 * sizeof(float), 64);
+#define r_malloc_aligned(REG, LEN, ALIGN)	\
+  __r_alloc((REG), (LEN), (ALIGN))
+
+// Resize the allocation PTR of OLD bytes within region REG to NEW bytes.
+/////
+// Extends PTR in place if it is the most recent allocation and its block has
+// room, otherwise copies it into fresh memory, keeping its alignment up to
+// max_align_t. Shrinking never moves PTR. A NULL PTR allocates.
+/////
+// Abandoned copies are only released with the region, so grow geometrically.
+#define r_realloc(REG, PTR, OLD, NEW)			\
+  ({ size_t __r_new = (NEW);				\
+    __r_profile_site_(__r_new);				\
+    __r_realloc_((REG), (PTR), (OLD), __r_new); })
 
 // Allocate string inside region REG.
 #define r_malloc_string(REG, STR)				\
@@ -44,17 +119,19 @@ region_t r_create();
 // r_malloc_flex(r, struct foo, rest, 10);
 #define r_malloc_flex(REG, TYPE, FIELD, COUNT)				\
   (cast(pointer(TYPE),							\
-	__r_malloc_(							\
+	__r_alloc(							\
 	  (REG),							\
 	  (sizeof(TYPE)							\
 	   + (sizeof(array_elem_typeof(member_typeof(TYPE, FIELD)))	\
-	      * (COUNT))))))
+	      * (COUNT))),						\
+	  alignof(TYPE))))
 
 // Allocate an array of TYPE with COUNT elements.
 ////
 // parray_t(int) int_array; r_malloc_array(r, int, 5);
 #define r_malloc_parray(REG, TYPE, COUNT)				\
-  parray_new(__r_malloc_((REG), (sizeof(TYPE) * (COUNT))), (COUNT))
+  parray_new(__r_alloc((REG), (sizeof(TYPE) * (COUNT)), alignof(TYPE)),	\
+	     (COUNT))
 
 // Allocate into the pointer PTR and initialize the memory.
 /////
@@ -77,11 +154,62 @@ region_t r_create();
 static inline
 void r_destroy(region_t);
 
+////////////////////////////////////////////////////////////////////////////////
+// Savepoints
+//
+// A mark records the state of a region. Rewinding to it destroys everything
+// created in the region since, but keeps the region's blocks to be reused by
+// later allocations.
+/////
+// struct r_mark m = r_mark(r); ...; r_rewind(r, m);
+
+struct r_mark;
+
+// Record the current state of the region.
+static inline
+struct r_mark r_mark(region_t);
+
+// Roll the region back to MARK, destroying subregions, invoking destructors
+// and releasing memory allocated after it.
+/////
+// Marks taken after MARK are invalidated.
+static inline
+void r_rewind(region_t, struct r_mark);
+
+// Empty the region as r_destroy would, but keep it and its blocks for reuse.
+/////
+// Reserved regions also return their committed pages to the system.
+static inline
+void r_reset(region_t);
+
+////////////////////////////////////////////////////////////////////////////////
+// Block cache
+//
+// Blocks of destroyed regions are kept for new regions, up to a limit. The
+// parameters of this header must agree across compilation units.
+
+// Set the number of bytes the block cache may hold, trimming it if needed.
+static inline
+void r_cache_set_limit(size_t bytes);
+
+// Release cached blocks to the system until at most KEEP bytes remain.
+static inline
+void r_cache_trim(size_t keep);
+
+// Get the number of bytes currently held by the block cache.
+static inline
+size_t r_cache_bytes();
+
 ////////////////////////////////////////////////////////////////////////////////
 // Subregions
 //
 // Subregions are regions which are contained with another region. They are
 // destroyed when the parent region is destroyed, unless the are extracted first.
+/////
+// Tags need not be unique, the most recently added subregion with a tag hides
+// older ones until it is extracted. Regions with more than
+// REGION_SUB_INDEX_MIN subregions, or which had one extracted, look tags up
+// in a hash index.
 
 // Create a subregion with tag TAG (int) in region REG.
 /////
@@ -99,10 +227,31 @@ void r_destroy(region_t);
 #define r_get_subregion(REG, TAG)		\
   __r_get_subregion_((REG), (int)(TAG))
 
+// Retrieve the handle a subregion with tag TAG, or NULL if there is none.
+#define r_try_get_subregion(REG, TAG)		\
+  __r_try_get_subregion_((REG), (int)(TAG))
+
 // Remove a subregion from REG and return its handle.
 #define r_extract_subregion(REG, TAG)		\
   __r_extract_subregion_((REG), (int)(TAG))
 
+////////////////////////////////////////////////////////////////////////////////
+// Thread-local subregions
+//
+// Regions are not synchronized, so only one thread may use a region at a time.
+// Threads sharing a parent region instead allocate, and add structures and
+// subregions, in their own child of it. Children are destroyed with the
+// parent, or by rewinding it past their creation.
+/////
+// parallel_for (...) { node* n = r_malloc(r_thread_local(r), node); ... }
+
+// Get the calling thread's child region of REG, creating it on first use.
+/////
+// May be called concurrently from any number of threads. Returns the same
+// child for repeated calls on one thread.
+static inline
+region_t r_thread_local(region_t);
+
 ////////////////////////////////////////////////////////////////////////////////
 // Structures
 //
@@ -113,13 +262,44 @@ typedef void (*r_generic_destructor_t)(void*);
 
 // Allocate memory of type TYPE, with destructor DESTRUCTOR.
 #define r_new_struct(REG, DESTRUCTOR, TYPE)				\
-  (cast(pointer(TYPE), __r_add_struct((REG), (DESTRUCTOR), sizeof(TYPE))))
+  ({ __r_profile_site_(sizeof(TYPE));					\
+    cast(pointer(TYPE), __r_add_struct((REG), (DESTRUCTOR), sizeof(TYPE))); })
+
+////////////////////////////////////////////////////////////////////////////////
+// Statistics
+
+struct r_stats {
+  size_t requested;   // Bytes asked for by live allocations.
+  size_t reserved;    // Bytes of blocks held, committed bytes if reserved.
+  size_t tail_waste;  // Bytes abandoned at the ends of retired blocks.
+  size_t uncommitted; // Bytes reserved by r_create_reserved, not committed.
+  size_t blocks;      // Blocks held, including spare ones.
+  size_t oversized;   // Oversized blocks held.
+  size_t structs;     // Registered destructors.
+  size_t high_water;  // Most bytes requested at once, summed over regions.
+};
+
+// Gather statistics of REG, including its subregions and thread children.
+static inline
+struct r_stats r_stats(region_t);
+
+// Print allocation counts and bytes by call site to FILE.
+/////
+// Only available when compiled with REGION_PROFILE.
+#ifdef REGION_PROFILE
+static inline
+void r_profile_dump(FILE*);
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
 // Private
 
 #include "list.h"
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 struct region;
 
@@ -127,104 +307,470 @@ SLIST_DECL(r_block_slist, struct r_block);
 struct r_block {
   SLIST_ENTRY(struct r_block) slist;
 
-  size_t num_free;
-  char bytes[];
+  size_t size;
+  size_t num_free; // Abandoned tail, set once the block is no longer current.
+  alignas(max_align_t) char bytes[];
 };
 
 SLIST_DECL(r_struct_slist, struct r_struct);
 struct r_struct {
   SLIST_ENTRY(struct r_struct) slist;
   r_generic_destructor_t dstr;
-  char data[];
+  alignas(max_align_t) char data[];
 };
 
 SLIST_DECL(r_sub_region_slist, struct r_sub_region);
 struct r_sub_region {
   SLIST_ENTRY(struct r_sub_region) slist;
   int tag;
+  region_t region; // NULL once extracted.
+  struct r_sub_region* shadow; // Live subregion with the same tag it hides.
+};
+
+// Lives in the child region, so that threads never allocate in the parent.
+SLIST_DECL(r_thread_region_slist, struct r_thread_region);
+struct r_thread_region {
+  SLIST_ENTRY(struct r_thread_region) slist;
+  const void* thread;
   region_t region;
 };
 
+// Last child handed out on this thread, valid while the parent's serial holds.
+struct r_thread_cache {
+  region_t parent;
+  uint64_t serial;
+  region_t child;
+};
+
 struct region {
-  struct r_block_slist blocks;
+  char* cursor;
+  char* limit;
+  size_t block_size;
+
+  struct r_block_slist blocks; // Current block first.
+  struct r_block_slist spare;  // Rewound blocks, next to be reused first.
   struct r_block_slist oversized;
   struct r_struct_slist structs;
   struct r_sub_region_slist subs;
+  size_t num_subs; // Live subregions.
+  // Newest live subregion by tag, open addressed, NULL until needed.
+  struct r_sub_region** sub_index;
+  size_t sub_mask;
+  size_t sub_len;
+
+  uint64_t serial;
+  atomic_flag lock;
+  struct r_thread_region_slist threads;
+
+  char* vm_commit; // End of committed memory if reserved, NULL otherwise.
+
+  size_t requested;
+  size_t high_water;
+};
+
+struct r_mark {
+  char* cursor;
+  size_t requested;
+  struct r_block* block;
+  struct r_block* oversized;
+  struct r_struct* structs;
+  struct r_sub_region* subs;
+  struct r_thread_region* threads;
+};
+
+#ifdef REGION_PROFILE
+// Allocation totals of one call site, linked into __r_sites on first use.
+struct r_site {
+  const char* file;
+  int line;
+  _Atomic size_t count;
+  _Atomic size_t bytes;
+  _Atomic bool linked;
+  struct r_site* next;
+};
+#endif
+
+// Cached blocks, one list per block size.
+struct r_cache {
+  struct r_block_slist sizes[REGION_BLOCK_MAX_SHIFT + 1];
+  size_t bytes;
+  size_t limit;
+  atomic_flag lock;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 
-static const size_t REAL_BLOCK_SIZE =
-  (REGION_BLOCK_SIZE - sizeof(struct r_block));
+#define REGION_MAX_BLOCK_SIZE (REGION_BLOCK_SIZE << REGION_BLOCK_MAX_SHIFT)
+
+// Weak, so that every compilation unit shares the same cache.
+#ifdef REGION_CACHE_THREAD_LOCAL
+__attribute__((weak)) _Thread_local
+#else
+__attribute__((weak))
+#endif
+struct r_cache __r_cache = {
+  .limit = REGION_CACHE_MAX_BYTES,
+  .lock = ATOMIC_FLAG_INIT,
+};
+
+__attribute__((weak)) _Atomic uint64_t __r_serial = 1;
+
+// Its address identifies the thread.
+__attribute__((weak)) _Thread_local struct r_thread_cache __r_thread;
+
+#ifdef REGION_PROFILE
+__attribute__((weak)) struct r_site* _Atomic __r_sites = NULL;
+
+#define __r_profile_site_(BYTES)					\
+  do {									\
+    static struct r_site __r_site = { .file = __FILE__, .line = __LINE__ }; \
+    __r_site_record_(&__r_site, (BYTES));				\
+  } while (0)
+#else
+#define __r_profile_site_(BYTES) ((void) 0)
+#endif
+
+#define __r_alloc(REG, BYTES, ALIGN)					\
+  ({ size_t __r_bytes = (BYTES);					\
+    __r_profile_site_(__r_bytes);					\
+    __r_malloc_((REG), __r_bytes, (ALIGN)); })
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static inline void __attribute__((always_inline))
+__r_spin_lock(atomic_flag*);
+static inline void __attribute__((always_inline))
+__r_spin_unlock(atomic_flag*);
+
+static inline struct r_block* __attribute__((warn_unused_result))
+__r_block_get(size_t block_size);
+static inline void
+__r_block_put(struct r_block*);
+static inline struct r_block* __attribute__((always_inline))
+__r_home_block(region_t);
 static inline char* __attribute__((always_inline))
-r_block_free_ptr(struct r_block*);
+__r_block_limit(region_t, struct r_block*);
+
+static inline region_t
+__r_init_(struct r_block* home);
+static bool
+__r_vm_commit_(region_t, size_t bytes);
 
 static inline void* __attribute__((malloc, warn_unused_result, nonnull, unused))
-__r_malloc_(region_t, size_t);
+__r_malloc_(region_t, size_t, size_t);
+static void* __attribute__((malloc, noinline, nonnull, unused))
+__r_malloc_slow_(region_t, size_t, size_t);
 
 static inline void __attribute__((unused))
 __r_add_subregion_(region_t, int, region_t);
 static inline region_t __attribute__((warn_unused_result, nonnull, unused))
 __r_get_subregion_(region_t, int);
 static inline region_t __attribute__((warn_unused_result, nonnull, unused))
+__r_try_get_subregion_(region_t, int);
+static inline region_t __attribute__((warn_unused_result, nonnull, unused))
 __r_extract_subregion_(region_t, int);
 
+static inline struct r_sub_region* __attribute__((nonnull))
+__r_sub_find_(region_t, int);
+static inline void __attribute__((nonnull))
+__r_sub_unlink_(region_t, struct r_sub_region*);
+static void __attribute__((nonnull(1)))
+__r_sub_index_set_(region_t, int, struct r_sub_region*);
+static void __attribute__((noinline, nonnull))
+__r_sub_index_resize_(region_t, size_t cap);
+
 static inline void* __attribute__((malloc, warn_unused_result, nonnull, unused))
 __r_add_struct(region_t, r_generic_destructor_t, size_t);
 
+static inline void* __attribute__((warn_unused_result, unused))
+__r_realloc_(region_t, void*, size_t, size_t);
+
+static region_t __attribute__((noinline, nonnull, unused))
+__r_thread_local_slow_(region_t);
+
+#ifdef REGION_PROFILE
+static inline void __attribute__((unused))
+__r_site_record_(struct r_site*, size_t bytes);
+#endif
+static inline void
+__r_stats_add_(struct r_stats*, region_t);
+
 ////////////////////////////////////////////////////////////////////////////////
 
+static inline void
+__r_spin_lock(atomic_flag* lock) {
+  while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire)) {}
+}
+
+static inline void
+__r_spin_unlock(atomic_flag* lock) {
+  atomic_flag_clear_explicit(lock, memory_order_release);
+}
+
+#ifdef REGION_CACHE_THREAD_LOCAL
+#define __r_cache_lock() ((void) 0)
+#define __r_cache_unlock() ((void) 0)
+#else
+#define __r_cache_lock() __r_spin_lock(&__r_cache.lock)
+#define __r_cache_unlock() __r_spin_unlock(&__r_cache.lock)
+#endif
+
+// Block sizes are REGION_BLOCK_SIZE << shift, including the header.
+#define __r_block_shift(BLOCK_SIZE)					\
+  cast(size_t, __builtin_ctzl((BLOCK_SIZE) / REGION_BLOCK_SIZE))
+
+static inline struct r_block*
+__r_block_get(size_t block_size) {
+  struct r_block_slist* cached = &__r_cache.sizes[__r_block_shift(block_size)];
+  struct r_block* block = NULL;
+
+  __r_cache_lock();
+  if (!slist_is_empty(cached)) {
+    slist_pop(cached, block, slist);
+    __r_cache.bytes -= block_size;
+  }
+  __r_cache_unlock();
+
+  if (block == NULL) {
+    block = sys_malloc_flex(struct r_block, block_size - sizeof(struct r_block));
+    block->size = block_size - sizeof(struct r_block);
+  }
+  block->num_free = 0;
+  return block;
+}
+
+static inline void
+__r_block_put(struct r_block* block) {
+  size_t block_size = block->size + sizeof(struct r_block);
+  bool cached = false;
+
+  __r_cache_lock();
+  if (__r_cache.bytes + block_size <= __r_cache.limit) {
+    slist_insert(&__r_cache.sizes[__r_block_shift(block_size)], block, slist);
+    __r_cache.bytes += block_size;
+    cached = true;
+  }
+  __r_cache_unlock();
+
+  if (!cached) {
+    sys_free(block);
+  }
+}
+
+static inline struct r_block*
+__r_home_block(region_t region) {
+  return cast(pointer(struct r_block),
+	      cast(void*, cast(char*, region) - offsetof(struct r_block, bytes)));
+}
+
+static inline void __attribute__((unused))
+r_cache_set_limit(size_t bytes) {
+  __r_cache_lock();
+  __r_cache.limit = bytes;
+  __r_cache_unlock();
+  r_cache_trim(bytes);
+}
+
+static inline void __attribute__((unused))
+r_cache_trim(size_t keep) {
+  struct r_block_slist release;
+  slist_init(&release);
+
+  __r_cache_lock();
+  size_t shift = array_len(__r_cache.sizes);
+  while (__r_cache.bytes > keep && shift-- > 0) {
+    struct r_block_slist* cached = &__r_cache.sizes[shift];
+    while (__r_cache.bytes > keep && !slist_is_empty(cached)) {
+      struct r_block* block;
+      slist_pop(cached, block, slist);
+      __r_cache.bytes -= block->size + sizeof(struct r_block);
+      slist_insert(&release, block, slist);
+    }
+  }
+  __r_cache_unlock();
+
+  while (!slist_is_empty(&release)) {
+    struct r_block* block;
+    slist_pop(&release, block, slist);
+    sys_free(block);
+  }
+}
+
+static inline size_t __attribute__((unused))
+r_cache_bytes() {
+  __r_cache_lock();
+  size_t bytes = __r_cache.bytes;
+  __r_cache_unlock();
+  return bytes;
+}
+
 static inline char*
-r_block_free_ptr(struct r_block* block) {
-  return &block->bytes[REAL_BLOCK_SIZE - block->num_free];
+__r_block_limit(region_t region, struct r_block* block) {
+  return (region->vm_commit != NULL && block == __r_home_block(region))
+    ? region->vm_commit
+    : block->bytes + block->size;
 }
 
 static inline region_t __attribute__((malloc, warn_unused_result, unused))
 r_create() {
-  region_t res = sys_malloc(struct region);
+  return __r_init_(__r_block_get(REGION_BLOCK_SIZE));
+}
+
+static inline region_t __attribute__((malloc, warn_unused_result, unused))
+r_create_reserved(size_t bytes, bool huge_pages) {
+  size_t align = (huge_pages) ? REGION_COMMIT_SIZE : cast(size_t, sysconf(_SC_PAGESIZE));
+  size_t total = (bytes + sizeof(struct r_block) + sizeof(struct region)
+		  + align - 1) & ~(align - 1);
+
+  // Over-reserve to place the range on an aligned boundary, then trim.
+  char* map = mmap(NULL, total + align, PROT_NONE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  char* base = map + (-cast(uintptr_t, map) & (align - 1));
+  if (base != map) {
+    munmap(map, cast(size_t, base - map));
+  }
+  munmap(base + total, align - cast(size_t, base - map));
+
+  size_t commit = min(REGION_COMMIT_SIZE, total);
+  if (mprotect(base, commit, PROT_READ | PROT_WRITE) != 0) {
+    munmap(base, total);
+    return NULL;
+  }
+  if (huge_pages) {
+    madvise(base, total, MADV_HUGEPAGE);
+  }
+
+  struct r_block* home = cast(pointer(struct r_block), cast(void*, base));
+  home->size = total - sizeof(struct r_block);
+  home->num_free = 0;
+  region_t res = __r_init_(home);
+  res->vm_commit = base + commit;
+  res->limit = res->vm_commit;
+  return res;
+}
+
+static inline region_t
+__r_init_(struct r_block* home) {
+  region_t res = cast(region_t, cast(void*, home->bytes));
+  res->cursor = home->bytes + sizeof(struct region);
+  res->limit = home->bytes + home->size;
+  res->block_size = min(cast(size_t, REGION_BLOCK_SIZE) * 2, REGION_MAX_BLOCK_SIZE);
   slist_init(&res->blocks);
+  slist_insert(&res->blocks, home, slist);
+  slist_init(&res->spare);
   slist_init(&res->oversized);
   slist_init(&res->structs);
   slist_init(&res->subs);
+  res->num_subs = 0;
+  res->sub_index = NULL;
+  res->sub_mask = 0;
+  res->sub_len = 0;
+  res->serial = atomic_fetch_add_explicit(&__r_serial, 1, memory_order_relaxed);
+  atomic_flag_clear(&res->lock);
+  slist_init(&res->threads);
+  res->vm_commit = NULL;
+  res->requested = 0;
+  res->high_water = 0;
   return res;
 }
 
+static
+bool __r_vm_commit_(region_t region, size_t bytes) {
+  struct r_block* home = __r_home_block(region);
+  char* end = home->bytes + home->size;
+  if (slist_first(&region->blocks) != home
+      || bytes > cast(size_t, end - region->cursor)) {
+    return false;
+  }
+
+  size_t offset = cast(size_t, region->cursor + bytes - as_bytes(home));
+  offset = (offset + REGION_COMMIT_SIZE - 1) & ~(REGION_COMMIT_SIZE - 1);
+  char* commit = min(cast(char*, home) + offset, end);
+  if (mprotect(region->vm_commit, cast(size_t, commit - region->vm_commit),
+	       PROT_READ | PROT_WRITE) != 0) {
+    return false;
+  }
+
+  region->vm_commit = commit;
+  region->limit = commit;
+  return true;
+}
+
 static inline
-void* __r_malloc_(region_t region, size_t bytes) {
+void* __r_malloc_(region_t region, size_t bytes, size_t align) {
+  assertf((align & (align - 1)) == 0, "Alignment %lu not a power of two", align);
+  size_t pad = -cast(uintptr_t, region->cursor) & (align - 1);
+  if (likely(pad + bytes <= cast(size_t, region->limit - region->cursor))) {
+    void* result = region->cursor + pad;
+    region->cursor += pad + bytes;
+    region->requested += bytes;
+    return result;
+  }
+  return __r_malloc_slow_(region, bytes, align);
+}
+
+static
+void* __r_malloc_slow_(region_t region, size_t bytes, size_t align) {
+  if (region->vm_commit != NULL
+      && __r_vm_commit_(region,
+			bytes + (-cast(uintptr_t, region->cursor) & (align - 1)))) {
+    return __r_malloc_(region, bytes, align);
+  }
+
+  size_t fresh = slist_is_empty(&region->spare)
+    ? region->block_size - sizeof(struct r_block)
+    : slist_first(&region->spare)->size;
+  // Block memory is aligned to max_align_t, only stricter alignments need room
+  // to pad.
+  size_t slack = (align > alignof(max_align_t)) ? align - 1 : 0;
   struct r_block* curr;
-  if (unlikely(bytes > REAL_BLOCK_SIZE)) {
-    curr = sys_malloc_flex(struct r_block, bytes);
+
+  if (bytes + slack > fresh / REGION_OVERSIZED_RATIO) {
+    curr = sys_malloc_flex(struct r_block, bytes + slack);
+    curr->size = bytes + slack;
+    curr->num_free = 0;
     slist_insert(&region->oversized, curr, slist);
+    region->requested += bytes;
+    return curr->bytes + (-cast(uintptr_t, curr->bytes) & (align - 1));
+  }
+
+  slist_first(&region->blocks)->num_free =
+    cast(size_t, region->limit - region->cursor);
+
+  if (!slist_is_empty(&region->spare)) {
+    slist_pop(&region->spare, curr, slist);
     curr->num_free = 0;
-    return curr->bytes;
   } else {
-    slist_foreach(curr, &region->blocks, slist) {
-      if (bytes <= curr->num_free) {
-	break;
-      }
-    }
-
-    if (curr == NULL) {
-      curr = sys_malloc_flex(struct r_block, REAL_BLOCK_SIZE);
-      slist_insert(&region->blocks, curr, slist);
-      curr->num_free = REAL_BLOCK_SIZE;
+    curr = __r_block_get(region->block_size);
+    if (region->block_size < REGION_MAX_BLOCK_SIZE) {
+      region->block_size *= 2;
     }
-
-    void* result = r_block_free_ptr(curr);
-    curr->num_free -= bytes;
-    return result;
   }
+  slist_insert(&region->blocks, curr, slist);
+
+  region->limit = curr->bytes + fresh;
+  region->cursor = curr->bytes;
+  return __r_malloc_(region, bytes, align);
 }
 
 static inline
 void r_destroy(region_t region) {
+  struct r_thread_region* child;
+  while (!slist_is_empty(&region->threads)) {
+    slist_pop(&region->threads, child, slist);
+    r_destroy(child->region);
+  }
+
   struct r_sub_region* sub;
   slist_foreach(sub, &region->subs, slist) {
-    r_destroy(sub->region);
+    if (sub->region != NULL) {
+      r_destroy(sub->region);
+    }
   }
+  sys_free(region->sub_index);
 
   struct r_struct* ds;
   slist_foreach(ds, &region->structs, slist) {
@@ -237,17 +783,166 @@ void r_destroy(region_t region) {
     sys_free(block);
   }
 
-  while (!slist_is_empty(&region->blocks)) {
+  while (!slist_is_empty(&region->spare)) {
+    slist_pop(&region->spare, block, slist);
+    __r_block_put(block);
+  }
+
+  // The home block holds the region itself, so it goes last.
+  struct r_block* home = __r_home_block(region);
+  while (slist_first(&region->blocks) != home) {
     slist_pop(&region->blocks, block, slist);
+    __r_block_put(block);
+  }
+
+  if (region->vm_commit != NULL) {
+    munmap(home, home->size + sizeof(struct r_block));
+  } else {
+    __r_block_put(home);
+  }
+}
+
+static inline struct r_mark __attribute__((warn_unused_result, unused))
+r_mark(region_t region) {
+  return new(struct r_mark,
+	     .cursor = region->cursor,
+	     .requested = region->requested,
+	     .block = slist_first(&region->blocks),
+	     .oversized = slist_first(&region->oversized),
+	     .structs = slist_first(&region->structs),
+	     .subs = slist_first(&region->subs),
+	     .threads = slist_first(&region->threads));
+}
+
+static inline void __attribute__((unused))
+r_rewind(region_t region, struct r_mark mark) {
+  struct r_thread_region* child;
+  __r_spin_lock(&region->lock);
+  if (slist_first(&region->threads) != mark.threads) {
+    // Invalidates the children cached by each thread.
+    region->serial =
+      atomic_fetch_add_explicit(&__r_serial, 1, memory_order_relaxed);
+  }
+  while (slist_first(&region->threads) != mark.threads) {
+    slist_pop(&region->threads, child, slist);
+    r_destroy(child->region);
+  }
+  __r_spin_unlock(&region->lock);
+
+  struct r_sub_region* sub;
+  while (slist_first(&region->subs) != mark.subs) {
+    slist_pop(&region->subs, sub, slist);
+    if (sub->region != NULL) {
+      __r_sub_unlink_(region, sub);
+      r_destroy(sub->region);
+    }
+  }
+
+  struct r_struct* ds;
+  while (slist_first(&region->structs) != mark.structs) {
+    slist_pop(&region->structs, ds, slist);
+    ds->dstr(ds->data);
+  }
+
+  struct r_block* block;
+  while (slist_first(&region->oversized) != mark.oversized) {
+    slist_pop(&region->oversized, block, slist);
     sys_free(block);
   }
 
-  sys_free(region);
+  // Popping newest first leaves the oldest rewound block at the head of spare.
+  while (slist_first(&region->blocks) != mark.block) {
+    slist_pop(&region->blocks, block, slist);
+    slist_insert(&region->spare, block, slist);
+  }
+
+  region->high_water = max(region->high_water, region->requested);
+  region->requested = mark.requested;
+  region->cursor = mark.cursor;
+  region->limit = __r_block_limit(region, mark.block);
+  mark.block->num_free = 0;
+}
+
+static inline void __attribute__((unused))
+r_reset(region_t region) {
+  struct r_block* home = __r_home_block(region);
+  r_rewind(region, new(struct r_mark,
+		       .cursor = home->bytes + sizeof(struct region),
+		       .block = home));
+
+  if (region->vm_commit != NULL) {
+    size_t page = cast(size_t, sysconf(_SC_PAGESIZE));
+    char* unused = cast(char*, (cast(uintptr_t, region->cursor) + page - 1)
+			& ~(page - 1));
+    madvise(unused, cast(size_t, region->vm_commit - unused), MADV_DONTNEED);
+  }
+}
+
+static inline region_t __attribute__((unused))
+r_thread_local(region_t region) {
+  if (likely(__r_thread.parent == region
+	     && __r_thread.serial == region->serial)) {
+    return __r_thread.child;
+  }
+  return __r_thread_local_slow_(region);
+}
+
+static
+region_t __r_thread_local_slow_(region_t region) {
+  struct r_thread_region* entry;
+  region_t child = NULL;
+
+  __r_spin_lock(&region->lock);
+  slist_foreach(entry, &region->threads, slist) {
+    if (entry->thread == &__r_thread) {
+      child = entry->region;
+      break;
+    }
+  }
+
+  if (child == NULL) {
+    child = r_create();
+    r_malloc_init(child, entry, .thread = &__r_thread, .region = child);
+    slist_insert(&region->threads, entry, slist);
+  }
+
+  __r_thread = new(struct r_thread_cache,
+		   .parent = region,
+		   .serial = region->serial,
+		   .child = child);
+  __r_spin_unlock(&region->lock);
+  return child;
+}
+
+static inline void*
+__r_realloc_(region_t region, void* ptr, size_t old, size_t bytes) {
+  if (ptr == NULL) {
+    return __r_malloc_(region, bytes, alignof(max_align_t));
+  }
+
+  // Nothing but the most recent allocation ends at the cursor.
+  if (as_bytes(ptr) + old == region->cursor) {
+    if (bytes <= old
+	|| bytes - old <= cast(size_t, region->limit - region->cursor)
+	|| (region->vm_commit != NULL && __r_vm_commit_(region, bytes - old))) {
+      region->cursor = cast(char*, ptr) + bytes;
+      region->requested += bytes - old;
+      return ptr;
+    }
+  } else if (bytes <= old) {
+    return ptr;
+  }
+
+  uintptr_t addr = cast(uintptr_t, ptr);
+  void* res = __r_malloc_(region, bytes, min(addr & -addr, alignof(max_align_t)));
+  region->requested -= old;
+  return memcpy(res, ptr, old);
 }
 
 static inline void*
 __r_add_struct(region_t region, r_generic_destructor_t dstr, size_t bytes) {
-  struct r_struct* ds = r_malloc_flex(region, struct r_struct, data, bytes);
+  struct r_struct* ds = __r_malloc_(region, sizeof(struct r_struct) + bytes,
+				    alignof(struct r_struct));
   slist_insert(&region->structs, ds, slist);
   ds->dstr = dstr;
   return ds->data;
@@ -256,32 +951,225 @@ __r_add_struct(region_t region, r_generic_destructor_t dstr, size_t bytes) {
 
 void __r_add_subregion_(region_t region, int tag, region_t sub) {
   struct r_sub_region* res;
-  r_malloc_init(region, res, .tag = tag, .region = sub);
+  r_malloc_init(region, res, .tag = tag, .region = sub,
+		.shadow = __r_sub_find_(region, tag));
   slist_insert(&region->subs, res, slist);
+
+  ++region->num_subs;
+  if (region->sub_index != NULL) {
+    __r_sub_index_set_(region, tag, res);
+  } else if (region->num_subs > REGION_SUB_INDEX_MIN) {
+    __r_sub_index_resize_(region, 4 * REGION_SUB_INDEX_MIN);
+  }
 }
 
 region_t __r_get_subregion_(region_t region, int tag) {
+  struct r_sub_region* sub = __r_sub_find_(region, tag);
+  if (sub == NULL) {
+    UNREACHABLE;
+  }
+  return sub->region;
+}
+
+region_t __r_try_get_subregion_(region_t region, int tag) {
+  struct r_sub_region* sub = __r_sub_find_(region, tag);
+  return (sub != NULL) ? sub->region : NULL;
+}
+
+// Extracted entries stay linked, so that marks taken before still find them.
+region_t __r_extract_subregion_(region_t region, int tag) {
+  struct r_sub_region* sub = __r_sub_find_(region, tag);
+  if (sub == NULL) {
+    UNREACHABLE;
+  }
+
+  region_t extracted = sub->region;
+  __r_sub_unlink_(region, sub);
+  sub->region = NULL;
+  // Dead entries would slow down scanning the list from now on.
+  if (region->sub_index == NULL) {
+    __r_sub_index_resize_(region, 4 * REGION_SUB_INDEX_MIN);
+  }
+  return extracted;
+}
+
+#define __r_sub_slot_(TAG, MASK)					\
+  (cast(size_t, (cast(uint64_t, cast(uint32_t, (TAG)))			\
+		 * 0x9e3779b97f4a7c15lu) >> 32) & (MASK))
+
+static inline struct r_sub_region*
+__r_sub_find_(region_t region, int tag) {
+  struct r_sub_region* sub;
+  if (region->sub_index == NULL) {
+    slist_foreach(sub, &region->subs, slist) {
+      if (sub->tag == tag && sub->region != NULL) {
+	return sub;
+      }
+    }
+    return NULL;
+  }
+
+  size_t mask = region->sub_mask;
+  for (size_t i = __r_sub_slot_(tag, mask);; i = (i + 1) & mask) {
+    sub = region->sub_index[i];
+    if (sub == NULL || sub->tag == tag) {
+      return sub;
+    }
+  }
+}
+
+// Forget SUB, the newest live subregion with its tag, uncovering its shadow.
+/////
+// Extraction and rewinding both take the newest live entry of a tag first, so
+// the shadow of a live entry is itself live.
+static inline void
+__r_sub_unlink_(region_t region, struct r_sub_region* sub) {
+  --region->num_subs;
+  if (region->sub_index != NULL) {
+    __r_sub_index_set_(region, sub->tag, sub->shadow);
+  }
+}
+
+// Point TAG at SUB in the index, or remove TAG if SUB is NULL.
+static void
+__r_sub_index_set_(region_t region, int tag, struct r_sub_region* sub) {
+  struct r_sub_region** index = region->sub_index;
+  size_t mask = region->sub_mask;
+  size_t i = __r_sub_slot_(tag, mask);
+  while (index[i] != NULL && index[i]->tag != tag) {
+    i = (i + 1) & mask;
+  }
+
+  if (sub != NULL) {
+    bool fresh = index[i] == NULL;
+    index[i] = sub;
+    if (fresh && ++region->sub_len * 2 > mask + 1) {
+      __r_sub_index_resize_(region, 2 * (mask + 1));
+    }
+    return;
+  }
+  if (index[i] == NULL) {
+    return;
+  }
+
+  // Shift later entries of the probe run back over the hole.
+  --region->sub_len;
+  for (size_t j = i;;) {
+    j = (j + 1) & mask;
+    if (index[j] == NULL) {
+      break;
+    }
+    size_t home = __r_sub_slot_(index[j]->tag, mask);
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      index[i] = index[j];
+      i = j;
+    }
+  }
+  index[i] = NULL;
+}
+
+// Rebuild the index with CAP (a power of two) slots.
+static void
+__r_sub_index_resize_(region_t region, size_t cap) {
+  struct r_sub_region** old = region->sub_index;
+  size_t old_cap = (old != NULL) ? region->sub_mask + 1 : 0;
+
+  region->sub_index = sys_malloc_array(struct r_sub_region*, cap);
+  memset(region->sub_index, 0, cap * sizeof(struct r_sub_region*));
+  region->sub_mask = cap - 1;
+  region->sub_len = 0;
+
+  if (old != NULL) {
+    struct r_sub_region** entry;
+    array_foreach(entry, old_cap, old) {
+      if (*entry != NULL) {
+	__r_sub_index_set_(region, (*entry)->tag, *entry);
+      }
+    }
+    sys_free(old);
+    return;
+  }
+
+  // The list is newest first, so the first live entry of a tag is the one seen.
   struct r_sub_region* sub;
   slist_foreach(sub, &region->subs, slist) {
-    if (sub->tag == tag) {
-      return sub->region;
+    if (sub->region != NULL && __r_sub_find_(region, sub->tag) == NULL) {
+      __r_sub_index_set_(region, sub->tag, sub);
     }
   }
+}
 
-  UNREACHABLE;
+static inline struct r_stats __attribute__((warn_unused_result, unused))
+r_stats(region_t region) {
+  struct r_stats stats = { 0 };
+  __r_stats_add_(&stats, region);
+  return stats;
 }
 
-region_t __r_extract_subregion_(region_t region, int tag) {
-  struct r_sub_region** sub;
-  struct r_sub_region* extracted;
-  slist_mut_foreach(sub, &region->subs, slist) {
-    if ((*sub)->tag == tag) {
-      extracted = *sub;
-      slist_remove(sub, slist);
-      return extracted->region;
+static inline void
+__r_stats_add_(struct r_stats* stats, region_t region) {
+  region->high_water = max(region->high_water, region->requested);
+  stats->requested += region->requested;
+  stats->high_water += region->high_water;
+
+  struct r_block* home = __r_home_block(region);
+  struct r_block* block;
+  slist_foreach(block, &region->blocks, slist) {
+    stats->reserved += (block == home && region->vm_commit != NULL)
+      ? cast(size_t, region->vm_commit - as_bytes(home))
+      : block->size + sizeof(struct r_block);
+    stats->tail_waste += block->num_free;
+    ++stats->blocks;
+  }
+  if (region->vm_commit != NULL) {
+    // Counted apart from tail_waste, even once the region left the range.
+    stats->uncommitted += cast(size_t, home->bytes + home->size - region->vm_commit);
+  }
+  slist_foreach(block, &region->spare, slist) {
+    stats->reserved += block->size + sizeof(struct r_block);
+    ++stats->blocks;
+  }
+  slist_foreach(block, &region->oversized, slist) {
+    stats->reserved += block->size + sizeof(struct r_block);
+    ++stats->oversized;
+  }
+
+  stats->structs += slist_len(&region->structs, slist);
+
+  struct r_sub_region* sub;
+  slist_foreach(sub, &region->subs, slist) {
+    if (sub->region != NULL) {
+      __r_stats_add_(stats, sub->region);
     }
   }
 
-  UNREACHABLE;
+  struct r_thread_region* child;
+  __r_spin_lock(&region->lock);
+  slist_foreach(child, &region->threads, slist) {
+    __r_stats_add_(stats, child->region);
+  }
+  __r_spin_unlock(&region->lock);
+}
+
+#ifdef REGION_PROFILE
+static inline void
+__r_site_record_(struct r_site* site, size_t bytes) {
+  atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&site->bytes, bytes, memory_order_relaxed);
+  if (unlikely(!atomic_load_explicit(&site->linked, memory_order_acquire))
+      && !atomic_exchange(&site->linked, true)) {
+    site->next = atomic_load(&__r_sites);
+    while (!atomic_compare_exchange_weak(&__r_sites, &site->next, site)) {}
+  }
 }
 
+static inline void __attribute__((unused))
+r_profile_dump(FILE* out) {
+  fprintf(out, "%-40s %12s %16s\n", "site", "count", "bytes");
+  struct r_site* site;
+  for (site = atomic_load(&__r_sites); site != NULL; site = site->next) {
+    fprintf(out, "%32s:%-7d %12lu %16lu\n", site->file, site->line,
+	    atomic_load(&site->count), atomic_load(&site->bytes));
+  }
+}
+#endif
@@ -0,0 +1,180 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// snapshot.h - Region snapshots, saved to disk and mapped back zero-copy.
+//
+// A snapshot is the allocated contents of a reserved region written to a file.
+// Loading maps the file read-only wherever the system puts it, so the data in
+// it may not hold ordinary pointers. Instead structures link to each other
+// with self-relative pointers (rel_t), which stay valid at any address, and
+// one root allocation is recorded as the entry point.
+//
+// The file keeps each allocation at the same offset within its page as it had
+// in the region, so alignments up to the page size survive the round trip.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "basic.h"
+#include "error.h"
+#include "file_map.h"
+#include "region.h"
+
+#include <stdio.h>
+
+// Self-relative pointer to TYPE.
+/////
+// struct table { size_t len; rel_t(struct entry) entries; };
+#define rel_t(TYPE)					\
+  struct { ptrdiff_t __rel_off; TYPE* __rel_type[0]; }
+
+#define rel_elem_typeof(REL)			\
+  typeof(*(REL)->__rel_type[0])
+
+// Point the relative pointer at REL to PTR, or to NULL.
+/////
+// rel_set(&table->entries, r_malloc_aligned(r, ...));
+#define rel_set(REL, PTR)						\
+  do {									\
+    __auto_type __rel = (REL);						\
+    pointer(rel_elem_typeof(__rel)) __rel_ptr = (PTR);			\
+    __rel->__rel_off = (__rel_ptr == NULL)				\
+      ? 0 : as_bytes(__rel_ptr) - as_bytes(__rel);			\
+  } while (0)
+
+// Get the pointer stored in the relative pointer at REL.
+#define rel_get(REL)							\
+  ({ __auto_type __rel = (REL);						\
+    cast(pointer(rel_elem_typeof(__rel)),				\
+	 __rel_get_(__rel, __rel->__rel_off)); })
+
+// Create a region of up to BYTES which can be saved as a snapshot.
+#define r_snapshot_create(BYTES)		\
+  r_create_reserved((BYTES), false)
+
+// Save the contents of region REG to the file PATH, with ROOT as entry point.
+/////
+// REG must come from r_snapshot_create, must not have outgrown its
+// reservation, and must not hold structures, subregions or thread children.
+// ROOT must be allocated in REG. Fails with FILE_ERROR_LAYOUT otherwise.
+#define r_snapshot_save(REG, ROOT, PATH)		\
+  __r_snapshot_save_((REG), (ROOT), (PATH))
+
+// Map the snapshot file PATH read-only, pointing ROOT at its entry point.
+/////
+// The mapping lives until region REG is destroyed. Pages are read from the
+// file as they are first touched.
+/////
+// const struct table* table; r_snapshot_load(r, "table.snap", &table);
+#define r_snapshot_load(REG, PATH, ROOT)				\
+  ({ const void* __snapshot_root = NULL;				\
+    struct file_error __snapshot_err =					\
+      __r_snapshot_load_((REG), (PATH), &__snapshot_root);		\
+    *(ROOT) = __snapshot_root;						\
+    __snapshot_err; })
+
+////////////////////////////////////////////////////////////////////////////////
+// Private
+
+#include <stdint.h>
+#include <string.h>
+
+#define SNAPSHOT_MAGIC 0x50414e5352434b00lu // "\0KCRSNAP"
+#define SNAPSHOT_VERSION 1u
+
+// Written at the start of the file, followed by zeros up to the data.
+struct r_snapshot_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t data_offset; // Offset of the first allocation within its page.
+  uint64_t bytes;
+  uint64_t root;        // Offset of the root from the data.
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline void* __attribute__((always_inline, unused))
+__rel_get_(const void*, ptrdiff_t off);
+
+static inline struct file_error __attribute__((warn_unused_result, unused))
+__r_snapshot_save_(region_t, const void* root, const char* path);
+static inline struct file_error __attribute__((warn_unused_result, unused))
+__r_snapshot_load_(region_t, const char* path, const void** root);
+
+static bool __attribute__((unused))
+__r_snapshot_valid_(const void* map, size_t len, const void*);
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline void*
+__rel_get_(const void* rel, ptrdiff_t off) {
+  return (off == 0) ? NULL : cast(void*, as_bytes(rel) + off);
+}
+
+static inline struct file_error
+__r_snapshot_save_(region_t region, const void* root, const char* path) {
+  struct r_block* home = __r_home_block(region);
+  const char* data = home->bytes + sizeof(struct region);
+  if (region->vm_commit == NULL
+      || slist_first(&region->blocks) != home
+      || !slist_is_empty(&region->oversized)
+      || !slist_is_empty(&region->structs)
+      || !slist_is_empty(&region->subs)
+      || !slist_is_empty(&region->threads)
+      || as_bytes(root) < data || as_bytes(root) >= region->cursor) {
+    return __file_error(FILE_ERROR_LAYOUT);
+  }
+
+  _Static_assert(sizeof(struct r_snapshot_header)
+		<= sizeof(struct r_block) + sizeof(struct region),
+		"Snapshot header overlaps the data");
+  struct r_snapshot_header header = {
+    .magic = SNAPSHOT_MAGIC,
+    .version = SNAPSHOT_VERSION,
+    .data_offset = cast(uint32_t, data - as_bytes(home)),
+    .bytes = cast(uint64_t, region->cursor - data),
+    .root = cast(uint64_t, as_bytes(root) - data),
+  };
+  char pad[sizeof(struct r_block) + sizeof(struct region)] = { 0 };
+  memcpy(pad, &header, sizeof(header));
+
+  FILE* file = fopen(path, "wb");
+  if (file == NULL) {
+    return __file_error(FILE_ERROR_IO);
+  }
+  if (fwrite(pad, 1, header.data_offset, file) != header.data_offset
+      || fwrite(data, 1, header.bytes, file) != header.bytes) {
+    struct file_error err = __file_error(FILE_ERROR_IO);
+    fclose(file);
+    return err;
+  }
+  if (fclose(file) != 0) {
+    return __file_error(FILE_ERROR_IO);
+  }
+  return error_no(file_error);
+}
+
+static inline struct file_error
+__r_snapshot_load_(region_t region, const char* path, const void** root) {
+  const void* map;
+  struct file_error err =
+    __r_file_map_(region, path, sizeof(struct r_snapshot_header),
+		  __r_snapshot_valid_, NULL, &map);
+  if (!is_error(&err)) {
+    const struct r_snapshot_header* header = map;
+    *root = as_bytes(map) + header->data_offset + header->root;
+  }
+  return err;
+}
+
+static bool
+__r_snapshot_valid_(const void* map, size_t len, const void* arg) {
+  IGNORE(arg);
+  const struct r_snapshot_header* header = map;
+  return header->magic == SNAPSHOT_MAGIC
+    && header->version == SNAPSHOT_VERSION
+    && header->data_offset >= sizeof(struct r_snapshot_header)
+    && header->data_offset <= len
+    && header->bytes == len - header->data_offset
+    && header->root < header->bytes;
+}
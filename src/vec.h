@@ -9,6 +9,7 @@
 #include "type.h"
 #include "util.h"
 #include "basic.h"
+#include "region.h"
 
 // Declare a growable array NAME for elements TYPE.
 #define VEC_DECL(NAME, TYPE)				\
@@ -65,9 +66,7 @@
     __auto_type __vec = (VEC);						\
     pointer(vec_elem_typeof(__vec)) __push_ref = (PTR);	\
     if (vec_cap(__vec) <= vec_len(__vec)) {				\
-      vec_cap(__vec) +=							\
-	max(8UL, cast(size_t, (cast(double, vec_cap(__vec)) * 1.6)));	\
-      __vec_grow(__vec, vec_cap(__vec));				\
+      __vec_grow(__vec, __vec_next_cap(vec_cap(__vec)));		\
     }									\
     memcpy(vec_raw(__vec) + vec_len(__vec),				\
            __push_ref, vec_elem_sizeof(__vec));			\
@@ -156,6 +155,58 @@
 // Create a new vec stored in region REG.
 #define r_new_vec(REG, VEC_TYPE) r_new_vec_w_cap(REG, VEC_TYPE, 8)
 
+////////////////////////////////////////////////////////////////////////////////
+// Region vecs
+//
+// Vecs whose elements live in a region. They are grown inside the region with
+// the r_vec_* macros, never destroyed, and disappear along with the region.
+// All other vec macros apply as usual.
+/////
+// struct int_vec v = r_vec_new(r, struct int_vec); r_vec_push(r, &v, 3);
+
+// Allocate a new vec of VEC_TYPE in region REG with initial capacity CAP.
+#define r_vec_new_w_cap(REG, VEC_TYPE, CAP) ({				\
+  size_t __cap = (CAP);							\
+  member_typeof(VEC_TYPE, parray) __parray;				\
+  typeof(parray_raw(&__parray)) __ptr =					\
+    r_malloc_aligned((REG), parray_elem_sizeof(&__parray) * __cap,	\
+		     alignof(parray_elem_typeof(&__parray)));		\
+  parray_init(&__parray, __ptr, 0);					\
+  new(VEC_TYPE, .cap = __cap, .parray = __parray);			\
+})
+
+// Allocate a new vec of the type in region REG.
+#define r_vec_new(REG, VEC_TYPE) r_vec_new_w_cap(REG, VEC_TYPE, 8)
+
+// Put a value, referenced by PTR, at the end of the region vec.
+#define r_vec_push_ref(REG, VEC, PTR)					\
+  do {									\
+    __auto_type __vec = (VEC);						\
+    pointer(vec_elem_typeof(__vec)) __push_ref = (PTR);		\
+    if (vec_cap(__vec) <= vec_len(__vec)) {				\
+      __r_vec_grow((REG), __vec, __vec_next_cap(vec_cap(__vec)));	\
+    }									\
+    memcpy(vec_raw(__vec) + vec_len(__vec),				\
+           __push_ref, vec_elem_sizeof(__vec));				\
+    vec_len(__vec)++;							\
+  } while (0)
+
+// Put a value VAL at the end of the region vec.
+#define r_vec_push(REG, VEC, VAL)				\
+  do {								\
+    __auto_type __vec = (VEC);					\
+    vec_elem_typeof(__vec) __push_val = (VAL);			\
+    r_vec_push_ref((REG), __vec, &__push_val);			\
+  } while (0)
+
+// Reserve CAP spaces for elements in the region vec.
+#define r_vec_reserve(REG, VEC, CAP)					\
+  do {									\
+    __auto_type __cap = (CAP);						\
+    __auto_type __vec = (VEC);						\
+    if (vec_cap(__vec) < __cap) __r_vec_grow((REG), __vec, __cap);	\
+  } while (0)
+
 ////////////////////////////////////////////////////////////////////////////////
 // Private
 
@@ -164,6 +215,9 @@ __vec_generic_destructor(void* vec);
 
 ////////////////////////////////////////////////////////////////////////////////
 
+#define __vec_next_cap(CAP)						\
+  ((CAP) + max(8UL, cast(size_t, (cast(double, (CAP)) * 1.6))))
+
 #define __vec_grow(VEC, CAP)						\
   do {								        \
     __auto_type __vec = (VEC);						\
@@ -175,6 +229,19 @@ __vec_generic_destructor(void* vec);
     parray_init(&vec_parray(__vec), __ptr, vec_len(__vec));		\
   } while (0)
 
+// Grows in place while the vec is the region's most recent allocation.
+#define __r_vec_grow(REG, VEC, CAP)					\
+  do {									\
+    __auto_type __vec = (VEC);						\
+    size_t __old_cap = vec_cap(__vec);					\
+    vec_cap(__vec) = (CAP);						\
+    pointer(vec_elem_typeof(__vec)) __ptr =				\
+      r_realloc((REG), vec_raw(__vec),					\
+		vec_elem_sizeof(__vec) * __old_cap,			\
+		vec_elem_sizeof(__vec) * vec_cap(__vec));		\
+    parray_init(&vec_parray(__vec), __ptr, vec_len(__vec));		\
+  } while (0)
+
 static inline void
 __vec_generic_destructor(void* vec_) {
   vec_t(char)* vec = cast(typeof(vec), vec_);
@@ -1,6 +1,12 @@
 #include "test.h"
 #include "basic.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
 #define HMAP_NAME hmap_int_int
 #define HMAP_KEY_TYPE int
 #define HMAP_VAL_TYPE unsigned int
@@ -67,6 +73,1611 @@ TEST_DECL(test_int_int, r) {
   return true;
 }
 
+// Insert, look up, erase and reinsert keys.
+TEST_DECL(test_int_int_churn, r) {
+  IGNORE(r);
+  static const int N = 20000;
+  struct hmap_int_int map = hmap_int_int_new();
+  unsigned int val;
+  int i;
+
+  range_foreach(i, 0, N) {
+    val = cast(unsigned int, i) * 3;
+    if (hmap_int_int_insert(&map, &i, &val) != NULL) {
+      tassertf("insert", false, "Key %d already present", i);
+    }
+  }
+  val = 0;
+  i = 7;
+  tassert_eqf("insert present", *hmap_int_int_insert(&map, &i, &val), 21u,
+	      "Value overwritten");
+
+  for (i = 0; i < N; i += 2) {
+    if (!hmap_int_int_erase(&map, &i)) {
+      tassertf("erase", false, "Key %d missing", i);
+    }
+  }
+  i = 0;
+  tassertf("erase absent", !hmap_int_int_erase(&map, &i), "Key %d erased twice", i);
+
+  range_foreach(i, -N, 2 * N) {
+    unsigned int* found = hmap_int_int_get(&map, &i);
+    bool present = i >= 0 && i < N && i % 2 == 1;
+    if ((found != NULL) != present
+	|| (present && *found != cast(unsigned int, i) * 3)) {
+      tassertf("get", false, "Key %d %s", i,
+	       present ? "missing" : "present");
+    }
+  }
+
+  for (i = 0; i < N; i += 2) {
+    val = cast(unsigned int, i) * 3;
+    hmap_int_int_insert(&map, &i, &val);
+  }
+  range_foreach(i, 0, N) {
+    unsigned int* found = hmap_int_int_get(&map, &i);
+    if (found == NULL || *found != cast(unsigned int, i) * 3) {
+      tassertf("reinsert", false, "Key %d missing", i);
+    }
+  }
+
+  // Cycle a window of keys through the map, churning its slots.
+  range_foreach(i, N, 8 * N) {
+    int old = i - N / 4;
+    val = cast(unsigned int, i) * 3;
+    hmap_int_int_insert(&map, &i, &val);
+    if (old >= N && !hmap_int_int_erase(&map, &old)) {
+      tassertf("cycle", false, "Key %d missing", old);
+    }
+  }
+  range_foreach(i, 0, 8 * N) {
+    bool present = i < N || i >= 8 * N - N / 4;
+    if ((hmap_int_int_get(&map, &i) != NULL) != present) {
+      tassertf("cycle get", false, "Key %d %s", i,
+	       present ? "missing" : "present");
+    }
+  }
+
+  hmap_int_int_destroy(&map);
+  return true;
+}
+
+#define HMAP_NAME hmap_int_int_soa
+#define HMAP_KEY_TYPE int
+#define HMAP_VAL_TYPE unsigned int
+#define HMAP_SOA
+#include "hmap.h"
+
+// Slots keep keys and values alone, their distances and hash bytes live in the
+// meta array and stay in step with them as entries shift.
+TEST_DECL(test_soa_meta, r) {
+  IGNORE(r);
+  static const int N = 20000;
+  struct hmap_int_int_soa map = hmap_int_int_soa_new();
+  size_t index, live = 0;
+  int i;
+
+  tassert_eqf("bucket size", sizeof(struct hmap_int_int_soa__bucket),
+	      sizeof(int) + sizeof(unsigned int), "%lu",
+	      sizeof(struct hmap_int_int_soa__bucket));
+  range_foreach(i, 0, N) {
+    unsigned int val = cast(unsigned int, i) * 3;
+    hmap_int_int_soa_insert(&map, &i, &val);
+  }
+  for (i = 0; i < N; i += 2) {
+    hmap_int_int_soa_erase(&map, &i);
+  }
+
+  struct hmap_stats stats = hmap_int_int_soa_stats(&map);
+  range_foreach(index, 0, stats.num_slots) {
+    const struct hmap_int_int_soa__meta* meta = &map.meta[index];
+    if (meta->dist < 0) {
+      continue;
+    }
+    int key = map.buckets[index].key;
+    size_t hash = hmap_int_int_soa_hash(&key);
+    size_t home = hmap_int_int_soa__home(&map, hash);
+    if (index - home != cast(size_t, meta->dist) || meta->frag != hash >> 56
+	|| key % 2 == 0 || map.buckets[index].val != cast(unsigned int, key) * 3) {
+      tassertf("meta", false, "Slot %lu holds %d at %d", index, key, meta->dist);
+    }
+    ++live;
+  }
+  tassert_eqf("meta live", live, cast(size_t, N) / 2, "%lu", live);
+
+  range_foreach(i, -N, 2 * N) {
+    unsigned int* found = hmap_int_int_soa_get(&map, &i);
+    bool present = i >= 0 && i < N && i % 2 == 1;
+    if ((found != NULL) != present || (present && *found != cast(unsigned int, i) * 3)) {
+      tassertf("get", false, "Key %d %s", i, present ? "missing" : "present");
+    }
+  }
+
+  hmap_int_int_soa_destroy(&map);
+  return true;
+}
+
+#define HMAP_NAME hmap_int_int_swiss
+#define HMAP_KEY_TYPE int
+#define HMAP_VAL_TYPE unsigned int
+#define HMAP_SWISS
+#include "hmap.h"
+
+// Count the erased markers of MAP into ERASED, checking the control byte of
+// every full slot and that each slot counts once against the growth allowed.
+static bool swiss_ctrl_ok(const struct hmap_int_int_swiss* map, size_t* erased) {
+  size_t index, full = 0;
+  *erased = 0;
+  range_foreach(index, 0, map->mask + 1) {
+    int8_t ctrl = map->ctrl[index];
+    if (ctrl == __HMAP_ERASED) {
+      // Only left where the group has no empty slot to end probes.
+      const int8_t* group = &map->ctrl[index & ~(__HMAP_GROUP - 1)];
+      if (memchr(group, (uint8_t) __HMAP_EMPTY, __HMAP_GROUP) != NULL) {
+	return false;
+      }
+      ++*erased;
+    } else if (ctrl >= 0) {
+      size_t hash = hmap_int_int_swiss_hash(&map->buckets[index].key);
+      if (ctrl != cast(int8_t, hash & 0x7f)) {
+	return false;
+      }
+      ++full;
+    }
+  }
+  return full == map->num_items && map->growth_left + map->num_items + *erased
+    == hmap_int_int_swiss__growth_for(map->mask + 1);
+}
+
+// Erasing leaves markers in full groups, which probes go past and inserts
+// fill again.
+TEST_DECL(test_swiss_ctrl, r) {
+  IGNORE(r);
+  static const int N = 20000;
+  struct hmap_int_int_swiss map = hmap_int_int_swiss_new();
+  size_t erased, refilled;
+  int i;
+
+  range_foreach(i, 0, N) {
+    unsigned int val = cast(unsigned int, i) * 3;
+    hmap_int_int_swiss_insert(&map, &i, &val);
+  }
+  tassertf("ctrl", swiss_ctrl_ok(&map, &erased) && erased == 0,
+	   "%lu items, %lu erased", map.num_items, erased);
+
+  for (i = 0; i < N; i += 2) {
+    hmap_int_int_swiss_erase(&map, &i);
+  }
+  tassertf("ctrl erased", swiss_ctrl_ok(&map, &erased) && erased > 0,
+	   "%lu items, %lu erased", map.num_items, erased);
+  range_foreach(i, -N, 2 * N) {
+    unsigned int* found = hmap_int_int_swiss_get(&map, &i);
+    bool present = i >= 0 && i < N && i % 2 == 1;
+    if ((found != NULL) != present || (present && *found != cast(unsigned int, i) * 3)) {
+      tassertf("get", false, "Key %d %s", i, present ? "missing" : "present");
+    }
+  }
+
+  size_t slots = map.mask + 1;
+  for (i = 0; i < N; i += 2) {
+    unsigned int val = cast(unsigned int, i) * 3;
+    hmap_int_int_swiss_insert(&map, &i, &val);
+  }
+  tassertf("ctrl refilled", swiss_ctrl_ok(&map, &refilled) && refilled < erased
+	   && map.mask + 1 == slots, "%lu erased, %lu slots", refilled, map.mask + 1);
+  range_foreach(i, 0, N) {
+    unsigned int* found = hmap_int_int_swiss_get(&map, &i);
+    if (found == NULL || *found != cast(unsigned int, i) * 3) {
+      tassertf("get refilled", false, "Key %d", i);
+    }
+  }
+
+  hmap_int_int_swiss_destroy(&map);
+  return true;
+}
+
+#define HMAP_NAME hmap_int_int_fastmod
+#define HMAP_KEY_TYPE int
+#define HMAP_VAL_TYPE unsigned int
+#define HMAP_FASTMOD
+#include "hmap.h"
+
+// Expected home slot of HASH among CAP slots with HMAP_FASTMOD.
+static size_t fastmod_home(size_t hash, size_t cap) {
+  return (cap <= UINT32_MAX) ? cast(uint32_t, hash ^ (hash >> 32)) % cap : hash % cap;
+}
+
+TEST_DECL(test_fastmod_home, r) {
+  IGNORE(r);
+  static const size_t hashes[] = {
+    0, 1, 4, 5, 0x7fffffff, 0xffffffff, 0x100000000lu, 0x9e3779b97f4a7c15lu,
+    SIZE_MAX / 3, SIZE_MAX - 1, SIZE_MAX,
+  };
+  struct hmap_int_int_fastmod map;
+  const size_t* hash;
+
+  range_foreach(map.slot_bound, 0, array_len(hmap_int_int_fastmod__slot_bounds)) {
+    size_t cap = hmap_int_int_fastmod__slot_bounds[map.slot_bound].cap;
+    array_foreach(hash, array_len(hashes), hashes) {
+      size_t edge = (*hash | 0xffffffff) - cap;
+      size_t home = hmap_int_int_fastmod__home(&map, *hash);
+      if (home != fastmod_home(*hash, cap)) {
+	tassertf("home", false, "%lu among %lu gave %lu", *hash, cap, home);
+      }
+      home = hmap_int_int_fastmod__home(&map, edge);
+      if (home != fastmod_home(edge, cap)) {
+	tassertf("home edge", false, "%lu among %lu gave %lu", edge, cap, home);
+      }
+    }
+  }
+  return true;
+}
+
+// Every entry sits its distance past the home slot given by the reduction
+// above, after erasing leaves entries shifted back.
+TEST_DECL(test_fastmod_place, r) {
+  IGNORE(r);
+  static const int N = 20000;
+  struct hmap_int_int_fastmod map = hmap_int_int_fastmod_new();
+  size_t index;
+  int i;
+
+  range_foreach(i, 0, N) {
+    unsigned int val = cast(unsigned int, i) * 3;
+    hmap_int_int_fastmod_insert(&map, &i, &val);
+  }
+  for (i = 0; i < N; i += 3) {
+    hmap_int_int_fastmod_erase(&map, &i);
+  }
+
+  size_t cap = hmap_int_int_fastmod__slot_bounds[map.slot_bound].cap;
+  struct hmap_stats stats = hmap_int_int_fastmod_stats(&map);
+  range_foreach(index, 0, stats.num_slots) {
+    const struct hmap_int_int_fastmod__bucket* bucket = &parray_get(&map.buckets, index);
+    if (bucket->dist >= 0
+	&& (bucket->hash != hmap_int_int_fastmod_hash(&bucket->key)
+	    || index - cast(size_t, bucket->dist) != fastmod_home(bucket->hash, cap))) {
+      tassertf("place", false, "Slot %lu holds %d at %d", index, bucket->key,
+	       bucket->dist);
+    }
+  }
+  range_foreach(i, -N, 2 * N) {
+    unsigned int* found = hmap_int_int_fastmod_get(&map, &i);
+    bool present = i >= 0 && i < N && i % 3 != 0;
+    if ((found != NULL) != present || (present && *found != cast(unsigned int, i) * 3)) {
+      tassertf("get", false, "Key %d %s", i, present ? "missing" : "present");
+    }
+  }
+
+  hmap_int_int_fastmod_destroy(&map);
+  return true;
+}
+
+#define HMAP_NAME hmap_int_int_pow2
+#define HMAP_KEY_TYPE int
+#define HMAP_VAL_TYPE unsigned int
+#define HMAP_SOA
+#define HMAP_POW2
+#include "hmap.h"
+
+// Capacities stay powers of two as the map grows, and every entry sits its
+// distance past the top bits of its hash times the golden ratio.
+TEST_DECL(test_pow2_place, r) {
+  IGNORE(r);
+  static const int N = 20000;
+  struct hmap_int_int_pow2 map = hmap_int_int_pow2_new();
+  uint8_t checked = 0;
+  size_t index;
+  int i;
+
+  range_foreach(i, 0, N) {
+    unsigned int val = cast(unsigned int, i) * 3;
+    hmap_int_int_pow2_insert(&map, &i, &val);
+    if (map.slot_bound == checked) {
+      continue;
+    }
+    checked = map.slot_bound;
+
+    size_t cap = hmap_int_int_pow2__slot_bounds[map.slot_bound].cap;
+    int bits = __builtin_ctzl(cap);
+    if (cap != 1lu << bits) {
+      tassertf("cap", false, "%lu slots", cap);
+    }
+    struct hmap_stats stats = hmap_int_int_pow2_stats(&map);
+    range_foreach(index, 0, stats.num_slots) {
+      int8_t dist = map.meta[index].dist;
+      if (dist >= 0 && index - cast(size_t, dist)
+	  != (hmap_int_int_pow2_hash(&map.buckets[index].key)
+	      * 0x9e3779b97f4a7c15lu) >> (64 - bits)) {
+	tassertf("place", false, "Slot %lu of %lu at %d", index, cap, dist);
+      }
+    }
+  }
+  tassertf("grown", checked > 8, "Slot bound %u", checked);
+
+  range_foreach(i, -N, 2 * N) {
+    unsigned int* found = hmap_int_int_pow2_get(&map, &i);
+    bool present = i >= 0 && i < N;
+    if ((found != NULL) != present || (present && *found != cast(unsigned int, i) * 3)) {
+      tassertf("get", false, "Key %d %s", i, present ? "missing" : "present");
+    }
+  }
+
+  hmap_int_int_pow2_destroy(&map);
+  return true;
+}
+
+#define HMAP_NAME hmap_int_int_incremental
+#define HMAP_KEY_TYPE int
+#define HMAP_VAL_TYPE unsigned int
+#define HMAP_INCREMENTAL
+#include "hmap.h"
+
+// Each insert migrates a few old slots at most, and a migration is done before
+// the load calls for the next growth. Only a probe too long to place a key may
+// grow the map sooner, finishing the migration at once.
+TEST_DECL(test_incremental_steps, r) {
+  IGNORE(r);
+  static const int N = 200000;
+  struct hmap_int_int_incremental map = hmap_int_int_incremental_new();
+  size_t growths = 0;
+  int i;
+
+  range_foreach(i, 0, N) {
+    bool migrating = map.old != NULL;
+    uint8_t slot_bound = map.slot_bound;
+    size_t cursor = map.cursor;
+    unsigned int val = cast(unsigned int, i) * 3;
+    hmap_int_int_incremental_insert(&map, &i, &val);
+    if (map.slot_bound != slot_bound) {
+      ++growths;
+      if (map.old == NULL || map.cursor != 0 || (migrating
+	  && cast(size_t, i) + 1 > hmap_int_int_incremental__slot_load_count(slot_bound))) {
+	tassertf("growth", false, "Key %d grew the map mid migration", i);
+      }
+    } else if (map.old != NULL
+	       && map.cursor > cursor + hmap_int_int_incremental__migrate_slots) {
+      tassertf("step", false, "Key %d migrated %lu slots", i, map.cursor - cursor);
+    }
+  }
+  tassertf("growths", growths > 10, "%lu", growths);
+
+  range_foreach(i, -N, 2 * N) {
+    unsigned int* found = hmap_int_int_incremental_get(&map, &i);
+    bool present = i >= 0 && i < N;
+    if ((found != NULL) != present || (present && *found != cast(unsigned int, i) * 3)) {
+      tassertf("get", false, "Key %d %s", i, present ? "missing" : "present");
+    }
+  }
+
+  hmap_int_int_incremental_destroy(&map);
+  return true;
+}
+
+#define HMAP_NAME hmap_int_int_frag
+#define HMAP_KEY_TYPE int
+#define HMAP_VAL_TYPE unsigned int
+#define HMAP_STORED_HASH HMAP_HASH_FRAG
+#include "hmap.h"
+
+// Slots keep the top byte of the hash next to the distance instead of the
+// whole hash, and lookups compare it before keys.
+TEST_DECL(test_stored_hash_frag, r) {
+  IGNORE(r);
+  static const int N = 20000;
+  struct hmap_int_int_frag map = hmap_int_int_frag_new();
+  size_t index;
+  int i;
+
+  tassertf("bucket size", sizeof(struct hmap_int_int_frag__bucket)
+	   < sizeof(struct hmap_int_int__bucket), "%lu of %lu",
+	   sizeof(struct hmap_int_int_frag__bucket), sizeof(struct hmap_int_int__bucket));
+  range_foreach(i, 0, N) {
+    unsigned int val = cast(unsigned int, i) * 3;
+    hmap_int_int_frag_insert(&map, &i, &val);
+  }
+  for (i = 0; i < N; i += 3) {
+    hmap_int_int_frag_erase(&map, &i);
+  }
+
+  struct hmap_stats stats = hmap_int_int_frag_stats(&map);
+  tassert_eqf("stats bytes", stats.bytes,
+	      stats.num_slots * sizeof(struct hmap_int_int_frag__bucket), "%lu",
+	      stats.bytes);
+  range_foreach(index, 0, stats.num_slots) {
+    const struct hmap_int_int_frag__bucket* bucket = &parray_get(&map.buckets, index);
+    if (bucket->dist < 0) {
+      continue;
+    }
+    size_t hash = hmap_int_int_frag_hash(&bucket->key);
+    if (bucket->frag != hash >> 56
+	|| index - cast(size_t, bucket->dist) != hmap_int_int_frag__home(&map, hash)) {
+      tassertf("frag", false, "Slot %lu holds %d at %d", index, bucket->key,
+	       bucket->dist);
+    }
+  }
+  range_foreach(i, -N, 2 * N) {
+    unsigned int* found = hmap_int_int_frag_get(&map, &i);
+    bool present = i >= 0 && i < N && i % 3 != 0;
+    if ((found != NULL) != present || (present && *found != cast(unsigned int, i) * 3)) {
+      tassertf("get", false, "Key %d %s", i, present ? "missing" : "present");
+    }
+  }
+
+  hmap_int_int_frag_destroy(&map);
+  return true;
+}
+
+#define HMAP_NAME hmap_int_int_nohash
+#define HMAP_KEY_TYPE int
+#define HMAP_VAL_TYPE unsigned int
+#define HMAP_STORED_HASH HMAP_HASH_NONE
+#define HMAP_INCREMENTAL
+#include "hmap.h"
+
+// Slots keep no hash, so every growth rehashes the keys as they migrate.
+TEST_DECL(test_stored_hash_none, r) {
+  IGNORE(r);
+  static const int N = 50000;
+  struct hmap_int_int_nohash map = hmap_int_int_nohash_new();
+  size_t index;
+  int i;
+
+  tassertf("bucket size", sizeof(struct hmap_int_int_nohash__bucket)
+	   <= sizeof(struct hmap_int_int_frag__bucket)
+	   && sizeof(struct hmap_int_int_nohash__bucket)
+	   < sizeof(int) + sizeof(unsigned int) + sizeof(size_t), "%lu",
+	   sizeof(struct hmap_int_int_nohash__bucket));
+  range_foreach(i, 0, N) {
+    unsigned int val = cast(unsigned int, i) * 3;
+    hmap_int_int_nohash_insert(&map, &i, &val);
+    if (map.old != NULL && i % 97 == 0) {
+      // Keys on either side of the migration cursor.
+      int key = i / 2;
+      unsigned int* found = hmap_int_int_nohash_get(&map, &key);
+      if (found == NULL || *found != cast(unsigned int, key) * 3) {
+	tassertf("get migrating", false, "Key %d", key);
+      }
+    }
+  }
+  hmap_int_int_nohash_reserve(&map, cast(size_t, N));
+  tassertf("migrated", map.old == NULL, "Still migrating");
+
+  struct hmap_stats stats = hmap_int_int_nohash_stats(&map);
+  range_foreach(index, 0, stats.num_slots) {
+    const struct hmap_int_int_nohash__bucket* bucket = &parray_get(&map.buckets, index);
+    if (bucket->dist >= 0 && index - cast(size_t, bucket->dist)
+	!= hmap_int_int_nohash__home(&map, hmap_int_int_nohash_hash(&bucket->key))) {
+      tassertf("rehash", false, "Slot %lu holds %d at %d", index, bucket->key,
+	       bucket->dist);
+    }
+  }
+  range_foreach(i, -N, 2 * N) {
+    unsigned int* found = hmap_int_int_nohash_get(&map, &i);
+    bool present = i >= 0 && i < N;
+    if ((found != NULL) != present || (present && *found != cast(unsigned int, i) * 3)) {
+      tassertf("get", false, "Key %d %s", i, present ? "missing" : "present");
+    }
+  }
+
+  hmap_int_int_nohash_destroy(&map);
+  return true;
+}
+
+// Maps its arrays from a few pages on already.
+#define HMAP_HUGE_MIN_TEST 16384lu
+
+#define HMAP_NAME hmap_int_int_huge
+#define HMAP_KEY_TYPE int
+#define HMAP_VAL_TYPE unsigned int
+#define HMAP_HUGE
+#define HMAP_HUGE_MIN HMAP_HUGE_MIN_TEST
+#include "hmap.h"
+
+// Slot arrays from HMAP_HUGE_MIN bytes on start on a huge page boundary, and
+// the map keeps working as it grows past that size and shrinks back.
+TEST_DECL(test_huge_alloc, r) {
+  IGNORE(r);
+  static const int N = 20000, KEEP = 100;
+  struct hmap_int_int_huge map = hmap_int_int_huge_new();
+  int i;
+
+  range_foreach(i, 0, N) {
+    unsigned int val = cast(unsigned int, i) * 3;
+    hmap_int_int_huge_insert(&map, &i, &val);
+    struct hmap_stats stats = hmap_int_int_huge_stats(&map);
+    if (stats.bytes >= HMAP_HUGE_MIN_TEST
+	&& cast(uintptr_t, parray_raw(&map.buckets)) % __HMAP_HUGE_PAGE != 0) {
+      tassertf("huge", false, "%lu bytes at %p", stats.bytes,
+	       cast(void*, parray_raw(&map.buckets)));
+    }
+  }
+  range_foreach(i, KEEP, N) {
+    hmap_int_int_huge_erase(&map, &i);
+  }
+  struct hmap_stats stats = hmap_int_int_huge_stats(&map);
+  tassertf("shrunk", stats.bytes < HMAP_HUGE_MIN_TEST, "%lu bytes", stats.bytes);
+
+  range_foreach(i, 0, N) {
+    unsigned int* found = hmap_int_int_huge_get(&map, &i);
+    if ((found != NULL) != (i < KEEP)
+	|| (found != NULL && *found != cast(unsigned int, i) * 3)) {
+      tassertf("get", false, "Key %d", i);
+    }
+  }
+
+  hmap_int_int_huge_destroy(&map);
+  return true;
+}
+
+#define HMAP_NAME hmap_int_int_ordered
+#define HMAP_KEY_TYPE int
+#define HMAP_VAL_TYPE unsigned int
+#define HMAP_ORDERED
+#include "hmap.h"
+
+// Erased entries stay in the entry array until it fills up, which compacts it
+// in place while most of the room is erased, keeping insertion order.
+TEST_DECL(test_ordered_compact, r) {
+  IGNORE(r);
+  struct hmap_int_int_ordered map = hmap_int_int_ordered_new_reserve(1000);
+  size_t cap = map.cap, mask = map.mask;
+  int i, count = 0;
+
+  range_foreach(i, 0, cast(int, cap)) {
+    unsigned int val = cast(unsigned int, i);
+    hmap_int_int_ordered_insert(&map, &i, &val);
+  }
+  for (i = 0; i < cast(int, cap); ++i) {
+    if (i % 3 != 0) {
+      hmap_int_int_ordered_erase(&map, &i);
+    }
+  }
+  tassertf("erase", map.len == cap && map.num_items == (cap + 2) / 3, "%lu of %lu",
+	   map.num_items, map.len);
+  struct hmap_stats stats = hmap_int_int_ordered_stats(&map);
+  tassert_eqf("stats bytes", stats.bytes,
+	      cap * sizeof(struct hmap_int_int_ordered__bucket)
+	      + (mask + 1) * sizeof(uint32_t), "%lu", stats.bytes);
+
+  i = -1;
+  unsigned int val = cast(unsigned int, i);
+  hmap_int_int_ordered_insert(&map, &i, &val);
+  tassertf("compact", map.mask == mask && map.cap == cap && map.len == map.num_items,
+	   "%lu of %lu entries, %lu slots", map.num_items, map.len, map.mask + 1);
+
+  struct hmap_int_int_ordered_iter iter = hmap_int_int_ordered_iter(&map);
+  while (hmap_int_int_ordered_iter_next(&iter)) {
+    int key = *hmap_int_int_ordered_iter_key(&iter);
+    int expected = (count < cast(int, map.len) - 1) ? 3 * count : -1;
+    if (key != expected
+	|| *hmap_int_int_ordered_iter_val(&iter) != cast(unsigned int, key)) {
+      tassertf("order", false, "Key %d at %d", key, count);
+    }
+    ++count;
+  }
+  tassert_eqf("order count", cast(size_t, count), map.num_items, "%d", count);
+
+  for (i = 0; i < cast(int, cap); i += 6) {
+    hmap_int_int_ordered_erase(&map, &i);
+  }
+  hmap_int_int_ordered_shrink_to_fit(&map);
+  tassertf("shrink_to_fit", map.len == map.num_items && map.mask < mask,
+	   "%lu of %lu entries, %lu slots", map.num_items, map.len, map.mask + 1);
+  range_foreach(i, -1, cast(int, cap)) {
+    bool present = i == -1 || i % 6 == 3;
+    if ((hmap_int_int_ordered_get(&map, &i) != NULL) != present) {
+      tassertf("get", false, "Key %d %s", i, present ? "missing" : "present");
+    }
+  }
+
+  // Growing keeps a lone erased entry and rebuilds only the index.
+  i = -1;
+  hmap_int_int_ordered_erase(&map, &i);
+  mask = map.mask;
+  for (i = cast(int, cap); map.mask == mask; ++i) {
+    val = cast(unsigned int, i);
+    hmap_int_int_ordered_insert(&map, &i, &val);
+  }
+  tassertf("grow", map.len == map.num_items + 1 && map.cap >= map.len,
+	   "%lu of %lu entries", map.num_items, map.len);
+  int end = i;
+  range_foreach(i, -1, end) {
+    bool present = i >= cast(int, cap) || i % 6 == 3;
+    if ((hmap_int_int_ordered_get(&map, &i) != NULL) != present) {
+      tassertf("grow get", false, "Key %d %s", i, present ? "missing" : "present");
+    }
+  }
+
+  hmap_int_int_ordered_destroy(&map);
+  return true;
+}
+
+// Iteration order of an ordered map follows insertion across erasing and growth.
+TEST_DECL(test_ordered_order, r) {
+  IGNORE(r);
+  static const int N = 10000;
+  struct hmap_int_int_ordered map = hmap_int_int_ordered_new();
+  int* order = sys_malloc_array(int, cast(size_t, N));
+  int i, len = 0;
+
+  // Keys from a full cycle modulo N, in no hash related order. Keys erased
+  // and inserted again go to the end.
+  range_foreach(i, 0, N) {
+    int key = (i * 7919) % N;
+    unsigned int val = cast(unsigned int, key);
+    hmap_int_int_ordered_insert(&map, &key, &val);
+    if (key % 3 != 0) {
+      order[len++] = key;
+    }
+  }
+  for (i = 0; i < N; i += 3) {
+    hmap_int_int_ordered_erase(&map, &i);
+  }
+  for (i = 0; i < N; i += 3) {
+    unsigned int val = cast(unsigned int, i);
+    hmap_int_int_ordered_insert(&map, &i, &val);
+    order[len++] = i;
+  }
+
+  struct hmap_int_int_ordered_iter iter = hmap_int_int_ordered_iter(&map);
+  int count = 0;
+  while (hmap_int_int_ordered_iter_next(&iter)) {
+    int key = *hmap_int_int_ordered_iter_key(&iter);
+    if (count >= len || key != order[count]
+	|| *hmap_int_int_ordered_iter_val(&iter) != cast(unsigned int, key)) {
+      tassertf("order", false, "Key %d at %d", key, count);
+    }
+    ++count;
+  }
+  tassert_eqf("order count", count, len, "%d", count);
+
+  free(order);
+  hmap_int_int_ordered_destroy(&map);
+  return true;
+}
+
+#define HMAP_NAME hmap_int_int_region
+#define HMAP_KEY_TYPE int
+#define HMAP_VAL_TYPE unsigned int
+#define HMAP_SWISS
+#define HMAP_REGION
+#include "hmap.h"
+
+TEST_DECL(test_int_int_region, r) {
+  static const int N = 20000;
+  struct hmap_int_int_region map = hmap_int_int_region_new_in(r);
+  size_t before = r_stats(r).requested;
+  int i;
+
+  range_foreach(i, 0, N) {
+    unsigned int val = cast(unsigned int, i) * 3;
+    hmap_int_int_region_insert(&map, &i, &val);
+  }
+  range_foreach(i, 0, N) {
+    unsigned int* val = hmap_int_int_region_get(&map, &i);
+    if (val == NULL || *val != cast(unsigned int, i) * 3) {
+      tassertf("get", false, "Key %d", i);
+    }
+  }
+  tassertf("r_stats", r_stats(r).requested > before + cast(size_t, N) * 8,
+	   "Region grew by %lu", r_stats(r).requested - before);
+
+  // Left for the region to free.
+  return true;
+}
+
+static bool count_entry(const int* key, unsigned int* val, void* arg) {
+  size_t* count = arg;
+  *count += (*val == cast(unsigned int, *key) * 3);
+  return false;
+}
+
+TEST_DECL(test_incremental_migration, r) {
+  IGNORE(r);
+  struct hmap_int_int_incremental map = hmap_int_int_incremental_new();
+  unsigned int val;
+  size_t count;
+  int i = 0;
+
+  // Fill until a growth leaves a migration half done.
+  do {
+    val = cast(unsigned int, i) * 3;
+    hmap_int_int_incremental_insert(&map, &i, &val);
+    ++i;
+  } while (i < 1000 || map.old == NULL || map.cursor == 0);
+  tassertf("migrating", map.old != NULL && map.old->num_items > 0,
+	   "No migration after %d keys", i);
+
+  int num = i;
+  count = 0;
+  hmap_int_int_incremental_foreach(&map, count_entry, &count);
+  tassert_eqf("foreach", count, cast(size_t, num), "Visited %lu of %d", count, num);
+
+  // Erasing advances the migration as well, finish it that way.
+  for (i = 0; map.old != NULL; i += 2) {
+    if (!hmap_int_int_incremental_erase(&map, &i)) {
+      tassertf("erase", false, "Key %d missing", i);
+    }
+  }
+  int erased = i;
+  range_foreach(i, 0, num) {
+    bool present = i >= erased || i % 2 == 1;
+    unsigned int* found = hmap_int_int_incremental_get(&map, &i);
+    if ((found != NULL) != present || (present && *found != cast(unsigned int, i) * 3)) {
+      tassertf("get", false, "Key %d %s", i, present ? "missing" : "present");
+    }
+  }
+
+  hmap_int_int_incremental_destroy(&map);
+  return true;
+}
+
+// Erasing most keys shrinks the map by a migration, not all at once.
+TEST_DECL(test_incremental_shrink, r) {
+  IGNORE(r);
+  static const int N = 50000, KEEP = 100;
+  struct hmap_int_int_incremental map = hmap_int_int_incremental_new();
+  int i;
+
+  range_foreach(i, 0, N) {
+    unsigned int val = cast(unsigned int, i);
+    hmap_int_int_incremental_insert(&map, &i, &val);
+  }
+  hmap_int_int_incremental_shrink_to_fit(&map);
+  struct hmap_stats full = hmap_int_int_incremental_stats(&map);
+
+  for (i = 0; i < N && map.old == NULL; ++i) {
+    hmap_int_int_incremental_erase(&map, &i);
+  }
+  int erased = i;
+  tassertf("shrinking", map.old != NULL && map.slot_bound < map.old->slot_bound
+	   && map.old->num_items > 0, "No migration after erasing %d keys", erased);
+
+  range_foreach(i, 0, N) {
+    unsigned int* found = hmap_int_int_incremental_get(&map, &i);
+    if ((found != NULL) != (i >= erased)
+	|| (found != NULL && *found != cast(unsigned int, i))) {
+      tassertf("get migrating", false, "Key %d", i);
+    }
+  }
+
+  // Shrinks again as keys go, each time once the last migration is done.
+  range_foreach(i, erased, N - KEEP) {
+    hmap_int_int_incremental_erase(&map, &i);
+  }
+  erased = N - KEEP;
+  for (i = -1; map.old != NULL;) {
+    unsigned int val = 0;
+    hmap_int_int_incremental_insert(&map, &i, &val);
+    hmap_int_int_incremental_erase(&map, &i);
+  }
+  struct hmap_stats stats = hmap_int_int_incremental_stats(&map);
+  tassert_eqf("stats items", stats.num_items, cast(size_t, KEEP), "%lu",
+	      stats.num_items);
+  tassertf("shrunk", stats.num_slots * 16 < full.num_slots, "%lu slots of %lu",
+	   stats.num_slots, full.num_slots);
+  range_foreach(i, 0, N) {
+    unsigned int* found = hmap_int_int_incremental_get(&map, &i);
+    if ((found != NULL) != (i >= erased)
+	|| (found != NULL && *found != cast(unsigned int, i))) {
+      tassertf("get", false, "Key %d", i);
+    }
+  }
+
+  hmap_int_int_incremental_destroy(&map);
+  return true;
+}
+
+// Batches shorter and longer than the keys hashed ahead, each key twice in a
+// row: the first value is kept and only counted once.
+TEST_DECL(test_batch_lengths, r) {
+  static const size_t lens[] = { 0, 1, 15, 16, 17, 33, 5000 };
+  const size_t* len;
+
+  array_foreach(len, array_len(lens), lens) {
+    int* keys = r_malloc_aligned(r, (*len + 2) * sizeof(int), alignof(int));
+    unsigned int* vals = r_malloc_aligned(r, *len * sizeof(unsigned int),
+					  alignof(unsigned int));
+    unsigned int** out = r_malloc_aligned(r, (*len + 2) * sizeof(unsigned int*),
+					  alignof(unsigned int*));
+    struct hmap_int_int map = hmap_int_int_new();
+    size_t index;
+
+    range_foreach(index, 0, *len) {
+      keys[index] = cast(int, index / 2);
+      vals[index] = cast(unsigned int, index);
+    }
+    size_t added = hmap_int_int_insert_batch(&map, *len, keys, vals);
+    tassertf("insert_batch", added == (*len + 1) / 2 && map.num_items == added,
+	     "Added %lu of %lu", added, *len);
+
+    // Every key once and a miss on either side.
+    range_foreach(index, 0, added + 2) {
+      keys[index] = cast(int, index) - 1;
+    }
+    hmap_int_int_get_batch(&map, added + 2, keys, out);
+    range_foreach(index, 0, added + 2) {
+      bool present = index >= 1 && index <= added;
+      if (out[index] != hmap_int_int_get(&map, &keys[index])
+	  || (out[index] != NULL) != present
+	  || (present && *out[index] != 2 * cast(unsigned int, keys[index]))) {
+	tassertf("get_batch", false, "Key %d of %lu", keys[index], *len);
+      }
+    }
+    hmap_int_int_destroy(&map);
+  }
+  return true;
+}
+
+// Batches find keys in the part of the old table not migrated yet.
+TEST_DECL(test_batch_migrating, r) {
+  static const int N = 5000;
+  int* keys = r_malloc_aligned(r, 2 * cast(size_t, N) * sizeof(int), alignof(int));
+  unsigned int* vals = r_malloc_aligned(r, 2 * cast(size_t, N) * sizeof(unsigned int),
+					alignof(unsigned int));
+  unsigned int** out = r_malloc_aligned(r, 2 * cast(size_t, N) * sizeof(unsigned int*),
+					alignof(unsigned int*));
+  struct hmap_int_int_incremental map = hmap_int_int_incremental_new();
+  int i = 0;
+
+  do {
+    unsigned int val = cast(unsigned int, i) * 3;
+    hmap_int_int_incremental_insert(&map, &i, &val);
+    ++i;
+  } while (i < N || map.old == NULL || map.cursor == 0);
+  int num = i;
+
+  range_foreach(i, 0, 2 * N) {
+    keys[i] = num - N + i;
+  }
+  hmap_int_int_incremental_get_batch(&map, 2 * cast(size_t, N), keys, out);
+  tassertf("migrating", map.old != NULL, "No migration left");
+  range_foreach(i, 0, 2 * N) {
+    if ((out[i] != NULL) != (keys[i] < num)
+	|| (out[i] != NULL && *out[i] != cast(unsigned int, keys[i]) * 3)) {
+      tassertf("get_batch", false, "Key %d", keys[i]);
+    }
+  }
+
+  // Keys still in the old table are present, not added again.
+  range_foreach(i, 0, 2 * N) {
+    vals[i] = 0;
+  }
+  size_t added = hmap_int_int_incremental_insert_batch(&map, 2 * cast(size_t, N),
+						       keys, vals);
+  tassert_eqf("insert_batch", added, cast(size_t, N), "Added %lu", added);
+  range_foreach(i, 0, num + N) {
+    unsigned int* found = hmap_int_int_incremental_get(&map, &i);
+    if (found == NULL || *found != ((i < num) ? cast(unsigned int, i) * 3 : 0)) {
+      tassertf("get", false, "Key %d", i);
+    }
+  }
+
+  hmap_int_int_incremental_destroy(&map);
+  return true;
+}
+
+static size_t counted_hash_calls = 0;
+
+static size_t counted_hash(const int* key) {
+  ++counted_hash_calls;
+  return hmap_int_int_hash(key);
+}
+
+// Keeps whole hashes, so only callers hash keys.
+#define HMAP_NAME hmap_int_int_counted
+#define HMAP_KEY_TYPE int
+#define HMAP_VAL_TYPE unsigned int
+#define HMAP_HASH_FUN counted_hash
+#include "hmap.h"
+
+// Calls given the hash never hash the key again, across growth as well.
+TEST_DECL(test_with_hash, r) {
+  IGNORE(r);
+  static const int N = 5000;
+  struct hmap_int_int_counted map = hmap_int_int_counted_new();
+  size_t* hashes = sys_malloc_array(size_t, cast(size_t, N));
+  unsigned int* val;
+  bool fresh;
+  int i;
+
+  range_foreach(i, 0, N) {
+    hashes[i] = hmap_int_int_counted_hash(&i);
+  }
+  counted_hash_calls = 0;
+  range_foreach(i, 0, N) {
+    unsigned int init = cast(unsigned int, i) * 3;
+    if (i % 2 == 0) {
+      hmap_int_int_counted_insert_with_hash(&map, &i, &init, hashes[i]);
+      continue;
+    }
+    val = hmap_int_int_counted_entry_with_hash(&map, &i, hashes[i], &fresh);
+    if (!fresh) {
+      tassertf("entry_with_hash", false, "Key %d present", i);
+    }
+    *val = init;
+  }
+  range_foreach(i, 0, N) {
+    val = hmap_int_int_counted_get_with_hash(&map, &i, hashes[i]);
+    if (val == NULL || *val != cast(unsigned int, i) * 3) {
+      tassertf("get_with_hash", false, "Key %d", i);
+    }
+    if (i % 3 == 0 && !hmap_int_int_counted_erase_with_hash(&map, &i, hashes[i])) {
+      tassertf("erase_with_hash", false, "Key %d missing", i);
+    }
+  }
+  tassert_eqf("hashed", counted_hash_calls, 0lu, "%lu calls", counted_hash_calls);
+
+  range_foreach(i, 0, N) {
+    val = hmap_int_int_counted_get(&map, &i);
+    if ((val != NULL) != (i % 3 != 0)) {
+      tassertf("get", false, "Key %d", i);
+    }
+  }
+  tassert_eqf("get hashed", counted_hash_calls, cast(size_t, N), "%lu calls",
+	      counted_hash_calls);
+
+  free(hashes);
+  hmap_int_int_counted_destroy(&map);
+  return true;
+}
+
+// Entries of keys not migrated yet point into the old table, updates through
+// them are seen by lookups.
+TEST_DECL(test_entry_migrating, r) {
+  IGNORE(r);
+  struct hmap_int_int_incremental map = hmap_int_int_incremental_new();
+  unsigned int* val;
+  bool fresh;
+  int i = 0;
+
+  do {
+    unsigned int init = cast(unsigned int, i) * 3;
+    hmap_int_int_incremental_insert(&map, &i, &init);
+    ++i;
+  } while (i < 1000 || map.old == NULL || map.cursor == 0);
+  int num = i;
+
+  // Keys are found in either table as the entry calls migrate the rest.
+  range_foreach(i, 0, num) {
+    val = hmap_int_int_incremental_entry(&map, &i, &fresh);
+    if (fresh || *val != cast(unsigned int, i) * 3) {
+      tassertf("entry", false, "Key %d", i);
+    }
+    ++*val;
+  }
+  range_foreach(i, num, 2 * num) {
+    val = hmap_int_int_incremental_entry(&map, &i, &fresh);
+    if (!fresh) {
+      tassertf("entry fresh", false, "Key %d present", i);
+    }
+    *val = cast(unsigned int, i) * 3 + 1;
+  }
+  range_foreach(i, 0, 2 * num) {
+    val = hmap_int_int_incremental_get(&map, &i);
+    if (val == NULL || *val != cast(unsigned int, i) * 3 + 1) {
+      tassertf("get", false, "Key %d", i);
+    }
+  }
+
+  hmap_int_int_incremental_destroy(&map);
+  return true;
+}
+
+// Every entry is visited once, values are updated in place, and an iterator
+// at the end stays there.
+TEST_DECL(test_iter, r) {
+  IGNORE(r);
+  static const int N = 5000;
+  struct hmap_int_int map = hmap_int_int_new();
+  size_t count = 0, sum = 0;
+  int i;
+
+  struct hmap_int_int_iter iter = hmap_int_int_iter(&map);
+  tassertf("iter_next empty", !hmap_int_int_iter_next(&iter), "Entry in empty map");
+
+  range_foreach(i, 0, N) {
+    unsigned int val = cast(unsigned int, i) * 3;
+    hmap_int_int_insert(&map, &i, &val);
+  }
+  for (i = 0; i < N; i += 2) {
+    hmap_int_int_erase(&map, &i);
+  }
+
+  iter = hmap_int_int_iter(&map);
+  while (hmap_int_int_iter_next(&iter)) {
+    int key = *hmap_int_int_iter_key(&iter);
+    unsigned int* val = hmap_int_int_iter_val(&iter);
+    if (key % 2 == 0 || *val != cast(unsigned int, key) * 3) {
+      tassertf("iter_next", false, "Key %d", key);
+    }
+    ++*val;
+    ++count;
+    sum += cast(size_t, key);
+  }
+  tassert_eqf("iter_next count", count, cast(size_t, N) / 2, "%lu", count);
+  tassert_eqf("iter_next sum", sum, cast(size_t, N) * cast(size_t, N) / 4, "%lu", sum);
+  tassertf("iter_next end", !hmap_int_int_iter_next(&iter)
+	   && !hmap_int_int_iter_next(&iter), "Entry after end");
+
+  range_foreach(i, 0, N) {
+    unsigned int* found = hmap_int_int_get(&map, &i);
+    if ((found != NULL) != (i % 2 == 1)
+	|| (found != NULL && *found != cast(unsigned int, i) * 3 + 1)) {
+      tassertf("iter_val", false, "Key %d", i);
+    }
+  }
+
+  hmap_int_int_destroy(&map);
+  return true;
+}
+
+// Whole groups of control bytes are empty in a sparse swiss map, iterating
+// skips them and still yields entries in slot order.
+TEST_DECL(test_iter_sparse, r) {
+  IGNORE(r);
+  static const int N = 50;
+  struct hmap_int_int_swiss map = hmap_int_int_swiss_new_reserve(100000);
+  size_t count = 0, last = 0;
+  int i;
+
+  range_foreach(i, 0, N) {
+    unsigned int val = cast(unsigned int, i);
+    hmap_int_int_swiss_insert(&map, &i, &val);
+  }
+  struct hmap_int_int_swiss_iter iter = hmap_int_int_swiss_iter(&map);
+  while (hmap_int_int_swiss_iter_next(&iter)) {
+    const int* key = hmap_int_int_swiss_iter_key(&iter);
+    size_t slot = cast(size_t, cast(const struct hmap_int_int_swiss__bucket*,
+				    cast(const void*, key)) - map.buckets);
+    if ((count > 0 && slot <= last) || map.ctrl[slot] < 0
+	|| *hmap_int_int_swiss_iter_val(&iter) != cast(unsigned int, *key)) {
+      tassertf("iter_next", false, "Key %d in slot %lu", *key, slot);
+    }
+    last = slot;
+    ++count;
+  }
+  tassert_eqf("iter_next count", count, cast(size_t, N), "%lu", count);
+
+  hmap_int_int_swiss_destroy(&map);
+  return true;
+}
+
+// Iterating mid migration visits the entries left in the old table as well,
+// and not the stale copies of those already moved.
+TEST_DECL(test_iter_migrating, r) {
+  IGNORE(r);
+  struct hmap_int_int_incremental map = hmap_int_int_incremental_new();
+  size_t count = 0, sum = 0;
+  int i = 0;
+
+  do {
+    unsigned int val = cast(unsigned int, i) * 3;
+    hmap_int_int_incremental_insert(&map, &i, &val);
+    ++i;
+  } while (i < 1000 || map.old == NULL || map.cursor == 0);
+  size_t num = cast(size_t, i);
+
+  struct hmap_int_int_incremental_iter iter = hmap_int_int_incremental_iter(&map);
+  while (hmap_int_int_incremental_iter_next(&iter)) {
+    int key = *hmap_int_int_incremental_iter_key(&iter);
+    if (*hmap_int_int_incremental_iter_val(&iter) != cast(unsigned int, key) * 3) {
+      tassertf("iter_next", false, "Key %d", key);
+    }
+    ++count;
+    sum += cast(size_t, key);
+  }
+  tassertf("migrating", map.old != NULL, "No migration left");
+  tassert_eqf("iter_next count", count, num, "%lu of %lu", count, num);
+  tassert_eqf("iter_next sum", sum, num * (num - 1) / 2, "%lu", sum);
+
+  hmap_int_int_incremental_destroy(&map);
+  return true;
+}
+
+// Erasing most keys shrinks the map on the way, stats follow.
+TEST_DECL(test_shrink, r) {
+  IGNORE(r);
+  static const int N = 50000, KEEP = 100;
+  struct hmap_int_int map = hmap_int_int_new();
+  int i;
+
+  range_foreach(i, 0, N) {
+    unsigned int val = cast(unsigned int, i);
+    hmap_int_int_insert(&map, &i, &val);
+  }
+  struct hmap_stats full = hmap_int_int_stats(&map);
+  tassert_eqf("stats items", full.num_items, cast(size_t, N), "%lu", full.num_items);
+
+  range_foreach(i, KEEP, N) {
+    hmap_int_int_erase(&map, &i);
+  }
+  struct hmap_stats kept = hmap_int_int_stats(&map);
+  tassert_eqf("erase items", kept.num_items, cast(size_t, KEEP), "%lu", kept.num_items);
+  tassertf("shrink", kept.num_slots * 16 < full.num_slots, "%lu slots of %lu",
+	   kept.num_slots, full.num_slots);
+
+  hmap_int_int_shrink_to_fit(&map);
+  struct hmap_stats fit = hmap_int_int_stats(&map);
+  tassertf("shrink_to_fit", fit.num_slots <= kept.num_slots && fit.load >= kept.load,
+	   "%lu slots at %f", fit.num_slots, cast(double, fit.load));
+  size_t counted = 0;
+  const size_t* dist;
+  array_foreach(dist, HMAP_STATS_DISTS, fit.dists) {
+    counted += *dist;
+  }
+  tassert_eqf("stats dists", counted, fit.num_items, "%lu", counted);
+  tassertf("stats max_dist", fit.max_dist < HMAP_STATS_DISTS
+	   || fit.dists[HMAP_STATS_DISTS - 1] > 0, "%lu", fit.max_dist);
+  tassert_eqf("stats bytes", fit.bytes,
+	      fit.num_slots * sizeof(struct hmap_int_int__bucket), "%lu", fit.bytes);
+
+  range_foreach(i, 0, N) {
+    unsigned int* found = hmap_int_int_get(&map, &i);
+    if ((found != NULL) != (i < KEEP)
+	|| (found != NULL && *found != cast(unsigned int, i))) {
+      tassertf("get", false, "Key %d", i);
+    }
+  }
+
+  hmap_int_int_destroy(&map);
+  return true;
+}
+
+// The other engines shrink on erase too, from the same load.
+TEST_DECL(test_shrink_engines, r) {
+  IGNORE(r);
+  static const int N = 50000, KEEP = 100;
+  struct hmap_int_int_swiss swiss = hmap_int_int_swiss_new();
+  struct hmap_int_int_ordered ordered = hmap_int_int_ordered_new();
+  int i;
+
+  range_foreach(i, 0, N) {
+    unsigned int val = cast(unsigned int, i);
+    hmap_int_int_swiss_insert(&swiss, &i, &val);
+    hmap_int_int_ordered_insert(&ordered, &i, &val);
+  }
+  size_t swiss_slots = swiss.mask + 1, ordered_slots = ordered.mask + 1;
+  range_foreach(i, KEEP, N) {
+    hmap_int_int_swiss_erase(&swiss, &i);
+    hmap_int_int_ordered_erase(&ordered, &i);
+  }
+  tassertf("swiss", (swiss.mask + 1) * 16 < swiss_slots
+	   && swiss.growth_left + swiss.num_items
+	   <= hmap_int_int_swiss__growth_for(swiss.mask + 1),
+	   "%lu slots of %lu", swiss.mask + 1, swiss_slots);
+  tassertf("ordered", (ordered.mask + 1) * 16 < ordered_slots
+	   && ordered.len <= ordered.cap,
+	   "%lu slots of %lu", ordered.mask + 1, ordered_slots);
+
+  // Survivors keep their order.
+  struct hmap_int_int_ordered_iter iter = hmap_int_int_ordered_iter(&ordered);
+  for (i = 0; hmap_int_int_ordered_iter_next(&iter); ++i) {
+    if (*hmap_int_int_ordered_iter_key(&iter) != i
+	|| hmap_int_int_swiss_get(&swiss, &i) == NULL) {
+      tassertf("get", false, "Key %d", i);
+    }
+  }
+  tassert_eqf("count", i, KEEP, "%d", i);
+
+  hmap_int_int_swiss_destroy(&swiss);
+  hmap_int_int_ordered_destroy(&ordered);
+  return true;
+}
+
+#define HMAP_NAME hmap_int_int_lf50
+#define HMAP_KEY_TYPE int
+#define HMAP_VAL_TYPE unsigned int
+#define HMAP_LOAD_FACTOR 0.5f
+#include "hmap.h"
+
+// Half the slots at most are used, whether growing, shrinking on erase, or
+// shrinking to fit.
+TEST_DECL(test_shrink_load_factor, r) {
+  IGNORE(r);
+  static const int N = 50000, KEEP = 100;
+  struct hmap_int_int_lf50 map = hmap_int_int_lf50_new();
+  struct hmap_stats stats;
+  uint8_t slot_bound = map.slot_bound;
+  size_t resizes = 0;
+  int i;
+
+  range_foreach(i, 0, N) {
+    unsigned int val = cast(unsigned int, i);
+    hmap_int_int_lf50_insert(&map, &i, &val);
+    if (map.slot_bound != slot_bound) {
+      slot_bound = map.slot_bound;
+      stats = hmap_int_int_lf50_stats(&map);
+      ++resizes;
+      if (stats.load > 0.5f) {
+	tassertf("grow", false, "%lu items in %lu slots", stats.num_items,
+		 stats.num_slots);
+      }
+    }
+  }
+  range_foreach(i, KEEP, N) {
+    hmap_int_int_lf50_erase(&map, &i);
+    if (map.slot_bound != slot_bound) {
+      slot_bound = map.slot_bound;
+      stats = hmap_int_int_lf50_stats(&map);
+      ++resizes;
+      if (stats.load > 0.5f || stats.load < 0.5f / 8) {
+	tassertf("shrink", false, "%lu items in %lu slots", stats.num_items,
+		 stats.num_slots);
+      }
+    }
+  }
+  tassertf("resizes", resizes > 20, "%lu", resizes);
+
+  hmap_int_int_lf50_shrink_to_fit(&map);
+  stats = hmap_int_int_lf50_stats(&map);
+  tassertf("shrink_to_fit", stats.load <= 0.5f && stats.load > 0.25f,
+	   "%lu items in %lu slots", stats.num_items, stats.num_slots);
+  range_foreach(i, 0, N) {
+    unsigned int* found = hmap_int_int_lf50_get(&map, &i);
+    if ((found != NULL) != (i < KEEP)
+	|| (found != NULL && *found != cast(unsigned int, i))) {
+      tassertf("get", false, "Key %d", i);
+    }
+  }
+
+  hmap_int_int_lf50_destroy(&map);
+  return true;
+}
+
+// Fills every slot the load factor allows, all but one.
+#define HMAP_NAME hmap_int_int_swiss_full
+#define HMAP_KEY_TYPE int
+#define HMAP_VAL_TYPE unsigned int
+#define HMAP_SWISS
+#define HMAP_LOAD_FACTOR 1.0f
+#include "hmap.h"
+
+TEST_DECL(test_swiss_full_shrink, r) {
+  IGNORE(r);
+  struct hmap_int_int_swiss_full map = hmap_int_int_swiss_full_new();
+  int i;
+
+  range_foreach(i, 0, 64) {
+    unsigned int val = cast(unsigned int, i);
+    hmap_int_int_swiss_full_insert(&map, &i, &val);
+  }
+  range_foreach(i, 0, 48) {
+    hmap_int_int_swiss_full_erase(&map, &i);
+  }
+  hmap_int_int_swiss_full_shrink_to_fit(&map);
+  tassertf("shrink_to_fit", map.num_items < map.mask + 1
+	   && map.growth_left < map.mask + 1 - map.num_items,
+	   "%lu items in %lu slots, %lu to grow", map.num_items, map.mask + 1,
+	   map.growth_left);
+
+  i = 100;
+  tassertf("get absent", hmap_int_int_swiss_full_get(&map, &i) == NULL, "Key %d", i);
+  range_foreach(i, 48, 200) {
+    unsigned int val = cast(unsigned int, i);
+    hmap_int_int_swiss_full_insert(&map, &i, &val);
+  }
+  range_foreach(i, 0, 200) {
+    unsigned int* found = hmap_int_int_swiss_full_get(&map, &i);
+    if ((found != NULL) != (i >= 48)) {
+      tassertf("get", false, "Key %d", i);
+    }
+  }
+
+  hmap_int_int_swiss_full_destroy(&map);
+  return true;
+}
+
+#define HMAP_NAME hmap_int_int_file
+#define HMAP_KEY_TYPE int
+#define HMAP_VAL_TYPE unsigned int
+#define HMAP_FILE
+#include "hmap.h"
+
+#define HMAP_NAME hmap_int_int_soa_file
+#define HMAP_KEY_TYPE int
+#define HMAP_VAL_TYPE unsigned int
+#define HMAP_SOA
+#define HMAP_INCREMENTAL
+#define HMAP_FILE
+#include "hmap.h"
+
+static void hmap_file_path(char* path, size_t len, const char* name) {
+  snprintf(path, len, "/tmp/kc_hmap_%s_%d", name, getpid());
+}
+
+// The loaded map points at the saved arrays in the mapped file, aligned as
+// they were in memory, and is looked up and iterated in place.
+TEST_DECL(test_file, r) {
+  static const int N = 30000;
+  char path[64];
+  hmap_file_path(path, sizeof(path), "file");
+  struct hmap_int_int_file map = hmap_int_int_file_new();
+  size_t count = 0;
+  int i;
+
+  range_foreach(i, 0, N) {
+    unsigned int val = cast(unsigned int, i) * 3;
+    hmap_int_int_file_insert(&map, &i, &val);
+  }
+  struct file_error err = hmap_int_int_file_save(&map, path);
+  tassert_error_no("save", &err, file_error_print);
+  struct hmap_stats saved = hmap_int_int_file_stats(&map);
+
+  struct hmap_int_int_file loaded;
+  err = hmap_int_int_file_load(r, path, &loaded);
+  unlink(path);
+  tassert_error_no("load", &err, file_error_print);
+  struct hmap_stats stats = hmap_int_int_file_stats(&loaded);
+  tassertf("load stats", stats.num_items == saved.num_items
+	   && stats.num_slots == saved.num_slots && stats.max_dist == saved.max_dist,
+	   "%lu items in %lu slots", stats.num_items, stats.num_slots);
+  const void* buckets = parray_raw(&loaded.buckets);
+  tassertf("load arrays", cast(uintptr_t, buckets) % __HMAP_FILE_ALIGN == 0
+	   && memcmp(buckets, parray_raw(&map.buckets), saved.bytes) == 0,
+	   "Buckets at %p", buckets);
+  hmap_int_int_file_destroy(&map);
+
+  range_foreach(i, -N, 2 * N) {
+    const unsigned int* found = hmap_int_int_file_get(&loaded, &i);
+    bool present = i >= 0 && i < N;
+    if ((found != NULL) != present || (present && *found != cast(unsigned int, i) * 3)) {
+      tassertf("get", false, "Key %d %s", i, present ? "missing" : "present");
+    }
+  }
+  struct hmap_int_int_file_iter iter = hmap_int_int_file_iter(&loaded);
+  while (hmap_int_int_file_iter_next(&iter)) {
+    ++count;
+  }
+  tassert_eqf("iter", count, cast(size_t, N), "%lu", count);
+
+  // The mapping is left for the region to free.
+  return true;
+}
+
+// Saving finishes a migration first, so the image holds one table, with the
+// meta and entry arrays each starting on a cache line.
+TEST_DECL(test_file_migrating, r) {
+  char path[64];
+  hmap_file_path(path, sizeof(path), "migrating");
+  struct hmap_int_int_soa_file map = hmap_int_int_soa_file_new();
+  int i = 0;
+
+  do {
+    unsigned int val = cast(unsigned int, i) * 3;
+    hmap_int_int_soa_file_insert(&map, &i, &val);
+    ++i;
+  } while (i < 1000 || map.old == NULL || map.cursor == 0);
+  int num = i;
+
+  struct file_error err = hmap_int_int_soa_file_save(&map, path);
+  tassert_error_no("save", &err, file_error_print);
+  tassertf("save migrated", map.old == NULL, "Still migrating");
+  hmap_int_int_soa_file_destroy(&map);
+
+  struct hmap_int_int_soa_file loaded;
+  err = hmap_int_int_soa_file_load(r, path, &loaded);
+  unlink(path);
+  tassert_error_no("load", &err, file_error_print);
+  tassertf("load arrays", loaded.old == NULL && loaded.num_items == cast(size_t, num)
+	   && cast(uintptr_t, loaded.meta) % __HMAP_FILE_ALIGN == 0
+	   && cast(uintptr_t, loaded.buckets) % __HMAP_FILE_ALIGN == 0,
+	   "%lu items, meta at %p, buckets at %p", loaded.num_items,
+	   cast(void*, loaded.meta), cast(void*, loaded.buckets));
+  range_foreach(i, -num, 2 * num) {
+    const unsigned int* found = hmap_int_int_soa_file_get(&loaded, &i);
+    bool present = i >= 0 && i < num;
+    if ((found != NULL) != present || (present && *found != cast(unsigned int, i) * 3)) {
+      tassertf("get", false, "Key %d %s", i, present ? "missing" : "present");
+    }
+  }
+  return true;
+}
+
+TEST_DECL(test_file_errors, r) {
+  char path[64];
+  hmap_file_path(path, sizeof(path), "errors");
+  struct hmap_int_int_file map = hmap_int_int_file_new();
+  struct hmap_int_int_soa_file other;
+
+  struct file_error err = hmap_int_int_file_load(r, path, &map);
+  tassertf("load missing", err.tag == FILE_ERROR_IO && err.sys_errno != 0,
+	   "%d", err.tag);
+
+  err = hmap_int_int_file_save(&map, path);
+  tassert_error_no("save", &err, file_error_print);
+  err = hmap_int_int_soa_file_load(r, path, &other);
+  tassert_eqf("load other type", err.tag, FILE_ERROR_FORMAT, "%d", err.tag);
+  tassertf("truncate", truncate(path, 100) == 0, "Can't truncate %s", path);
+  err = hmap_int_int_file_load(r, path, &map);
+  unlink(path);
+  tassert_eqf("load truncated", err.tag, FILE_ERROR_FORMAT, "%d", err.tag);
+
+  hmap_int_int_file_destroy(&map);
+  return true;
+}
+
+// Value which a torn read would leave inconsistent.
+struct conc_val {
+  size_t key;
+  size_t check;
+};
+
+#define CONC_CHECK(KEY, GEN) (~(KEY) * 0x9e3779b97f4a7c15lu + (GEN))
+
+#define HMAP_NAME hmap_conc
+#define HMAP_KEY_TYPE size_t
+#define HMAP_VAL_TYPE struct conc_val
+#define HMAP_CONCURRENT
+#include "hmap.h"
+
+struct conc_reader_arg {
+  struct hmap_conc* map;
+  size_t stable;
+  atomic_bool* stop;
+  size_t missing;
+  size_t torn;
+  size_t reads;
+};
+
+// Look up the stable keys, which are never erased, and the churned keys after
+// them, which come and go with a new value each time.
+static void* conc_reader(void* arg_) {
+  struct conc_reader_arg* arg = arg_;
+  size_t key = 0;
+  while (!atomic_load_explicit(arg->stop, memory_order_relaxed)) {
+    struct conc_val val;
+    bool found = hmap_conc_get_copy(arg->map, &key, &val);
+    arg->missing += !found && key < arg->stable;
+    arg->torn += found && (val.key != key || (val.check - CONC_CHECK(key, 0)) > 1000);
+    ++arg->reads;
+    key = (key + 1) % (2 * arg->stable);
+  }
+  return NULL;
+}
+
+TEST_DECL(test_concurrent, r) {
+  IGNORE(r);
+  static const size_t STABLE = 2000, THREADS = 2;
+  struct hmap_conc map = hmap_conc_new();
+  struct conc_val val;
+  size_t i, gen;
+
+  range_foreach(i, 0, STABLE) {
+    val = new(struct conc_val, .key = i, .check = CONC_CHECK(i, 0));
+    if (!hmap_conc_insert(&map, &i, &val)) {
+      tassertf("insert", false, "Key %lu present", i);
+    }
+  }
+  i = 0;
+  tassertf("insert again", !hmap_conc_insert(&map, &i, &val), "Key %lu added twice", i);
+  tassertf("get_copy", hmap_conc_get_copy(&map, &i, &val) && val.check == CONC_CHECK(i, 0),
+	   "Key %lu", i);
+
+  atomic_bool stop = false;
+  pthread_t threads[THREADS];
+  struct conc_reader_arg args[THREADS];
+  range_foreach(i, 0, THREADS) {
+    args[i] = new(struct conc_reader_arg, .map = &map, .stable = STABLE, .stop = &stop);
+    pthread_create(&threads[i], NULL, conc_reader, &args[i]);
+  }
+
+  // Churn the keys after the stable ones while the table keeps growing.
+  range_foreach(gen, 1, 1000) {
+    range_foreach(i, STABLE, 2 * STABLE) {
+      hmap_conc_erase(&map, &i);
+      val = new(struct conc_val, .key = i, .check = CONC_CHECK(i, gen));
+      hmap_conc_insert(&map, &i, &val);
+    }
+    size_t grow = gen * 100 + 2 * STABLE;
+    range_foreach(i, grow, grow + 100) {
+      val = new(struct conc_val, .key = i, .check = CONC_CHECK(i, 0));
+      hmap_conc_insert(&map, &i, &val);
+    }
+  }
+
+  atomic_store(&stop, true);
+  range_foreach(i, 0, THREADS) {
+    pthread_join(threads[i], NULL);
+    tassert_eqf("get_copy stable", args[i].missing, 0lu,
+		"Thread %lu missed %lu of %lu reads", i, args[i].missing, args[i].reads);
+    tassert_eqf("get_copy torn", args[i].torn, 0lu,
+		"Thread %lu tore %lu of %lu reads", i, args[i].torn, args[i].reads);
+  }
+
+  hmap_conc_reclaim(&map);
+  i = STABLE;
+  tassertf("extract", hmap_conc_extract(&map, &i, &val) && val.check == CONC_CHECK(i, 999),
+	   "Key %lu", i);
+  tassertf("erase", !hmap_conc_erase(&map, &i) && !hmap_conc_get_copy(&map, &i, &val),
+	   "Key %lu still present", i);
+  range_foreach(i, 0, STABLE) {
+    if (!hmap_conc_get_copy(&map, &i, &val) || val.check != CONC_CHECK(i, 0)) {
+      tassertf("get_copy after", false, "Key %lu", i);
+    }
+  }
+
+  hmap_conc_destroy(&map);
+  return true;
+}
+
+#define CONC_SEGMENTS 64lu
+
+// Arrays retired by MAP and not freed yet.
+static size_t conc_retired(const struct hmap_conc* map) {
+  size_t count = 0;
+  struct hmap_conc__array* const* arrays;
+  array_foreach(arrays, 2lu, map->retired->arrays) {
+    for (const struct hmap_conc__array* slots = *arrays; slots != NULL;
+	 slots = slots->retired) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+// Insert the keys [FROM, TO), past the keys readers look up, returning how
+// many arrays were replaced meanwhile.
+static size_t conc_add(struct hmap_conc* map, size_t from, size_t to) {
+  struct hmap_conc__array* slots[CONC_SEGMENTS];
+  size_t key, seg, replaced = 0;
+  range_foreach(seg, 0, CONC_SEGMENTS) {
+    slots[seg] = atomic_load(&map->segments[seg].slots);
+  }
+  range_foreach(key, from, to) {
+    struct conc_val val = new(struct conc_val, .key = key, .check = CONC_CHECK(key, 0));
+    hmap_conc_insert(map, &key, &val);
+  }
+  range_foreach(seg, 0, CONC_SEGMENTS) {
+    replaced += slots[seg] != atomic_load(&map->segments[seg].slots);
+  }
+  return replaced;
+}
+
+// Growing retires an array each time, writers free them as lookups come and
+// go without HMAP(reclaim).
+TEST_DECL(test_concurrent_retire, r) {
+  IGNORE(r);
+  static const size_t STABLE = 2000, THREADS = 2, BATCH = 1000, BATCHES = 1000;
+  struct hmap_conc map = hmap_conc_new();
+  size_t i, from = 2 * STABLE, replaced = 0, peak = 0;
+
+  range_foreach(i, 0, from) {
+    struct conc_val val = new(struct conc_val, .key = i, .check = CONC_CHECK(i, 0));
+    hmap_conc_insert(&map, &i, &val);
+  }
+
+  atomic_bool stop = false;
+  pthread_t threads[THREADS];
+  struct conc_reader_arg args[THREADS];
+  range_foreach(i, 0, THREADS) {
+    args[i] = new(struct conc_reader_arg, .map = &map, .stable = STABLE, .stop = &stop);
+    pthread_create(&threads[i], NULL, conc_reader, &args[i]);
+  }
+  range_foreach(i, 0, BATCHES) {
+    replaced += conc_add(&map, from, from + BATCH);
+    from += BATCH;
+    peak = max(peak, conc_retired(&map));
+  }
+  atomic_store(&stop, true);
+  range_foreach(i, 0, THREADS) {
+    pthread_join(threads[i], NULL);
+    tassert_eqf("get_copy stable", args[i].missing, 0lu,
+		"Thread %lu missed %lu of %lu reads", i, args[i].missing, args[i].reads);
+  }
+  tassertf("retired", replaced >= 4 * CONC_SEGMENTS && peak < replaced,
+	   "%lu arrays replaced, up to %lu retired at once", replaced, peak);
+
+  // With no lookups running, the next arrays retired free all older ones.
+  hmap_conc_reserve(&map, 2 * from);
+  tassertf("retired after", conc_retired(&map) <= 2, "%lu arrays left",
+	   conc_retired(&map));
+
+  hmap_conc_destroy(&map);
+  return true;
+}
+
 static inline size_t shift_str_hash(const string_t* ptr) {
   return ((size_t) string_raw(*ptr)) >> 4;
 }
@@ -115,4 +1726,35 @@ TEST_DECL(test_string_set, r) {
 
 TEST_SUITE_DECL(hmap_test,
   test_add(test_int_int),
+  test_add(test_int_int_churn),
+  test_add(test_soa_meta),
+  test_add(test_swiss_ctrl),
+  test_add(test_fastmod_home),
+  test_add(test_fastmod_place),
+  test_add(test_pow2_place),
+  test_add(test_incremental_steps),
+  test_add(test_incremental_migration),
+  test_add(test_incremental_shrink),
+  test_add(test_stored_hash_frag),
+  test_add(test_stored_hash_none),
+  test_add(test_huge_alloc),
+  test_add(test_ordered_order),
+  test_add(test_ordered_compact),
+  test_add(test_int_int_region),
+  test_add(test_batch_lengths),
+  test_add(test_batch_migrating),
+  test_add(test_iter),
+  test_add(test_iter_sparse),
+  test_add(test_iter_migrating),
+  test_add(test_with_hash),
+  test_add(test_entry_migrating),
+  test_add(test_shrink),
+  test_add(test_shrink_engines),
+  test_add(test_shrink_load_factor),
+  test_add(test_swiss_full_shrink),
+  test_add(test_file),
+  test_add(test_file_migrating),
+  test_add(test_file_errors),
+  test_add(test_concurrent),
+  test_add(test_concurrent_retire),
   test_add(test_string_set));
@@ -0,0 +1,78 @@
+#include "test.h"
+
+#include "list.h"
+#include "pool.h"
+
+struct pool_node {
+  size_t entry;
+  SLIST_ENTRY(struct pool_node) slist;
+};
+
+SLIST_DECL(pool_node_list, struct pool_node);
+POOL_DECL(pool_node_pool, struct pool_node);
+
+TEST_DECL(test_pool_churn, r) {
+  static const size_t MAX = 10000;
+  struct pool_node_pool pool = pool_new(r, struct pool_node_pool);
+  struct pool_node_list list;
+  slist_init(&list);
+
+  size_t i;
+  range_foreach(i, 0, MAX) {
+    struct pool_node* node = pool_alloc(&pool);
+    node->entry = i;
+    slist_insert(&list, node, slist);
+  }
+  tassert_eqf("pool_alloc", pool_len(&pool), MAX, "%lu live", pool_len(&pool));
+
+  // Freeing and reallocating recycles the same slots without growing.
+  char* high_water = pool.base.cursor;
+  range_foreach(i, 0, 50) {
+    struct pool_node* node;
+    while (!slist_is_empty(&list)) {
+      slist_pop(&list, node, slist);
+      pool_free(&pool, node);
+    }
+    tassert_eqf("pool_free", pool_len(&pool), 0lu, "%lu live", pool_len(&pool));
+
+    size_t j;
+    range_foreach(j, 0, MAX) {
+      node = pool_alloc(&pool);
+      node->entry = j;
+      slist_insert(&list, node, slist);
+    }
+  }
+  tassert_eqf("pool reuse", pool.base.cursor, high_water, "Pool kept growing");
+
+  i = MAX - 1;
+  struct pool_node* curr;
+  slist_foreach(curr, &list, slist) {
+    if (curr->entry != i) {
+      tassert_eqf("pool corruption", i, curr->entry, "%lu vs. %lu", i, curr->entry);
+    }
+    --i;
+  }
+  tcheckpoint("pool corruption");
+
+  return true;
+}
+
+TEST_DECL(test_pool_small, r) {
+  pool_t(char) pool = pool_new(r, typeof(pool));
+  char* first = pool_alloc(&pool);
+  char* second = pool_alloc(&pool);
+  *first = 'a';
+  *second = 'b';
+  tassertf("pool small slots", second - first >= (ptrdiff_t) sizeof(void*),
+	   "Slots %p and %p overlap", (void*) first, (void*) second);
+
+  pool_free(&pool, first);
+  tassert_eqf("pool_free recycles", pool_alloc(&pool), first,
+	      "Freed slot not reused");
+
+  return true;
+}
+
+TEST_SUITE_DECL(pool_test,
+  test_add(test_pool_churn),
+  test_add(test_pool_small));
@@ -3,6 +3,9 @@
 #include "list.h"
 #include "region.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
+
 struct size_node {
   size_t entry;
   SLIST_ENTRY(struct size_node) slist;
@@ -50,6 +53,401 @@ TEST_DECL(test_regions, r) {
   return true;
 }
 
+TEST_DECL(test_region_sizes, r) {
+  static const size_t SIZES[] = { 1, 3, 16, 200, 600, 1500, 5000, 70000 };
+  static const size_t COUNT = 2000;
+  pointer(char) ptrs[COUNT];
+
+  size_t i;
+  range_foreach(i, 0, COUNT) {
+    size_t len = SIZES[i % array_len(SIZES)];
+    ptrs[i] = r_malloc_bytes(r, len);
+    memset(ptrs[i], (int)(i & 0x7f), len);
+  }
+
+  range_foreach(i, 0, COUNT) {
+    size_t len = SIZES[i % array_len(SIZES)];
+    if (ptrs[i][0] != (char)(i & 0x7f) || ptrs[i][len - 1] != (char)(i & 0x7f)) {
+      tassertf("mixed sizes", false, "Allocation %lu of %lu bytes clobbered",
+	       i, len);
+    }
+  }
+  tcheckpoint("mixed sizes");
+
+  return true;
+}
+
+TEST_DECL(test_region_alignment, r) {
+  struct wide { long double x; };
+
+  size_t i;
+  range_foreach(i, 0, 1000) {
+    char* pad = r_malloc_bytes(r, 3);
+    pad[0] = 'x';
+    struct wide* w = r_malloc(r, struct wide);
+    if (cast(uintptr_t, w) % alignof(struct wide) != 0) {
+      tassertf("r_malloc aligned", false, "%p not aligned", (void*) w);
+    }
+
+    size_t align = 1lu << (i % 8);
+    char* bytes = r_malloc_aligned(r, (i * 37) % 9000, align);
+    if (cast(uintptr_t, bytes) % align != 0) {
+      tassertf("r_malloc_aligned", false, "%p not aligned to %lu",
+	       (void*) bytes, align);
+    }
+  }
+  tcheckpoint("r_malloc aligned");
+  tcheckpoint("r_malloc_aligned");
+
+  return true;
+}
+
+static void count_destructor(void* counter) {
+  ++**cast(pointer(size_t*), counter);
+}
+
+TEST_DECL(test_region_rewind, r) {
+  size_t destroyed = 0;
+  size_t i, j;
+
+  struct r_mark start = r_mark(r);
+  size_t* first = r_malloc(r, size_t);
+
+  range_foreach(i, 0, 3) {
+    struct r_mark mark = r_mark(r);
+    size_t* again = r_malloc(r, size_t);
+    range_foreach(j, 0, 10000) {
+      char* bytes = r_malloc_bytes(r, 1 + j % 700);
+      bytes[0] = 'x';
+    }
+    *r_new_struct(r, count_destructor, size_t*) = &destroyed;
+    region_t sub = r_create_subregion(r, 7);
+    *r_new_struct(sub, count_destructor, size_t*) = &destroyed;
+    r_rewind(r, mark);
+
+    tassert_eqf("r_rewind reuses", again, r_malloc(r, size_t),
+		"Rewound allocation moved");
+    r_rewind(r, mark);
+  }
+  tassert_eqf("r_rewind destroys", destroyed, 6lu, "%lu destroyed", destroyed);
+
+  r_rewind(r, start);
+  tassert_eqf("r_rewind start", first, r_malloc(r, size_t),
+	      "Rewound allocation moved");
+
+  *r_new_struct(r, count_destructor, size_t*) = &destroyed;
+  r_reset(r);
+  tassert_eqf("r_reset destroys", destroyed, 7lu, "%lu destroyed", destroyed);
+  tassert_eqf("r_reset reuses", first, r_malloc(r, size_t),
+	      "Reset allocation moved");
+
+  return true;
+}
+
+TEST_DECL(test_region_cache, r) {
+  IGNORE(r);
+  size_t i;
+
+  region_t temp = r_create();
+  range_foreach(i, 0, 1000) {
+    r_malloc(temp, struct size_node)->entry = i;
+  }
+  size_t before = r_cache_bytes();
+  r_destroy(temp);
+  size_t cached = r_cache_bytes();
+  tassertf("r_destroy caches", cached > before, "%lu vs. %lu", cached, before);
+
+  temp = r_create();
+  tassert_eqf("r_create reuses", r_cache_bytes(), cached - REGION_BLOCK_SIZE,
+	      "Cache holds %lu", r_cache_bytes());
+  r_destroy(temp);
+
+  r_cache_trim(0);
+  tassert_eqf("r_cache_trim", r_cache_bytes(), 0lu,
+	      "Cache holds %lu", r_cache_bytes());
+
+  r_cache_set_limit(0);
+  r_destroy(r_create());
+  tassert_eqf("r_cache_set_limit", r_cache_bytes(), 0lu,
+	      "Cache holds %lu", r_cache_bytes());
+  r_cache_set_limit(REGION_CACHE_MAX_BYTES);
+
+  return true;
+}
+
+struct thread_local_arg {
+  region_t parent;
+  region_t child;
+  atomic_size_t* destroyed;
+  bool stable;
+};
+
+static void count_atomic_destructor(void* counter) {
+  atomic_fetch_add(*cast(pointer(atomic_size_t*), counter), 1);
+}
+
+static void* thread_local_worker(void* arg_) {
+  struct thread_local_arg* arg = arg_;
+  arg->child = r_thread_local(arg->parent);
+  arg->stable = true;
+
+  size_t i;
+  range_foreach(i, 0, 10000) {
+    region_t child = r_thread_local(arg->parent);
+    arg->stable = arg->stable && child == arg->child;
+    r_malloc(child, struct size_node)->entry = i;
+  }
+  *r_new_struct(arg->child, count_atomic_destructor, atomic_size_t*) =
+    arg->destroyed;
+  return NULL;
+}
+
+TEST_DECL(test_region_thread_local, r) {
+  IGNORE(r);
+  static const size_t THREADS = 8;
+  atomic_size_t destroyed = 0;
+  pthread_t threads[THREADS];
+  struct thread_local_arg args[THREADS];
+
+  region_t parent = r_create();
+  size_t i, j;
+  range_foreach(i, 0, THREADS) {
+    args[i] = new(struct thread_local_arg,
+		  .parent = parent, .destroyed = &destroyed);
+    pthread_create(&threads[i], NULL, thread_local_worker, &args[i]);
+  }
+  range_foreach(i, 0, THREADS) {
+    pthread_join(threads[i], NULL);
+    tassertf("r_thread_local stable", args[i].stable,
+	     "Thread %lu saw its child change", i);
+    range_foreach(j, 0, i) {
+      tassertf("r_thread_local distinct", args[i].child != args[j].child,
+	       "Threads %lu and %lu share a child", i, j);
+    }
+  }
+
+  r_destroy(parent);
+  tassert_eqf("r_thread_local destroyed", atomic_load(&destroyed), THREADS,
+	      "%lu destroyed", atomic_load(&destroyed));
+
+  return true;
+}
+
+TEST_DECL(test_region_reserved, r) {
+  IGNORE(r);
+  static const size_t RESERVE = 16lu << 20;
+
+  int huge;
+  range_foreach(huge, 0, 2) {
+    region_t vm = r_create_reserved(RESERVE, huge == 1);
+    tassertf("r_create_reserved", vm != NULL, "Reservation failed");
+    struct r_stats fresh = r_stats(vm);
+    tassertf("r_stats uncommitted", fresh.uncommitted > 0
+	     && fresh.reserved + fresh.uncommitted >= RESERVE,
+	     "%lu committed, %lu not", fresh.reserved, fresh.uncommitted);
+
+    struct size_node* prev = r_malloc(vm, struct size_node);
+    size_t i, count = RESERVE / sizeof(struct size_node) / 2;
+    range_foreach(i, 0, count) {
+      struct size_node* node = r_malloc(vm, struct size_node);
+      if (node != prev + 1) {
+	tassertf("reserved contiguous", false, "Node %lu at %p after %p",
+		 i, (void*) node, (void*) prev);
+      }
+      node->entry = i;
+      prev = node;
+    }
+    tcheckpoint("reserved contiguous");
+    struct r_stats half = r_stats(vm);
+    tassertf("r_stats committed", half.uncommitted < fresh.uncommitted
+	     && half.reserved + half.uncommitted == fresh.reserved + fresh.uncommitted,
+	     "%lu committed, %lu not", half.reserved, half.uncommitted);
+
+    // Past the reservation, the region carries on with ordinary blocks.
+    char* big = r_malloc_bytes(vm, RESERVE);
+    memset(big, 'x', RESERVE);
+    range_foreach(i, 0, count) {
+      r_malloc(vm, struct size_node)->entry = i;
+    }
+    tcheckpoint("reserved overflow");
+
+    r_reset(vm);
+    struct size_node* again = r_malloc(vm, struct size_node);
+    again->entry = 0;
+    tassert_eqf("reserved reset", again + 1, r_malloc(vm, struct size_node),
+		"Reset region is not contiguous");
+
+    r_destroy(vm);
+  }
+
+  return true;
+}
+
+TEST_DECL(test_region_realloc, r) {
+  size_t i, len = 16;
+  char* str = r_realloc(r, NULL, 0, len);
+  memset(str, 'a', len);
+
+  char* grown = r_realloc(r, str, len, 64);
+  tassert_eqf("r_realloc in place", grown, str, "Top allocation moved");
+  memset(grown + len, 'b', 64 - len);
+  len = 64;
+
+  char* shrunk = r_realloc(r, grown, len, 8);
+  tassert_eqf("r_realloc shrink", shrunk, grown, "Shrunk allocation moved");
+  tassert_eqf("r_realloc shrink reclaims", r_malloc_bytes(r, 1), str + 8,
+	      "Shrunk tail not reused");
+
+  // No longer on top, so growing has to copy.
+  char* copied = r_realloc(r, str, 8, 4096);
+  tassertf("r_realloc copy", copied != str && memcmp(copied, "aaaaaaaa", 8) == 0,
+	   "Copy lost contents");
+
+  double* xs = NULL;
+  size_t cap = 0;
+  range_foreach(i, 0, 100000) {
+    if (i == cap) {
+      xs = r_realloc(r, xs, cap * sizeof(double), (cap + 3) * 2 * sizeof(double));
+      cap = (cap + 3) * 2;
+    }
+    xs[i] = cast(double, i);
+    if (cast(uintptr_t, xs) % alignof(double) != 0 || xs[i / 2] != cast(double, i / 2)) {
+      tassertf("r_realloc grow", false, "Array corrupted at %lu", i);
+    }
+  }
+  tcheckpoint("r_realloc grow");
+
+  return true;
+}
+
+TEST_DECL(test_region_stats, r) {
+  size_t i;
+  struct r_stats empty = r_stats(r);
+
+  range_foreach(i, 0, 1000) {
+    r_malloc(r, struct size_node)->entry = i;
+  }
+  char* big = r_malloc_bytes(r, 100000);
+  big[0] = 'x';
+  *r_new_struct(r, count_destructor, size_t*) = &i;
+
+  region_t sub = r_create_subregion(r, 3);
+  range_foreach(i, 0, 100) {
+    r_malloc(sub, struct size_node)->entry = i;
+  }
+
+  struct r_stats stats = r_stats(r);
+  size_t expect = empty.requested + 1100 * sizeof(struct size_node) + 100000;
+  tassertf("r_stats requested", stats.requested >= expect
+	   && stats.requested <= expect + 256,
+	   "%lu requested, expected about %lu", stats.requested, expect);
+  tassert_eqf("r_stats oversized", stats.oversized, 1lu, "%lu", stats.oversized);
+  tassert_eqf("r_stats structs", stats.structs, 1lu, "%lu", stats.structs);
+  tassertf("r_stats blocks", stats.blocks > empty.blocks + 1,
+	   "%lu blocks", stats.blocks);
+  tassertf("r_stats reserved", stats.reserved >= stats.requested + stats.tail_waste,
+	   "%lu reserved for %lu", stats.reserved, stats.requested);
+
+  r_reset(r);
+  struct r_stats reset = r_stats(r);
+  tassertf("r_stats reset", reset.requested < empty.requested + 64
+	   && reset.high_water >= 1000 * sizeof(struct size_node) + 100000
+	   && reset.blocks == stats.blocks - 1 && reset.oversized == 0,
+	   "%lu requested, %lu high water, %lu blocks", reset.requested,
+	   reset.high_water, reset.blocks);
+
+  return true;
+}
+
+TEST_DECL(test_region_subregions, r) {
+  static const int N = 500;
+  region_t subs[N];
+  size_t destroyed = 0;
+  int i;
+
+  range_foreach(i, 0, N) {
+    subs[i] = r_create_subregion(r, i);
+    *r_new_struct(subs[i], count_destructor, size_t*) = &destroyed;
+  }
+  range_foreach(i, 0, N) {
+    if (r_get_subregion(r, i) != subs[i]) {
+      tassert_eqf("r_get_subregion", r_get_subregion(r, i), subs[i], "Tag %d", i);
+    }
+  }
+  tassertf("r_try_get_subregion missing", r_try_get_subregion(r, N) == NULL
+	   && r_try_get_subregion(r, -1) == NULL, "Found missing tag");
+
+  // A repeated tag hides the older subregion until it is extracted.
+  region_t shadow = r_create_subregion(r, 7);
+  tassert_eqf("r_get_subregion shadow", r_get_subregion(r, 7), shadow, "Older tag found");
+  tassert_eqf("r_extract_subregion shadow", r_extract_subregion(r, 7), shadow, "Older tag extracted");
+  tassert_eqf("r_get_subregion unshadowed", r_get_subregion(r, 7), subs[7], "Older tag lost");
+  r_destroy(shadow);
+
+  for (i = 0; i < N; i += 2) {
+    region_t extracted = r_extract_subregion(r, i);
+    tassert_eqf("r_extract_subregion", extracted, subs[i], "Tag %d", i);
+    r_destroy(extracted);
+  }
+  range_foreach(i, 0, N) {
+    region_t sub = r_try_get_subregion(r, i);
+    if (sub != ((i % 2 == 0) ? NULL : subs[i])) {
+      tassert_eqf("r_try_get_subregion", sub, subs[i], "Tag %d", i);
+    }
+  }
+  tassert_eqf("r_extract_subregion destroys", destroyed, cast(size_t, N / 2),
+	      "%lu destroyed", destroyed);
+
+  // Rewinding forgets the subregions created since, uncovering older ones.
+  struct r_mark mark = r_mark(r);
+  range_foreach(i, 0, N) {
+    r_create_subregion(r, 1);
+  }
+  tassertf("r_get_subregion newest", r_get_subregion(r, 1) != subs[1], "Older tag found");
+  r_rewind(r, mark);
+  tassert_eqf("r_rewind subregions", r_get_subregion(r, 1), subs[1], "Older tag lost");
+
+  r_reset(r);
+  tassert_eqf("r_reset subregions", destroyed, cast(size_t, N),
+	      "%lu destroyed", destroyed);
+  tassertf("r_reset forgets", r_try_get_subregion(r, 1) == NULL, "Tag found");
+
+  return true;
+}
+
+// Extracted entries stay linked, a parent which keeps attaching and extracting
+// a few subregions looks them up in its index instead of scanning them.
+TEST_DECL(test_region_subregion_churn, r) {
+  static const int N = 10000;
+  region_t parent = r_create();
+  r_add_subregion(r, -1, parent);
+  region_t kept = r_create_subregion(parent, 1);
+  int i;
+
+  range_foreach(i, 0, N) {
+    region_t sub = r_create_subregion(parent, 2);
+    if (r_extract_subregion(parent, 2) != sub) {
+      tassertf("r_extract_subregion", false, "Round %d", i);
+    }
+    r_destroy(sub);
+  }
+  tassertf("r_extract_subregion index", parent->sub_index != NULL
+	   && parent->num_subs == 1, "%lu live", parent->num_subs);
+  tassertf("r_get_subregion", r_get_subregion(parent, 1) == kept
+	   && r_try_get_subregion(parent, 2) == NULL, "Tags mixed up");
+
+  return true;
+}
 
 TEST_SUITE_DECL(region_test,
-  test_add(test_regions));
+  test_add(test_regions),
+  test_add(test_region_sizes),
+  test_add(test_region_alignment),
+  test_add(test_region_rewind),
+  test_add(test_region_cache),
+  test_add(test_region_thread_local),
+  test_add(test_region_reserved),
+  test_add(test_region_realloc),
+  test_add(test_region_stats),
+  test_add(test_region_subregions),
+  test_add(test_region_subregion_churn));
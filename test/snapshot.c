@@ -0,0 +1,110 @@
+#include "test.h"
+
+#include "region.h"
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+struct snap_word {
+  size_t len;
+  rel_t(char) chars;
+};
+
+struct snap_table {
+  size_t len;
+  rel_t(struct snap_word) words;
+  rel_t(struct snap_table) self;
+  rel_t(char) none;
+};
+
+static void snap_nothing(void* data) {
+  (void) data;
+}
+
+static void snap_path(char* path, size_t len, const char* name) {
+  snprintf(path, len, "/tmp/kc_snapshot_%s_%d", name, getpid());
+}
+
+TEST_DECL(test_snapshot_roundtrip, r) {
+  static const size_t WORDS = 20000;
+  char path[64];
+  snap_path(path, sizeof(path), "roundtrip");
+  size_t i;
+
+  region_t build = r_snapshot_create(64lu << 20);
+  struct snap_table* table = r_malloc(build, struct snap_table);
+  table->len = WORDS;
+  rel_set(&table->words, r_malloc_aligned(build, WORDS * sizeof(struct snap_word),
+					  alignof(struct snap_word)));
+  rel_set(&table->self, table);
+  rel_set(&table->none, NULL);
+  range_foreach(i, 0, WORDS) {
+    struct snap_word* word = &rel_get(&table->words)[i];
+    char buf[32];
+    word->len = cast(size_t, snprintf(buf, sizeof(buf), "word-%lu", i));
+    rel_set(&word->chars, memcpy(r_malloc_bytes(build, word->len), buf, word->len));
+  }
+
+  struct file_error err = r_snapshot_save(build, table, path);
+  tassert_error_no("r_snapshot_save", &err, file_error_print);
+  r_destroy(build);
+
+  const struct snap_table* loaded;
+  err = r_snapshot_load(r, path, &loaded);
+  unlink(path);
+  tassert_error_no("r_snapshot_load", &err, file_error_print);
+
+  tassert_eqf("rel_get self", rel_get(&loaded->self), loaded, "Root moved");
+  tassertf("rel_get NULL", rel_get(&loaded->none) == NULL, "Expected NULL");
+  tassert_eqf("snapshot len", loaded->len, WORDS, "%lu words", loaded->len);
+  range_foreach(i, 0, WORDS) {
+    const struct snap_word* word = &rel_get(&loaded->words)[i];
+    char buf[32];
+    size_t len = cast(size_t, snprintf(buf, sizeof(buf), "word-%lu", i));
+    if (word->len != len || memcmp(rel_get(&word->chars), buf, len) != 0) {
+      tassertf("snapshot word", false, "Word %lu: %.*s", i,
+	       cast(int, word->len), rel_get(&word->chars));
+    }
+  }
+
+  return true;
+}
+
+TEST_DECL(test_snapshot_errors, r) {
+  char path[64];
+  snap_path(path, sizeof(path), "errors");
+
+  region_t blocks = r_create();
+  size_t* root = r_malloc(blocks, size_t);
+  *root = 1;
+  struct file_error err = r_snapshot_save(blocks, root, path);
+  tassert_eqf("r_snapshot_save blocks", err.tag, FILE_ERROR_LAYOUT, "%d", err.tag);
+  r_destroy(blocks);
+
+  region_t structs = r_snapshot_create(1lu << 20);
+  root = r_malloc(structs, size_t);
+  *root = 1;
+  *r_new_struct(structs, snap_nothing, void*) = NULL;
+  err = r_snapshot_save(structs, root, path);
+  tassert_eqf("r_snapshot_save structs", err.tag, FILE_ERROR_LAYOUT, "%d", err.tag);
+  r_destroy(structs);
+
+  const size_t* loaded;
+  err = r_snapshot_load(r, path, &loaded);
+  tassertf("r_snapshot_load missing", err.tag == FILE_ERROR_IO && err.sys_errno != 0,
+	   "%d", err.tag);
+
+  FILE* file = fopen(path, "w");
+  fprintf(file, "not a snapshot, but long enough to have a header");
+  fclose(file);
+  err = r_snapshot_load(r, path, &loaded);
+  unlink(path);
+  tassert_eqf("r_snapshot_load format", err.tag, FILE_ERROR_FORMAT, "%d", err.tag);
+
+  return true;
+}
+
+TEST_SUITE_DECL(snapshot_test,
+  test_add(test_snapshot_roundtrip),
+  test_add(test_snapshot_errors));
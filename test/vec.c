@@ -30,5 +30,41 @@ TEST_DECL(test_vec_int, r) {
   return true;
 }
 
+TEST_DECL(test_r_vec_int, r) {
+  struct int_vec evens = r_vec_new(r, struct int_vec);
+  struct int_vec odds = r_vec_new_w_cap(r, struct int_vec, 0);
+
+  // Interleaved, so that growth alternates between in place and copying.
+  int i;
+  range_foreach(i, 0, 10000) {
+    if (i % 2 == 0) {
+      r_vec_push(r, &evens, i);
+    } else {
+      r_vec_push(r, &odds, i);
+    }
+  }
+  r_vec_reserve(r, &odds, 20000lu);
+
+  int* j;
+  int k;
+  vec_idx_foreach(j, k, &evens) {
+    if (*j != 2 * k) {
+      tassertf("r_vec_push", false, "%d vs. %d", 2 * k, *j);
+    }
+  }
+  vec_idx_foreach(j, k, &odds) {
+    if (*j != 2 * k + 1) {
+      tassertf("r_vec_push", false, "%d vs. %d", 2 * k + 1, *j);
+    }
+  }
+  tassert_eqf("r_vec_push", vec_len(&evens) + vec_len(&odds), 10000lu,
+	      "Lengths %lu + %lu", vec_len(&evens), vec_len(&odds));
+  tassert_eqf("r_vec_reserve", vec_cap(&odds), 20000lu,
+	      "Capacity %lu", vec_cap(&odds));
+
+  return true;
+}
+
 TEST_SUITE_DECL(vec_test,
-  test_add(test_vec_int));
+  test_add(test_vec_int),
+  test_add(test_r_vec_int));